@@ -31,9 +31,14 @@
 
 #include "../hid-ids.h"
 #include "hid-gcore.h"
+#include "hid-gcore-trace.h"
 
 #define G110_NAME "Logitech G110"
 
+static unsigned int ep1_interval = 10;
+module_param(ep1_interval, uint, 0644);
+MODULE_PARM_DESC(ep1_interval, "Polling interval of the extra keys in ms, applied at probe (default: 10)");
+
 /* Key defines */
 #define G110_KEYS 17
 
@@ -117,13 +122,27 @@ static const unsigned int g110_default_keymap[G110_KEYS] = {
 	KEY_KBDILLUMTOGGLE
 };
 
+/* Where the keys are in the input report */
+static const struct gcore_report_keys g110_report_keys[] = {
+	{ .offset = 1, .mask = 0xff, .scancode = 0 }, /* G1 through G8 */
+	{ .offset = 2, .mask = 0xff, .scancode = 8 }, /* G9 through MR */
+	{ .offset = 3, .mask = 0x01, .scancode = 16 }, /* Light */
+};
+
+static const struct gcore_report_layout g110_report_layout = {
+	.report_id = 2,
+	.keys = g110_report_keys,
+	.key_count = ARRAY_SIZE(g110_report_keys),
+	.mkeys = { 12, 13, 14 },
+};
+
 static void g110_led_mbtns_send(struct hid_device *hdev)
 {
 	struct g110_data *g110data = hid_get_g110data(hdev);
 
 	g110data->led_report->field[0]->value[0] = g110data->led_mbtns & 0xFF;
 
-	hid_hw_request(hdev, g110data->led_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g110data->led_report, HID_REQ_SET_REPORT);
 }
 
 static void g110_led_mbtns_brightness_set(struct led_classdev *led_cdev,
@@ -218,7 +237,7 @@ static void g110_led_bl_send(struct hid_device *hdev)
 		field1->value[0] = g110data->backlight_rb[0]>>4;
 	}
 
-	hid_hw_request(hdev, g110data->backlight_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g110data->backlight_report, HID_REQ_SET_REPORT);
 }
 
 static void g110_led_bl_brightness_set(struct led_classdev *led_cdev,
@@ -290,12 +309,38 @@ static const struct led_classdev g110_led_cdevs[] = {
 	},
 };
 
+/* The interval in effect, which the hcd may have rounded */
+static ssize_t g110_ep1_interval_show(struct device *dev,
+				     struct device_attribute *attr,
+				     char *buf)
+{
+	struct gcore_data *gdata = dev_get_gdata(dev);
+	struct g110_data *g110data = gdata->data;
+	unsigned int rate = gcore_int_urb_rate(g110data->ep1_urb);
+
+	return sprintf(buf, "%u\n", rate ? 1000 / rate : 0);
+}
+
+static ssize_t g110_ep1_rate_show(struct device *dev,
+				 struct device_attribute *attr,
+				 char *buf)
+{
+	struct gcore_data *gdata = dev_get_gdata(dev);
+	struct g110_data *g110data = gdata->data;
+
+	return sprintf(buf, "%u\n", gcore_int_urb_rate(g110data->ep1_urb));
+}
+
 static DEVICE_ATTR(name, 0664, gcore_name_show, gcore_name_store);
 static DEVICE_ATTR(minor, 0444, gcore_minor_show, NULL);
+static DEVICE_ATTR(ep1_interval, 0444, g110_ep1_interval_show, NULL);
+static DEVICE_ATTR(ep1_rate, 0444, g110_ep1_rate_show, NULL);
 
 static struct attribute *g110_attrs[] = {
 	&dev_attr_name.attr,
 	&dev_attr_minor.attr,
+	&dev_attr_ep1_interval.attr,
+	&dev_attr_ep1_rate.attr,
 	NULL,	 /* need to NULL terminate the list of attributes */
 };
 
@@ -304,57 +349,21 @@ static struct attribute_group g110_attr_group = {
 };
 
 
-static void g110_raw_event_process_input(struct hid_device *hdev,
-					 struct gcore_data *gdata,
-					 u8 *raw_data)
+/* The init handshake of the probe; true when the report was part of it */
+static bool g110_raw_event_handshake(struct gcore_data *gdata,
+				     struct hid_report *report, u8 *raw_data)
 {
-	struct input_dev *idev = gdata->input_dev;
-	int scancode;
-	int value;
-	int i;
-	int mask;
-
-	raw_data[3] &= 0xBF; /* bit 6 is always on */
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		/* Keys G1 through G8 */
-		scancode = i;
-		value = raw_data[1] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		/* Keys G9 through MR */
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		/* Key Light Only */
-		if (i == 0) {
-			scancode = i + 16;
-			value = raw_data[3] & mask;
-			gcore_input_report_key(gdata, scancode, value);
-		}
-
-	}
-
-	input_sync(idev);
-}
-
-static int g110_raw_event(struct hid_device *hdev,
-			  struct hid_report *report,
-			  u8 *raw_data, int size)
-{
-	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+	/*
+	 * On initialization receive a 258 byte message with
+	 * data = 6 0 255 255 255 255 255 255 255 255 ...
+	 */
 	struct g110_data *g110data = gdata->data;
 	unsigned long irq_flags;
-
-	/*
-	* On initialization receive a 258 byte message with
-	* data = 6 0 255 255 255 255 255 255 255 255 ...
-	*/
+	bool handled = false;
 
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
-	if (unlikely(g110data->ready_stages != G110_READY_STAGE_3)) {
+	if (g110data->ready_stages != G110_READY_STAGE_3) {
 		switch (report->id) {
 		case 6:
 			if (!(g110data->ready_stages & G110_READY_SUBSTAGE_1))
@@ -379,16 +388,28 @@ static int g110_raw_event(struct hid_device *hdev,
 		    g110data->ready_stages == G110_READY_STAGE_3)
 			complete_all(&g110data->ready);
 
-		spin_unlock_irqrestore(&gdata->lock, irq_flags);
-		return 1;
+		handled = true;
 	}
 
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
+	return handled;
+}
 
-	if (likely(report->id == 2)) {
-		g110_raw_event_process_input(hdev, gdata, raw_data);
+static int g110_raw_event(struct hid_device *hdev,
+			  struct hid_report *report,
+			  u8 *raw_data, int size)
+{
+	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+
+	trace_lg4l_raw_event(hdev, report->id, size);
+
+	/* No lock is taken once the handshake is done */
+	if (unlikely(!smp_load_acquire(&gdata->ready)) &&
+	    g110_raw_event_handshake(gdata, report, raw_data))
 		return 1;
-	}
+
+	if (likely(report->id == gdata->report_id))
+		return gcore_input_report(gdata, raw_data, size);
 
 	return 0;
 }
@@ -435,7 +456,7 @@ static void g110_feature_report_4_send(struct hid_device *hdev, int which)
 		return;
 	}
 
-	hid_hw_request(hdev, g110data->feature_report_4, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g110data->feature_report_4, HID_REQ_SET_REPORT);
 }
 
 
@@ -445,16 +466,15 @@ static void g110_ep1_urb_completion(struct urb *urb)
 	struct hid_device *hdev = urb->context;
 	struct gcore_data *gdata = hid_get_gdata(hdev);
 	struct g110_data *g110data = gdata->data;
-	struct input_dev *idev = gdata->input_dev;
-	int i;
+	ktime_t stamp = ktime_get();
 
-	for (i = 0; i < 8; i++)
-		gcore_input_report_key(gdata, 24+i,
-				       g110data->ep1keys[0]&(1<<i));
+	trace_lg4l_urb_complete(hdev, urb, urb->status);
 
-	input_sync(idev);
+	/* Key slot 3 follows the slots of g110_report_layout */
+	if (gcore_input_report_keys(gdata, 3, g110data->ep1keys[0], 24))
+		gcore_input_sync(gdata, stamp);
 
-	usb_submit_urb(urb, GFP_ATOMIC);
+	trace_lg4l_urb_submit(hdev, urb, usb_submit_urb(urb, GFP_ATOMIC));
 }
 
 static int g110_ep1_read(struct hid_device *hdev)
@@ -479,11 +499,13 @@ static int g110_ep1_read(struct hid_device *hdev)
 		return -EINVAL;
 
 	usb_fill_int_urb(g110data->ep1_urb, usb_dev, pipe, g110data->ep1keys, 2,
-			 g110_ep1_urb_completion, NULL, 10);
+			 g110_ep1_urb_completion, NULL,
+			 gcore_int_urb_interval(usb_dev, ep1_interval));
 	g110data->ep1_urb->context = hdev;
 	g110data->ep1_urb->actual_length = 0;
 
 	retval = usb_submit_urb(g110data->ep1_urb, GFP_KERNEL);
+	trace_lg4l_urb_submit(hdev, g110data->ep1_urb, retval);
 
 	return retval;
 }
@@ -560,7 +582,7 @@ static void wait_ready(struct gcore_data *gdata)
 	 * report 6 and wait for us to get a response.
 	 */
 	g110_feature_report_4_send(hdev, G110_REPORT_4_INIT);
-	hid_hw_request(hdev, g110data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g110data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g110data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -588,8 +610,8 @@ static void send_finalize_report(struct gcore_data *gdata)
 	 * trigger report 6 and wait for us to get a response.
 	 */
 	g110_feature_report_4_send(hdev, G110_REPORT_4_FINALIZE);
-	hid_hw_request(hdev, g110data->start_input_report, HID_REQ_GET_REPORT);
-	hid_hw_request(hdev, g110data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g110data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g110data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g110data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -605,6 +627,9 @@ static void send_finalize_report(struct gcore_data *gdata)
 		dbg_hid("%s stage 3 complete\n", gdata->name);
 	}
 
+	/* raw_event can do without the lock from now on */
+	smp_store_release(&gdata->ready, true);
+
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
 }
 
@@ -643,7 +668,7 @@ static int g110_probe(struct hid_device *hdev,
 		goto err_cleanup_g110data;
 	}
 
-	error = gcore_hid_open(gdata);
+	error = gcore_hid_open(gdata, &g110_report_layout);
 	if (error) {
 		dev_err(&hdev->dev,
 			"%s error opening hid device\n",
@@ -764,6 +789,7 @@ static struct hid_driver g110_driver = {
 	.probe			= g110_probe,
 	.remove			= g110_remove,
 	.raw_event		= g110_raw_event,
+	.input_mapping		= gcore_input_mapping,
 
 #ifdef CONFIG_PM
 	.resume			= g110_resume,
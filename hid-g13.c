@@ -32,6 +32,7 @@
 
 #include "../hid-ids.h"
 #include "hid-gcore.h"
+#include "hid-gcore-trace.h"
 #include "hid-gfb.h"
 
 #define G13_NAME "Logitech G13"
@@ -137,6 +138,29 @@ static const unsigned int g13_default_keymap[G13_KEYS] = {
 	BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, KEY_KBDILLUMTOGGLE
 };
 
+/* Where the keys and the stick are in the input report */
+static const struct gcore_report_keys g13_report_keys[] = {
+	{ .offset = 3, .mask = 0xff, .scancode = 0 }, /* G1 through G8 */
+	{ .offset = 4, .mask = 0xff, .scancode = 8 }, /* G9 through G16 */
+	{ .offset = 5, .mask = 0x3f, .scancode = 16 }, /* G17 through G22 */
+	{ .offset = 6, .mask = 0xff, .scancode = 22 }, /* FUNC through M3 */
+	{ .offset = 7, .mask = 0x1f, .scancode = 30 }, /* MR through LIGHT */
+};
+
+static const struct gcore_report_axis g13_report_axes[] = {
+	{ .offset = 1, .code = ABS_X },
+	{ .offset = 2, .code = ABS_Y },
+};
+
+static const struct gcore_report_layout g13_report_layout = {
+	.report_id = 1,
+	.keys = g13_report_keys,
+	.key_count = ARRAY_SIZE(g13_report_keys),
+	.axes = g13_report_axes,
+	.axis_count = ARRAY_SIZE(g13_report_axes),
+	.mkeys = { 27, 28, 29 },
+};
+
 static void g13_led_mbtns_send(struct hid_device *hdev)
 {
 	struct g13_data *g13data = hid_get_g13data(hdev);
@@ -146,7 +170,7 @@ static void g13_led_mbtns_send(struct hid_device *hdev)
 	g13data->led_report->field[0]->value[2] = 0x00;
 	g13data->led_report->field[0]->value[3] = 0x00;
 
-	hid_hw_request(hdev, g13data->led_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g13data->led_report, HID_REQ_SET_REPORT);
 }
 
 static void g13_led_mbtns_brightness_set(struct led_classdev *led_cdev,
@@ -210,7 +234,7 @@ static void g13_led_bl_send(struct hid_device *hdev)
 	field0->value[2] = g13data->backlight_rgb[2];
 	field0->value[3] = 0x00;
 
-	hid_hw_request(hdev, g13data->backlight_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g13data->backlight_report, HID_REQ_SET_REPORT);
 }
 
 static void g13_led_bl_brightness_set(struct led_classdev *led_cdev,
@@ -289,6 +313,9 @@ static const struct led_classdev g13_led_cdevs[LED_COUNT] = {
 static DEVICE_ATTR(fb_node, 0444, gfb_fb_node_show, NULL);
 static DEVICE_ATTR(fb_update_rate, 0664,
 		   gfb_fb_update_rate_show, gfb_fb_update_rate_store);
+static DEVICE_ATTR(fb_converter, 0664,
+		   gfb_fb_converter_show, gfb_fb_converter_store);
+static DEVICE_ATTR(fb_flip, 0664, gfb_fb_flip_show, gfb_fb_flip_store);
 static DEVICE_ATTR(name, 0664, gcore_name_show, gcore_name_store);
 static DEVICE_ATTR(minor, 0444, gcore_minor_show, NULL);
 
@@ -297,6 +324,8 @@ static struct attribute *g13_attrs[] = {
 	&dev_attr_minor.attr,
 	&dev_attr_fb_update_rate.attr,
 	&dev_attr_fb_node.attr,
+	&dev_attr_fb_converter.attr,
+	&dev_attr_fb_flip.attr,
 	NULL,	/* need to NULL terminate the list of attributes */
 };
 
@@ -305,66 +334,21 @@ static struct attribute_group g13_attr_group = {
 };
 
 
-static void g13_raw_event_process_input(struct hid_device *hdev,
-					struct gcore_data *gdata,
-					u8 *raw_data)
-{
-	struct input_dev *idev = gdata->input_dev;
-	int scancode;
-	int value;
-	int i;
-	int mask;
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		/* Keys G1 through G8 */
-		scancode = i;
-		value = raw_data[3] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		/* Keys G9 through G16 */
-		scancode = i + 8;
-		value = raw_data[4] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		/* Keys G17 through G22 */
-		scancode = i + 16;
-		value = raw_data[5] & mask;
-		if (i <= 5)
-			gcore_input_report_key(gdata, scancode, value);
-
-		/* Keys FUNC through M3 */
-		scancode = i + 22;
-		value = raw_data[6] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		/* Keys MR through LIGHT */
-		scancode = i + 30;
-		value = raw_data[7] & mask;
-		if (i <= 4)
-			gcore_input_report_key(gdata, scancode, value);
-	}
-
-	input_report_abs(idev, ABS_X, raw_data[1]);
-	input_report_abs(idev, ABS_Y, raw_data[2]);
-	input_sync(idev);
-}
-
-static int g13_raw_event(struct hid_device *hdev,
-			 struct hid_report *report,
-			 u8 *raw_data, int size)
+/* The init handshake of the probe; true when the report was part of it */
+static bool g13_raw_event_handshake(struct gcore_data *gdata,
+				    struct hid_report *report, u8 *raw_data)
 {
-	unsigned long irq_flags;
-
 	/*
 	 * On initialization receive a 258 byte message with
 	 * data = 6 0 255 255 255 255 255 255 255 255 ...
 	 */
-	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
 	struct g13_data *g13data = gdata->data;
+	unsigned long irq_flags;
+	bool handled = false;
 
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
-	if (unlikely(g13data->ready_stages != G13_READY_STAGE_3)) {
+	if (g13data->ready_stages != G13_READY_STAGE_3) {
 		switch (report->id) {
 		case 6:
 			if (!(g13data->ready_stages & G13_READY_SUBSTAGE_1))
@@ -390,16 +374,28 @@ static int g13_raw_event(struct hid_device *hdev,
 		    g13data->ready_stages == G13_READY_STAGE_3)
 			complete_all(&g13data->ready);
 
-		spin_unlock_irqrestore(&gdata->lock, irq_flags);
-		return 1;
+		handled = true;
 	}
 
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
+	return handled;
+}
 
-	if (likely(report->id == 1)) {
-		g13_raw_event_process_input(hdev, gdata, raw_data);
+static int g13_raw_event(struct hid_device *hdev,
+			 struct hid_report *report,
+			 u8 *raw_data, int size)
+{
+	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+
+	trace_lg4l_raw_event(hdev, report->id, size);
+
+	/* No lock is taken once the handshake is done */
+	if (unlikely(!smp_load_acquire(&gdata->ready)) &&
+	    g13_raw_event_handshake(gdata, report, raw_data))
 		return 1;
-	}
+
+	if (likely(report->id == gdata->report_id))
+		return gcore_input_report(gdata, raw_data, size);
 
 	return 0;
 }
@@ -448,7 +444,7 @@ static void g13_feature_report_4_send(struct hid_device *hdev, int which)
 		return;
 	}
 
-	hid_hw_request(hdev, g13data->feature_report_4, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g13data->feature_report_4, HID_REQ_SET_REPORT);
 }
 
 static int read_feature_reports(struct gcore_data *gdata)
@@ -552,7 +548,7 @@ static void wait_ready(struct gcore_data *gdata)
 	 * report 6 and wait for us to get a response.
 	 */
 	g13_feature_report_4_send(hdev, G13_REPORT_4_INIT);
-	hid_hw_request(hdev, g13data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g13data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g13data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -580,8 +576,8 @@ static void send_finalize_report(struct gcore_data *gdata)
 	 * trigger report 6 and wait for us to get a response.
 	 */
 	g13_feature_report_4_send(hdev, G13_REPORT_4_FINALIZE);
-	hid_hw_request(hdev, g13data->start_input_report, HID_REQ_GET_REPORT);
-	hid_hw_request(hdev, g13data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g13data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g13data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g13data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -595,6 +591,9 @@ static void send_finalize_report(struct gcore_data *gdata)
 		dbg_hid(G13_NAME " stage 3 complete\n");
 	}
 
+	/* raw_event can do without the lock from now on */
+	smp_store_release(&gdata->ready, true);
+
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
 }
 
@@ -624,7 +623,7 @@ static int g13_probe(struct hid_device *hdev,
 	gdata->data = g13data;
 	init_completion(&g13data->ready);
 
-	error = gcore_hid_open(gdata);
+	error = gcore_hid_open(gdata, &g13_report_layout);
 	if (error) {
 		dev_err(&hdev->dev,
 			"%s error opening hid device\n",
@@ -748,6 +747,7 @@ static struct hid_driver g13_driver = {
 	.probe			= g13_probe,
 	.remove			= g13_remove,
 	.raw_event		= g13_raw_event,
+	.input_mapping		= gcore_input_mapping,
 
 #ifdef CONFIG_PM
 	.resume			= g13_resume,
@@ -32,6 +32,7 @@
 
 #include "../hid-ids.h"
 #include "hid-gcore.h"
+#include "hid-gcore-trace.h"
 #include "hid-gfb.h"
 
 #define G15_NAME "Logitech G15"
@@ -198,6 +199,26 @@ static const unsigned int g15_default_keymap[G15_KEYS] = {
 	KEY_OK, /* S1 */
 };
 
+/* Where the keys are in the input report */
+static const struct gcore_report_keys g15_report_keys[] = {
+	{ .offset = 1, .mask = 0xff, .scancode = 0 },
+	{ .offset = 2, .mask = 0xff, .scancode = 8 },
+	{ .offset = 3, .mask = 0xff, .scancode = 16 },
+	/* bit 0 turns on and off at random */
+	{ .offset = 4, .mask = 0xfe, .scancode = 24 },
+	{ .offset = 5, .mask = 0xff, .scancode = 32 },
+	{ .offset = 6, .mask = 0xff, .scancode = 40 },
+	{ .offset = 7, .mask = 0xff, .scancode = 48 },
+	{ .offset = 8, .mask = 0xff, .scancode = 56 },
+};
+
+static const struct gcore_report_layout g15_report_layout = {
+	.report_id = 2,
+	.keys = g15_report_keys,
+	.key_count = ARRAY_SIZE(g15_report_keys),
+	.mkeys = { 40, 49, 58 },
+};
+
 
 static void g15_led_send(struct hid_device *hdev, u8 msg, u8 value1, u8 value2)
 {
@@ -207,7 +228,7 @@ static void g15_led_send(struct hid_device *hdev, u8 msg, u8 value1, u8 value2)
 	g15data->led_report->field[0]->value[1] = value1;
 	g15data->led_report->field[0]->value[2] = value2;
 
-	hid_hw_request(hdev, g15data->led_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g15data->led_report, HID_REQ_SET_REPORT);
 }
 
 static void g15_led_mbtns_send(struct hid_device *hdev)
@@ -360,6 +381,9 @@ static const struct led_classdev g15_led_cdevs[7] = {
 static DEVICE_ATTR(fb_node, 0444, gfb_fb_node_show, NULL);
 static DEVICE_ATTR(fb_update_rate, 0664,
 		   gfb_fb_update_rate_show, gfb_fb_update_rate_store);
+static DEVICE_ATTR(fb_converter, 0664,
+		   gfb_fb_converter_show, gfb_fb_converter_store);
+static DEVICE_ATTR(fb_flip, 0664, gfb_fb_flip_show, gfb_fb_flip_store);
 static DEVICE_ATTR(name, 0664, gcore_name_show, gcore_name_store);
 static DEVICE_ATTR(minor, 0444, gcore_minor_show, NULL);
 
@@ -368,6 +392,8 @@ static struct attribute *g15_attrs[] = {
 	&dev_attr_minor.attr,
 	&dev_attr_fb_update_rate.attr,
 	&dev_attr_fb_node.attr,
+	&dev_attr_fb_converter.attr,
+	&dev_attr_fb_flip.attr,
 	NULL,	/* need to NULL terminate the list of attributes */
 };
 
@@ -375,70 +401,21 @@ static struct attribute_group g15_attr_group = {
 	.attrs = g15_attrs,
 };
 
-static void g15_raw_event_process_input(struct hid_device *hdev,
-					struct gcore_data *gdata,
-					u8 *raw_data)
-{
-	struct input_dev *idev = gdata->input_dev;
-	int scancode;
-	int value;
-	int i;
-	int mask;
-
-	raw_data[4] &= 0xFE; /* This bit turns on and off at random */
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		scancode = i;
-		value = raw_data[1] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 16;
-		value = raw_data[3] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 24;
-		value = raw_data[4] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 32;
-		value = raw_data[5] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 40;
-		value = raw_data[6] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 48;
-		value = raw_data[7] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 56;
-		value = raw_data[8] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-	}
-
-	input_sync(idev);
-}
-
-static int g15_raw_event(struct hid_device *hdev,
-			 struct hid_report *report,
-			 u8 *raw_data, int size)
+/* The init handshake of the probe; true when the report was part of it */
+static bool g15_raw_event_handshake(struct gcore_data *gdata,
+				    struct hid_report *report, u8 *raw_data)
 {
 	/*
-	* On initialization receive a 258 byte message with
-	* data = 6 0 255 255 255 255 255 255 255 255 ...
-	*/
-	unsigned long irq_flags;
-	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+	 * On initialization receive a 258 byte message with
+	 * data = 6 0 255 255 255 255 255 255 255 255 ...
+	 */
 	struct g15_data *g15data = gdata->data;
+	unsigned long irq_flags;
+	bool handled = false;
 
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
-	if (unlikely(g15data->ready_stages != G15_READY_STAGE_3)) {
+	if (g15data->ready_stages != G15_READY_STAGE_3) {
 		switch (report->id) {
 		case 6:
 			if (!(g15data->ready_stages & G15_READY_SUBSTAGE_1))
@@ -464,16 +441,28 @@ static int g15_raw_event(struct hid_device *hdev,
 		    g15data->ready_stages == G15_READY_STAGE_3)
 			complete_all(&g15data->ready);
 
-		spin_unlock_irqrestore(&gdata->lock, irq_flags);
-		return 1;
+		handled = true;
 	}
 
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
+	return handled;
+}
+
+static int g15_raw_event(struct hid_device *hdev,
+			 struct hid_report *report,
+			 u8 *raw_data, int size)
+{
+	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+
+	trace_lg4l_raw_event(hdev, report->id, size);
 
-	if (likely(report->id == 2)) {
-		g15_raw_event_process_input(hdev, gdata, raw_data);
+	/* No lock is taken once the handshake is done */
+	if (unlikely(!smp_load_acquire(&gdata->ready)) &&
+	    g15_raw_event_handshake(gdata, report, raw_data))
 		return 1;
-	}
+
+	if (likely(report->id == gdata->report_id))
+		return gcore_input_report(gdata, raw_data, size);
 
 	return 0;
 }
@@ -521,7 +510,7 @@ static void g15_feature_report_4_send(struct hid_device *hdev, int which)
 		return;
 	}
 
-	hid_hw_request(hdev, g15data->feature_report_4, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g15data->feature_report_4, HID_REQ_SET_REPORT);
 }
 
 static int read_feature_reports(struct gcore_data *gdata)
@@ -621,7 +610,7 @@ static void wait_ready(struct gcore_data *gdata)
 	 * report 6 and wait for us to get a response.
 	 */
 	g15_feature_report_4_send(hdev, G15_REPORT_4_INIT);
-	hid_hw_request(hdev, g15data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g15data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g15data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -649,8 +638,8 @@ static void send_finalize_report(struct gcore_data *gdata)
 	 * trigger report 6 and wait for us to get a response.
 	 */
 	g15_feature_report_4_send(hdev, G15_REPORT_4_FINALIZE);
-	hid_hw_request(hdev, g15data->start_input_report, HID_REQ_GET_REPORT);
-	hid_hw_request(hdev, g15data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g15data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g15data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g15data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -664,6 +653,9 @@ static void send_finalize_report(struct gcore_data *gdata)
 		dbg_hid(G15_NAME " stage 3 complete\n");
 	}
 
+	/* raw_event can do without the lock from now on */
+	smp_store_release(&gdata->ready, true);
+
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
 }
 
@@ -691,7 +683,7 @@ static int g15_probe(struct hid_device *hdev,
 	gdata->data = g15data;
 	init_completion(&g15data->ready);
 
-	error = gcore_hid_open(gdata);
+	error = gcore_hid_open(gdata, &g15_report_layout);
 	if (error) {
 		dev_err(&hdev->dev,
 			"%s error opening hid device\n",
@@ -803,6 +795,7 @@ static struct hid_driver g15_driver = {
 	.probe			= g15_probe,
 	.remove			= g15_remove,
 	.raw_event		= g15_raw_event,
+	.input_mapping		= gcore_input_mapping,
 
 #ifdef CONFIG_PM
 	.resume			= g15_resume,
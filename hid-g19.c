@@ -32,10 +32,15 @@
 
 #include "../hid-ids.h"
 #include "hid-gcore.h"
+#include "hid-gcore-trace.h"
 #include "hid-gfb.h"
 
 #define G19_NAME "Logitech G19"
 
+static unsigned int ep1_interval = 10;
+module_param(ep1_interval, uint, 0644);
+MODULE_PARM_DESC(ep1_interval, "Polling interval of the extra keys in ms, applied at probe (default: 10)");
+
 /* Key defines */
 #define G19_KEYS 32
 
@@ -144,13 +149,30 @@ static const unsigned int g19_default_keymap[G19_KEYS] = {
 	KEY_RIGHT, KEY_LEFT, KEY_DOWN, KEY_UP,
 };
 
+/* Where the keys are in the input report */
+static const struct gcore_report_keys g19_report_keys[] = {
+	/* G1 through G8 */
+	{ .offset = 1, .mask = 0xff, .scancode = 0 },
+	/* G9 through G12, M1 through MR */
+	{ .offset = 2, .mask = 0xff, .scancode = 8 },
+	/* G17 through G22, bit 6 is always on */
+	{ .offset = 3, .mask = 0xbf, .scancode = 16 },
+};
+
+static const struct gcore_report_layout g19_report_layout = {
+	.report_id = 2,
+	.keys = g19_report_keys,
+	.key_count = ARRAY_SIZE(g19_report_keys),
+	.mkeys = { 12, 13, 14 },
+};
+
 static void g19_led_mbtns_send(struct hid_device *hdev)
 {
 	struct g19_data *g19data = hid_get_g19data(hdev);
 
 	g19data->led_report->field[0]->value[0] = g19data->led_mbtns & 0xFF;
 
-	hid_hw_request(hdev, g19data->led_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g19data->led_report, HID_REQ_SET_REPORT);
 }
 
 static void g19_led_mbtns_brightness_set(struct led_classdev *led_cdev,
@@ -213,7 +235,7 @@ static void g19_led_bl_send(struct hid_device *hdev)
 	field0->value[1] = g19data->backlight_rgb[1];
 	field0->value[2] = g19data->backlight_rgb[2];
 
-	hid_hw_request(hdev, g19data->backlight_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g19data->backlight_report, HID_REQ_SET_REPORT);
 }
 
 static void g19_led_bl_brightness_set(struct led_classdev *led_cdev,
@@ -362,14 +384,50 @@ static const struct led_classdev g19_led_cdevs[] = {
 static DEVICE_ATTR(fb_node, 0444, gfb_fb_node_show, NULL);
 static DEVICE_ATTR(fb_update_rate, 0664,
 		   gfb_fb_update_rate_show, gfb_fb_update_rate_store);
+static DEVICE_ATTR(fb_converter, 0664,
+		   gfb_fb_converter_show, gfb_fb_converter_store);
+static DEVICE_ATTR(fb_flip, 0664, gfb_fb_flip_show, gfb_fb_flip_store);
+static DEVICE_ATTR(fb_mirror, 0664, gfb_fb_mirror_show, gfb_fb_mirror_store);
+static DEVICE_ATTR(fb_span, 0664, gfb_fb_span_show, gfb_fb_span_store);
+
+/* The interval in effect, which the hcd may have rounded */
+static ssize_t g19_ep1_interval_show(struct device *dev,
+				     struct device_attribute *attr,
+				     char *buf)
+{
+	struct gcore_data *gdata = dev_get_gdata(dev);
+	struct g19_data *g19data = gdata->data;
+	unsigned int rate = gcore_int_urb_rate(g19data->ep1_urb);
+
+	return sprintf(buf, "%u\n", rate ? 1000 / rate : 0);
+}
+
+static ssize_t g19_ep1_rate_show(struct device *dev,
+				 struct device_attribute *attr,
+				 char *buf)
+{
+	struct gcore_data *gdata = dev_get_gdata(dev);
+	struct g19_data *g19data = gdata->data;
+
+	return sprintf(buf, "%u\n", gcore_int_urb_rate(g19data->ep1_urb));
+}
+
 static DEVICE_ATTR(name, 0664, gcore_name_show, gcore_name_store);
 static DEVICE_ATTR(minor, 0444, gcore_minor_show, NULL);
+static DEVICE_ATTR(ep1_interval, 0444, g19_ep1_interval_show, NULL);
+static DEVICE_ATTR(ep1_rate, 0444, g19_ep1_rate_show, NULL);
 
 static struct attribute *g19_attrs[] = {
 	&dev_attr_name.attr,
 	&dev_attr_minor.attr,
+	&dev_attr_ep1_interval.attr,
+	&dev_attr_ep1_rate.attr,
 	&dev_attr_fb_update_rate.attr,
 	&dev_attr_fb_node.attr,
+	&dev_attr_fb_converter.attr,
+	&dev_attr_fb_flip.attr,
+	&dev_attr_fb_mirror.attr,
+	&dev_attr_fb_span.attr,
 	NULL,	 /* need to NULL terminate the list of attributes */
 };
 
@@ -378,52 +436,21 @@ static struct attribute_group g19_attr_group = {
 };
 
 
-static void g19_raw_event_process_input(struct hid_device *hdev,
-					struct gcore_data *gdata,
-					u8 *raw_data)
-{
-	int scancode, value;
-	int i, mask;
-
-	raw_data[3] &= 0xBF; /* bit 6 is always on */
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		/* Keys G1 through G8 */
-		scancode = i;
-		value = raw_data[1] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		/* Keys G9 through G12, M1 through MR */
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		/* Keys G17 through G22 */
-		scancode = i + 16;
-		value = raw_data[3] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-	}
-
-	input_sync(gdata->input_dev);
-}
-
-static int g19_raw_event(struct hid_device *hdev,
-			 struct hid_report *report,
-			 u8 *raw_data, int size)
+/* The init handshake of the probe; true when the report was part of it */
+static bool g19_raw_event_handshake(struct gcore_data *gdata,
+				    struct hid_report *report, u8 *raw_data)
 {
-	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+	/*
+	 * On initialization receive a 258 byte message with
+	 * data = 6 0 255 255 255 255 255 255 255 255 ...
+	 */
 	struct g19_data *g19data = gdata->data;
 	unsigned long irq_flags;
-
-	/*
-	* On initialization receive a 258 byte message with
-	* data = 6 0 255 255 255 255 255 255 255 255 ...
-	*/
-
+	bool handled = false;
 
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
-	if (unlikely(g19data->ready_stages != G19_READY_STAGE_3)) {
+	if (g19data->ready_stages != G19_READY_STAGE_3) {
 		switch (report->id) {
 		case 6:
 			if (!(g19data->ready_stages & G19_READY_SUBSTAGE_1))
@@ -449,16 +476,28 @@ static int g19_raw_event(struct hid_device *hdev,
 		    g19data->ready_stages == G19_READY_STAGE_3)
 			complete_all(&g19data->ready);
 
-		spin_unlock_irqrestore(&gdata->lock, irq_flags);
-		return 1;
+		handled = true;
 	}
 
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
+	return handled;
+}
 
-	if (likely(report->id == 2)) {
-		g19_raw_event_process_input(hdev, gdata, raw_data);
+static int g19_raw_event(struct hid_device *hdev,
+			 struct hid_report *report,
+			 u8 *raw_data, int size)
+{
+	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+
+	trace_lg4l_raw_event(hdev, report->id, size);
+
+	/* No lock is taken once the handshake is done */
+	if (unlikely(!smp_load_acquire(&gdata->ready)) &&
+	    g19_raw_event_handshake(gdata, report, raw_data))
 		return 1;
-	}
+
+	if (likely(report->id == gdata->report_id))
+		return gcore_input_report(gdata, raw_data, size);
 
 	return 0;
 }
@@ -496,15 +535,15 @@ static void g19_ep1_urb_completion(struct urb *urb)
 		struct hid_device *hdev = urb->context;
 		struct gcore_data *gdata = hid_get_gdata(hdev);
 		struct g19_data *g19data = gdata->data;
-		int i;
+		ktime_t stamp = ktime_get();
 
-		for (i = 0; i < 8; i++)
-			gcore_input_report_key(gdata, 24+i,
-					       g19data->ep1keys[0]&(1<<i));
+		trace_lg4l_urb_complete(hdev, urb, urb->status);
 
-		input_sync(gdata->input_dev);
+		/* Key slot 3 follows the slots of g19_report_layout */
+		if (gcore_input_report_keys(gdata, 3, g19data->ep1keys[0], 24))
+			gcore_input_sync(gdata, stamp);
 
-		usb_submit_urb(urb, GFP_ATOMIC);
+		trace_lg4l_urb_submit(hdev, urb, usb_submit_urb(urb, GFP_ATOMIC));
 	}
 }
 
@@ -526,7 +565,7 @@ static void g19_feature_report_4_send(struct hid_device *hdev, int which)
 		return;
 	}
 
-	hid_hw_request(hdev, g19data->feature_report_4, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g19data->feature_report_4, HID_REQ_SET_REPORT);
 }
 
 static int read_feature_reports(struct gcore_data *gdata)
@@ -603,7 +642,7 @@ static void wait_ready(struct gcore_data *gdata)
 	 * report 6 and wait for us to get a response.
 	 */
 	g19_feature_report_4_send(hdev, G19_REPORT_4_INIT);
-	hid_hw_request(hdev, g19data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g19data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g19data->ready, HZ);
 
 	/* Protect g19data->ready_stages */
@@ -631,8 +670,8 @@ static void send_finalize_report(struct gcore_data *gdata)
 	 * trigger report 6 and wait for us to get a response.
 	 */
 	g19_feature_report_4_send(hdev, G19_REPORT_4_FINALIZE);
-	hid_hw_request(hdev, g19data->start_input_report, HID_REQ_GET_REPORT);
-	hid_hw_request(hdev, g19data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g19data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g19data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g19data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -648,6 +687,9 @@ static void send_finalize_report(struct gcore_data *gdata)
 		dbg_hid("%s stage 3 complete\n", gdata->name);
 	}
 
+	/* raw_event can do without the lock from now on */
+	smp_store_release(&gdata->ready, true);
+
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
 }
 
@@ -673,11 +715,13 @@ static int g19_ep1_read(struct hid_device *hdev)
 		return -EINVAL;
 
 	usb_fill_int_urb(g19data->ep1_urb, usb_dev, pipe, g19data->ep1keys, 2,
-			 g19_ep1_urb_completion, NULL, 10);
+			 g19_ep1_urb_completion, NULL,
+			 gcore_int_urb_interval(usb_dev, ep1_interval));
 	g19data->ep1_urb->context = hdev;
 	g19data->ep1_urb->actual_length = 0;
 
 	retval = usb_submit_urb(g19data->ep1_urb, GFP_KERNEL);
+	trace_lg4l_urb_submit(hdev, g19data->ep1_urb, retval);
 
 	return retval;
 }
@@ -717,7 +761,7 @@ static int g19_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		goto err_cleanup_g19data;
 	}
 
-	error = gcore_hid_open(gdata);
+	error = gcore_hid_open(gdata, &g19_report_layout);
 	if (error) {
 		dev_err(&hdev->dev,
 			"%s error opening hid device\n",
@@ -855,6 +899,7 @@ static struct hid_driver g19_driver = {
 	.probe			= g19_probe,
 	.remove			= g19_remove,
 	.raw_event		= g19_raw_event,
+	.input_mapping		= gcore_input_mapping,
 
 #ifdef CONFIG_PM
 	.resume			= g19_resume,
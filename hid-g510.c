@@ -32,6 +32,7 @@
 
 #include "../hid-ids.h"
 #include "hid-gcore.h"
+#include "hid-gcore-trace.h"
 #include "hid-gfb.h"
 
 #define G510_NAME "Logitech G510"
@@ -137,6 +138,22 @@ static const unsigned int g510_default_keymap[G510_KEYS] = {
 	KEY_UNKNOWN
 };
 
+/* Where the keys are in the input report */
+static const struct gcore_report_keys g510_report_keys[] = {
+	{ .offset = 1, .mask = 0xff, .scancode = 0 },
+	{ .offset = 2, .mask = 0xff, .scancode = 8 },
+	{ .offset = 3, .mask = 0xff, .scancode = 16 },
+	/* like on the G15, bit 0 may flicker */
+	{ .offset = 4, .mask = 0xfe, .scancode = 24 },
+};
+
+static const struct gcore_report_layout g510_report_layout = {
+	.report_id = 2,
+	.keys = g510_report_keys,
+	.key_count = ARRAY_SIZE(g510_report_keys),
+	.mkeys = { 20, 21, 22 },
+};
+
 static void g510_led_send(struct hid_device *hdev, u8 msg, u8 value1, u8 value2)
 {
 	struct g510_data *g510data = hid_get_g510data(hdev);
@@ -145,7 +162,7 @@ static void g510_led_send(struct hid_device *hdev, u8 msg, u8 value1, u8 value2)
 	g510data->led_report->field[0]->value[1] = value1;
 	g510data->led_report->field[0]->value[2] = value2;
 
-	hid_hw_request(hdev, g510data->led_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g510data->led_report, HID_REQ_SET_REPORT);
 }
 
 static void g510_led_mbtns_send(struct hid_device *hdev)
@@ -217,7 +234,7 @@ static void g510_led_bl_send(struct hid_device *hdev)
 	field0->value[2] = g510data->backlight_rgb[2];
 	field0->value[3] = 0x00;
 
-	hid_hw_request(hdev, g510data->backlight_report, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g510data->backlight_report, HID_REQ_SET_REPORT);
 }
 
 static void g510_led_bl_brightness_set(struct led_classdev *led_cdev,
@@ -296,6 +313,9 @@ static const struct led_classdev g510_led_cdevs[LED_COUNT] = {
 static DEVICE_ATTR(fb_node, 0444, gfb_fb_node_show, NULL);
 static DEVICE_ATTR(fb_update_rate, 0664,
 		   gfb_fb_update_rate_show, gfb_fb_update_rate_store);
+static DEVICE_ATTR(fb_converter, 0664,
+		   gfb_fb_converter_show, gfb_fb_converter_store);
+static DEVICE_ATTR(fb_flip, 0664, gfb_fb_flip_show, gfb_fb_flip_store);
 static DEVICE_ATTR(name, 0664, gcore_name_show, gcore_name_store);
 static DEVICE_ATTR(minor, 0444, gcore_minor_show, NULL);
 
@@ -308,6 +328,8 @@ static struct attribute *g510_attrs[] = {
 	&dev_attr_minor.attr,
 	&dev_attr_fb_update_rate.attr,
 	&dev_attr_fb_node.attr,
+	&dev_attr_fb_converter.attr,
+	&dev_attr_fb_flip.attr,
 	NULL,	/* need to NULL terminate the list of attributes */
 };
 
@@ -315,58 +337,21 @@ static struct attribute_group g510_attr_group = {
 	.attrs = g510_attrs,
 };
 
-static void g510_raw_event_process_input(struct hid_device *hdev,
-	struct gcore_data *gdata,
-	u8 *raw_data)
+/* The init handshake of the probe; true when the report was part of it */
+static bool g510_raw_event_handshake(struct gcore_data *gdata,
+				     struct hid_report *report, u8 *raw_data)
 {
-	struct input_dev *idev = gdata->input_dev;
-	int scancode;
-	int value;
-	int i;
-	int mask;
-
 	/*
-	 * This bit turns on and off at random.
-	 * G510: does it do this? seems safe to leave here in case
+	 * On initialization receive a 258 byte message with
+	 * data = 6 0 255 255 255 255 255 255 255 255 ...
 	 */
-	raw_data[4] &= 0xFE;
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		scancode = i;
-		value = raw_data[1] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 16;
-		value = raw_data[3] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-
-		scancode = i + 24;
-		value = raw_data[4] & mask;
-		gcore_input_report_key(gdata, scancode, value);
-	}
-
-	input_sync(idev);
-}
-
-static int g510_raw_event(struct hid_device *hdev,
-			  struct hid_report *report,
-			  u8 *raw_data, int size)
-{
-	/*
-	* On initialization receive a 258 byte message with
-	* data = 6 0 255 255 255 255 255 255 255 255 ...
-	*/
-	unsigned long irq_flags;
-	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
 	struct g510_data *g510data = gdata->data;
+	unsigned long irq_flags;
+	bool handled = false;
 
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
-	if (unlikely(g510data->ready_stages != G510_READY_STAGE_3)) {
+	if (g510data->ready_stages != G510_READY_STAGE_3) {
 		switch (report->id) {
 		case 6:
 			if (!(g510data->ready_stages & G510_READY_SUBSTAGE_1))
@@ -392,16 +377,28 @@ static int g510_raw_event(struct hid_device *hdev,
 		    g510data->ready_stages == G510_READY_STAGE_3)
 			complete_all(&g510data->ready);
 
-		spin_unlock_irqrestore(&gdata->lock, irq_flags);
-		return 1;
+		handled = true;
 	}
 
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
+	return handled;
+}
 
-	if (likely(report->id == 2)) {
-		g510_raw_event_process_input(hdev, gdata, raw_data);
+static int g510_raw_event(struct hid_device *hdev,
+			  struct hid_report *report,
+			  u8 *raw_data, int size)
+{
+	struct gcore_data *gdata = dev_get_gdata(&hdev->dev);
+
+	trace_lg4l_raw_event(hdev, report->id, size);
+
+	/* No lock is taken once the handshake is done */
+	if (unlikely(!smp_load_acquire(&gdata->ready)) &&
+	    g510_raw_event_handshake(gdata, report, raw_data))
 		return 1;
-	}
+
+	if (likely(report->id == gdata->report_id))
+		return gcore_input_report(gdata, raw_data, size);
 
 	return 0;
 }
@@ -448,7 +445,7 @@ static void g510_feature_report_4_send(struct hid_device *hdev, int which)
 		return;
 	}
 
-	hid_hw_request(hdev, g510data->feature_report_4, HID_REQ_SET_REPORT);
+	gcore_hw_request(hdev, g510data->feature_report_4, HID_REQ_SET_REPORT);
 }
 
 static int read_feature_reports(struct gcore_data *gdata)
@@ -552,7 +549,7 @@ static void wait_ready(struct gcore_data *gdata)
 	 * report 6 and wait for us to get a response.
 	 */
 	g510_feature_report_4_send(hdev, G510_REPORT_4_INIT);
-	hid_hw_request(hdev, g510data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g510data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g510data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -580,8 +577,8 @@ static void send_finalize_report(struct gcore_data *gdata)
 	 * trigger report 6 and wait for us to get a response.
 	 */
 	g510_feature_report_4_send(hdev, G510_REPORT_4_FINALIZE);
-	hid_hw_request(hdev, g510data->start_input_report, HID_REQ_GET_REPORT);
-	hid_hw_request(hdev, g510data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g510data->start_input_report, HID_REQ_GET_REPORT);
+	gcore_hw_request(hdev, g510data->start_input_report, HID_REQ_GET_REPORT);
 	wait_for_completion_timeout(&g510data->ready, HZ);
 
 	/* Protect data->ready_stages */
@@ -595,6 +592,9 @@ static void send_finalize_report(struct gcore_data *gdata)
 		dbg_hid(G510_NAME " stage 3 complete\n");
 	}
 
+	/* raw_event can do without the lock from now on */
+	smp_store_release(&gdata->ready, true);
+
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
 }
 
@@ -624,7 +624,7 @@ static int g510_probe(struct hid_device *hdev,
 	gdata->data = g510data;
 	init_completion(&g510data->ready);
 
-	error = gcore_hid_open(gdata);
+	error = gcore_hid_open(gdata, &g510_report_layout);
 	if (error) {
 		dev_err(&hdev->dev,
 			"%s error opening hid device\n",
@@ -742,6 +742,7 @@ static struct hid_driver g510_driver = {
 	.probe			= g510_probe,
 	.remove			= g510_remove,
 	.raw_event		= g510_raw_event,
+	.input_mapping		= gcore_input_mapping,
 
 #ifdef CONFIG_PM
 	.resume			= g510_resume,
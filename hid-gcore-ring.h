@@ -0,0 +1,52 @@
+#ifndef HID_GCORE_RING_H_INCLUDED
+#define HID_GCORE_RING_H_INCLUDED		1
+
+/*
+ * Userspace interface of the raw report ring, /dev/greportN with N the id
+ * of the hid device. This header is shared by the driver and by the tools.
+ *
+ * The ring keeps the last GCORE_RING_RECORDS input reports received while
+ * the device is open, one client at a time. It is mapped read-only: a page
+ * holding struct gcore_ring_header, then the records. Record i is at
+ * records[i % GCORE_RING_RECORDS] and head counts the records ever written;
+ * it is stored after the record it accounts for.
+ *
+ * The client keeps its own tail, starting at head when the device is opened.
+ * It loads head with acquire semantics, copies the records from tail to
+ * head, then loads head again and discards the copies that are now
+ * GCORE_RING_RECORDS or more behind it, as they may have been overwritten.
+ *
+ * read() of a __u32 waits for records past the head returned by the
+ * previous read() and returns the current head. poll() reports POLLIN while
+ * there are such records. Wakeups come every GCORE_RING_IOC_BATCH records,
+ * or a jiffy after the first record of an incomplete batch.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define GCORE_RING_RECORDS 512
+#define GCORE_RING_DATA 64	/* bytes kept of a report */
+
+struct gcore_ring_header {
+	__u32 head;
+	__u32 records;		/* GCORE_RING_RECORDS */
+	__u32 record_size;	/* sizeof(struct gcore_ring_record) */
+	__u32 reserved;
+};
+
+struct gcore_ring_record {
+	__u64 time_ns;		/* CLOCK_MONOTONIC arrival of the report */
+	__u8 id;		/* report id */
+	__u8 size;		/* bytes used in data */
+	__u8 reserved[6];
+	__u8 data[GCORE_RING_DATA]; /* the report, starting with its id */
+};
+
+/* Shares its magic with hid-gfb-ioctl.h */
+#define GCORE_IOC_MAGIC 'g'
+
+/* Records per wakeup, 1 to GCORE_RING_RECORDS, 1 when opened */
+#define GCORE_RING_IOC_BATCH	_IOW(GCORE_IOC_MAGIC, 0x40, __u32)
+
+#endif
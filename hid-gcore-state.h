@@ -0,0 +1,32 @@
+#ifndef HID_GCORE_STATE_H_INCLUDED
+#define HID_GCORE_STATE_H_INCLUDED		1
+
+/*
+ * Userspace interface of the key state page, /dev/gstateN with N the id of
+ * the hid device. This header is shared by the driver and by the tools.
+ *
+ * The device maps one read-only page starting with struct gcore_state,
+ * which always holds the current state of the keys and the stick. Any
+ * number of clients may map it. The driver bumps seq before and after each
+ * update, so a consistent snapshot is taken with:
+ *
+ *	do {
+ *		seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE);
+ *		copy = *state;
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while ((seq & 1) || seq != __atomic_load_n(&state->seq,
+ *						     __ATOMIC_RELAXED));
+ */
+
+#include <linux/types.h>
+
+struct gcore_state {
+	__u32 seq;		/* odd while being updated */
+	__u8 mbank;		/* 1 to 3 once M1 to M3 was pressed, else 0 */
+	__u8 axes[2];		/* stick position, x then y, on the G13 */
+	__u8 reserved;
+	__u64 time_ns;		/* CLOCK_MONOTONIC arrival of the last change */
+	__u64 keys;		/* bit n set while the key of scancode n is held */
+};
+
+#endif
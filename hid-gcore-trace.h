@@ -0,0 +1,168 @@
+/*
+ * Trace events of the lg4l drivers, defined in hid-gcore.c.
+ *
+ * Devices are named by their HID id, the number after the dot in the
+ * name of the hid device, and framebuffers by their node.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lg4l
+
+#if !defined(HID_GCORE_TRACE_H_INCLUDED) || defined(TRACE_HEADER_MULTI_READ)
+#define HID_GCORE_TRACE_H_INCLUDED
+
+#include <linux/fb.h>
+#include <linux/hid.h>
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+TRACE_EVENT(lg4l_raw_event,
+	TP_PROTO(struct hid_device *hdev, int id, int size),
+	TP_ARGS(hdev, id, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, hid)
+		__field(int, id)
+		__field(int, size)
+	),
+	TP_fast_assign(
+		__entry->hid = hdev->id;
+		__entry->id = id;
+		__entry->size = size;
+	),
+	TP_printk("hid=%u id=%d size=%d",
+		  __entry->hid, __entry->id, __entry->size)
+);
+
+TRACE_EVENT(lg4l_key,
+	TP_PROTO(struct hid_device *hdev, int scancode, unsigned int keycode,
+		 int value),
+	TP_ARGS(hdev, scancode, keycode, value),
+	TP_STRUCT__entry(
+		__field(unsigned int, hid)
+		__field(int, scancode)
+		__field(unsigned int, keycode)
+		__field(int, value)
+	),
+	TP_fast_assign(
+		__entry->hid = hdev->id;
+		__entry->scancode = scancode;
+		__entry->keycode = keycode;
+		__entry->value = value;
+	),
+	TP_printk("hid=%u scancode=%d keycode=%u value=%d",
+		  __entry->hid, __entry->scancode, __entry->keycode,
+		  __entry->value)
+);
+
+/* duration is the time hid_hw_request() took, usbhid only queues it */
+TRACE_EVENT(lg4l_hw_request,
+	TP_PROTO(struct hid_device *hdev, struct hid_report *report,
+		 int reqtype, u64 duration),
+	TP_ARGS(hdev, report, reqtype, duration),
+	TP_STRUCT__entry(
+		__field(unsigned int, hid)
+		__field(unsigned int, id)
+		__field(unsigned int, type)
+		__field(int, reqtype)
+		__field(u64, duration)
+	),
+	TP_fast_assign(
+		__entry->hid = hdev->id;
+		__entry->id = report->id;
+		__entry->type = report->type;
+		__entry->reqtype = reqtype;
+		__entry->duration = duration;
+	),
+	TP_printk("hid=%u id=%u type=%s %s duration=%lluns",
+		  __entry->hid, __entry->id,
+		  __print_symbolic(__entry->type,
+				   { HID_INPUT_REPORT, "input" },
+				   { HID_OUTPUT_REPORT, "output" },
+				   { HID_FEATURE_REPORT, "feature" }),
+		  __entry->reqtype == HID_REQ_SET_REPORT ? "set" : "get",
+		  __entry->duration)
+);
+
+DECLARE_EVENT_CLASS(lg4l_urb,
+	TP_PROTO(struct hid_device *hdev, struct urb *urb, int status),
+	TP_ARGS(hdev, urb, status),
+	TP_STRUCT__entry(
+		__field(unsigned int, hid)
+		__field(unsigned int, ep)
+		__field(bool, in)
+		__field(int, status)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__entry->hid = hdev->id;
+		__entry->ep = usb_pipeendpoint(urb->pipe);
+		__entry->in = usb_pipein(urb->pipe);
+		__entry->status = status;
+		__entry->length = urb->actual_length;
+	),
+	TP_printk("hid=%u ep=%u%s status=%d length=%u",
+		  __entry->hid, __entry->ep, __entry->in ? "in" : "out",
+		  __entry->status, __entry->length)
+);
+
+/* status is the result of usb_submit_urb() */
+DEFINE_EVENT(lg4l_urb, lg4l_urb_submit,
+	TP_PROTO(struct hid_device *hdev, struct urb *urb, int status),
+	TP_ARGS(hdev, urb, status)
+);
+
+DEFINE_EVENT(lg4l_urb, lg4l_urb_complete,
+	TP_PROTO(struct hid_device *hdev, struct urb *urb, int status),
+	TP_ARGS(hdev, urb, status)
+);
+
+/* x, y, w, h are in panel coordinates */
+DECLARE_EVENT_CLASS(lg4l_convert,
+	TP_PROTO(struct fb_info *info, int x, int y, int w, int h),
+	TP_ARGS(info, x, y, w, h),
+	TP_STRUCT__entry(
+		__field(int, node)
+		__field(int, x)
+		__field(int, y)
+		__field(int, w)
+		__field(int, h)
+	),
+	TP_fast_assign(
+		__entry->node = info->node;
+		__entry->x = x;
+		__entry->y = y;
+		__entry->w = w;
+		__entry->h = h;
+	),
+	TP_printk("fb%d %dx%d+%d+%d", __entry->node,
+		  __entry->w, __entry->h, __entry->x, __entry->y)
+);
+
+DEFINE_EVENT(lg4l_convert, lg4l_convert_start,
+	TP_PROTO(struct fb_info *info, int x, int y, int w, int h),
+	TP_ARGS(info, x, y, w, h)
+);
+
+DEFINE_EVENT(lg4l_convert, lg4l_convert_end,
+	TP_PROTO(struct fb_info *info, int x, int y, int w, int h),
+	TP_ARGS(info, x, y, w, h)
+);
+
+TRACE_EVENT(lg4l_defio,
+	TP_PROTO(struct fb_info *info),
+	TP_ARGS(info),
+	TP_STRUCT__entry(
+		__field(int, node)
+	),
+	TP_fast_assign(
+		__entry->node = info->node;
+	),
+	TP_printk("fb%d", __entry->node)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-gcore-trace
+#include <trace/define_trace.h>
@@ -14,13 +14,42 @@
  *   You should have received a copy of the GNU General Public License	   *
  *   along with this software. If not see <http://www.gnu.org/licenses/>.  *
  ***************************************************************************/
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/compat.h>
+#include <linux/debugfs.h>
 #include <linux/hid.h>
+#include <linux/hidraw.h>
 #include <linux/input.h>
+#include <linux/kref.h>
 #include <linux/leds.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/timer.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
 #include <linux/vmalloc.h>
 
 #include "hid-gcore.h"
+#include "hid-gcore-ring.h"
+#include "hid-gcore-state.h"
+
+#define CREATE_TRACE_POINTS
+#include "hid-gcore-trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(lg4l_raw_event);
+EXPORT_TRACEPOINT_SYMBOL_GPL(lg4l_urb_submit);
+EXPORT_TRACEPOINT_SYMBOL_GPL(lg4l_urb_complete);
+EXPORT_TRACEPOINT_SYMBOL_GPL(lg4l_convert_start);
+EXPORT_TRACEPOINT_SYMBOL_GPL(lg4l_convert_end);
+EXPORT_TRACEPOINT_SYMBOL_GPL(lg4l_defio);
+
+static struct dentry *gcore_debugfs_root;
 
 struct gcore_data *gcore_alloc_data(const char *name, struct hid_device *hdev)
 {
@@ -42,6 +71,7 @@ struct gcore_data *gcore_alloc_data(const char *name, struct hid_device *hdev)
 	strcpy(gdata->name, name);
 
 	spin_lock_init(&gdata->lock);
+	spin_lock_init(&gdata->state_lock);
 
 	gdata->hdev = hdev;
 	hid_set_drvdata(hdev, gdata);
@@ -59,11 +89,500 @@ void gcore_free_data(struct gcore_data *gdata)
 EXPORT_SYMBOL_GPL(gcore_free_data);
 
 
-int gcore_hid_open(struct gcore_data *gdata)
+/* Copy the report layout of the model into the decoding plan */
+static int gcore_input_plan(struct gcore_data *gdata,
+			    const struct gcore_report_layout *layout)
+{
+	int i;
+
+	if (layout->key_count > GCORE_KEY_BYTES ||
+	    layout->axis_count > GCORE_AXES)
+		return -EINVAL;
+
+	gdata->report_id = layout->report_id;
+	gdata->report_size = 0;
+
+	for (i = 0; i < layout->key_count; i++) {
+		gdata->report_keys[i] = layout->keys[i];
+		gdata->report_size = max(gdata->report_size,
+					 layout->keys[i].offset + 1);
+	}
+	gdata->report_key_count = layout->key_count;
+
+	for (i = 0; i < layout->axis_count; i++) {
+		gdata->report_axes[i] = layout->axes[i];
+		gdata->report_size = max(gdata->report_size,
+					 layout->axes[i].offset + 1);
+	}
+	gdata->report_axis_count = layout->axis_count;
+
+	gdata->mkey_mask = 0;
+	for (i = 0; i < GCORE_MBANKS; i++) {
+		if (layout->mkeys[i] >= 64)
+			return -EINVAL;
+		gdata->mkeys[i] = layout->mkeys[i];
+		gdata->mkey_mask |= BIT_ULL(layout->mkeys[i]);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Raw report ring, see hid-gcore-ring.h.
+ *
+ * The ring outlives the device while the client holds it open. Records are
+ * written from raw_event only, which gives the ring its single producer,
+ * and only while the device is open.
+ */
+struct gcore_ring {
+	struct kref kref;
+	struct miscdevice miscdev;
+	char name[16];
+	struct mutex lock;	/* serializes opens, releases and ioctls */
+	wait_queue_head_t wait;
+	struct timer_list flush; /* wakes the client for incomplete batches */
+	struct gcore_ring_header *header; /* vmalloc_user, mapped by the client */
+	struct gcore_ring_record *records;
+	unsigned long size;	/* bytes of the mapping */
+	u32 head;		/* producer copy of header->head */
+	u32 woken;		/* head at the last wakeup */
+	u32 read;		/* head returned by the last read() */
+	u32 batch;		/* records per wakeup */
+	bool open;
+	bool gone;		/* the device was removed */
+};
+
+#define gcore_ring_data(file)						\
+	container_of((file)->private_data, struct gcore_ring, miscdev)
+
+static void gcore_ring_push(struct gcore_ring *ring, ktime_t stamp, u8 id,
+			    const u8 *raw_data, int size)
+{
+	struct gcore_ring_record *record;
+	u32 head = ring->head;
+
+	record = &ring->records[head % GCORE_RING_RECORDS];
+	record->time_ns = ktime_to_ns(stamp);
+	record->id = id;
+	record->size = min(size, GCORE_RING_DATA);
+	memcpy(record->data, raw_data, record->size);
+
+	ring->head = ++head;
+	smp_store_release(&ring->header->head, head);
+
+	if (head - ring->woken >= READ_ONCE(ring->batch)) {
+		ring->woken = head;
+		if (wq_has_sleeper(&ring->wait))
+			wake_up_interruptible(&ring->wait);
+	} else if (!timer_pending(&ring->flush)) {
+		mod_timer(&ring->flush, jiffies + 1);
+	}
+}
+
+static void gcore_ring_flush(struct timer_list *t)
+{
+	struct gcore_ring *ring = from_timer(ring, t, flush);
+
+	wake_up_interruptible(&ring->wait);
+}
+
+static bool gcore_ring_readable(struct gcore_ring *ring)
+{
+	return smp_load_acquire(&ring->header->head) != READ_ONCE(ring->read);
+}
+
+static ssize_t gcore_ring_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct gcore_ring *ring = gcore_ring_data(file);
+	u32 head;
+	int error;
+
+	if (count < sizeof(head))
+		return -EINVAL;
+
+	while (!gcore_ring_readable(ring)) {
+		if (READ_ONCE(ring->gone))
+			return 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		error = wait_event_interruptible(ring->wait,
+			gcore_ring_readable(ring) || READ_ONCE(ring->gone));
+		if (error)
+			return error;
+	}
+
+	head = smp_load_acquire(&ring->header->head);
+	WRITE_ONCE(ring->read, head);
+
+	if (put_user(head, (u32 __user *)buf))
+		return -EFAULT;
+
+	return sizeof(head);
+}
+
+static __poll_t gcore_ring_poll(struct file *file, poll_table *wait)
+{
+	struct gcore_ring *ring = gcore_ring_data(file);
+	__poll_t mask = 0;
+
+	poll_wait(file, &ring->wait, wait);
+
+	if (gcore_ring_readable(ring))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(ring->gone))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static int gcore_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct gcore_ring *ring = gcore_ring_data(file);
+
+	/* The client only reads, the records are written in irq context */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, ring->header, vma->vm_pgoff);
+}
+
+static long gcore_ring_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct gcore_ring *ring = gcore_ring_data(file);
+	u32 batch;
+
+	switch (cmd) {
+	case GCORE_RING_IOC_BATCH:
+		if (get_user(batch, (u32 __user *)arg))
+			return -EFAULT;
+		if (batch < 1 || batch > GCORE_RING_RECORDS)
+			return -EINVAL;
+
+		mutex_lock(&ring->lock);
+		WRITE_ONCE(ring->batch, batch);
+		mutex_unlock(&ring->lock);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static long gcore_ring_compat_ioctl(struct file *file, unsigned int cmd,
+				    unsigned long arg)
+{
+	return gcore_ring_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static void gcore_ring_free(struct kref *kref)
+{
+	struct gcore_ring *ring = container_of(kref, struct gcore_ring, kref);
+
+	del_timer_sync(&ring->flush);
+	vfree(ring->header);
+	kfree(ring);
+}
+
+static int gcore_ring_open(struct inode *inode, struct file *file)
+{
+	struct gcore_ring *ring = gcore_ring_data(file);
+	int error = 0;
+
+	mutex_lock(&ring->lock);
+
+	/* If the device is gone, we don't accept new opens */
+	if (ring->gone) {
+		error = -ENODEV;
+		goto out;
+	}
+
+	/* The ring has a single client */
+	if (ring->open) {
+		error = -EBUSY;
+		goto out;
+	}
+
+	ring->read = ring->head;
+	ring->woken = ring->head;
+	ring->batch = 1;
+	smp_store_release(&ring->open, true);
+
+	/* match kref_put in gcore_ring_release */
+	kref_get(&ring->kref);
+
+out:
+	mutex_unlock(&ring->lock);
+	return error ? error : nonseekable_open(inode, file);
+}
+
+static int gcore_ring_release(struct inode *inode, struct file *file)
+{
+	struct gcore_ring *ring = gcore_ring_data(file);
+
+	mutex_lock(&ring->lock);
+	WRITE_ONCE(ring->open, false);
+	mutex_unlock(&ring->lock);
+
+	/* match kref_get in gcore_ring_open */
+	kref_put(&ring->kref, gcore_ring_free);
+
+	return 0;
+}
+
+static const struct file_operations gcore_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= gcore_ring_open,
+	.release	= gcore_ring_release,
+	.read		= gcore_ring_read,
+	.poll		= gcore_ring_poll,
+	.mmap		= gcore_ring_mmap,
+	.unlocked_ioctl	= gcore_ring_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= gcore_ring_compat_ioctl,
+#endif
+};
+
+/* The ring is optional, the device works without it */
+static void gcore_ring_probe(struct gcore_data *gdata)
+{
+	struct hid_device *hdev = gdata->hdev;
+	struct gcore_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL)
+		goto err;
+
+	ring->size = PAGE_ALIGN(PAGE_SIZE + GCORE_RING_RECORDS *
+				sizeof(struct gcore_ring_record));
+	ring->header = vmalloc_user(ring->size);
+	if (ring->header == NULL)
+		goto err_free_ring;
+
+	ring->header->records = GCORE_RING_RECORDS;
+	ring->header->record_size = sizeof(struct gcore_ring_record);
+	ring->records = (void *)ring->header + PAGE_SIZE;
+
+	kref_init(&ring->kref);
+	mutex_init(&ring->lock);
+	init_waitqueue_head(&ring->wait);
+	timer_setup(&ring->flush, gcore_ring_flush, 0);
+
+	snprintf(ring->name, sizeof(ring->name), "greport%u", hdev->id);
+	ring->miscdev.minor = MISC_DYNAMIC_MINOR;
+	ring->miscdev.name = ring->name;
+	ring->miscdev.fops = &gcore_ring_fops;
+	ring->miscdev.parent = &hdev->dev;
+
+	if (misc_register(&ring->miscdev))
+		goto err_free_header;
+
+	gdata->ring = ring;
+	return;
+
+err_free_header:
+	vfree(ring->header);
+err_free_ring:
+	kfree(ring);
+err:
+	dev_warn(&hdev->dev, "%s failed to register the report ring\n",
+		 gdata->name);
+}
+
+/* Called once raw_event can no longer run */
+static void gcore_ring_remove(struct gcore_data *gdata)
+{
+	struct gcore_ring *ring = gdata->ring;
+
+	if (ring == NULL)
+		return;
+
+	misc_deregister(&ring->miscdev);
+
+	mutex_lock(&ring->lock);
+	WRITE_ONCE(ring->gone, true);
+	mutex_unlock(&ring->lock);
+
+	/* A blocked client sees the device is gone */
+	wake_up_interruptible(&ring->wait);
+
+	gdata->ring = NULL;
+	kref_put(&ring->kref, gcore_ring_free);
+}
+
+
+/*
+ * Key state page, see hid-gcore-state.h. Like the ring, it outlives the
+ * device while clients hold it open.
+ */
+struct gcore_state_page {
+	struct kref kref;
+	struct miscdevice miscdev;
+	char name[16];
+	struct gcore_state *state;	/* vmalloc_user, mapped by the clients */
+};
+
+#define gcore_state_data(file)						\
+	container_of((file)->private_data, struct gcore_state_page, miscdev)
+
+/* Bump seq around the update as a raw seqcount would */
+static void gcore_state_publish(struct gcore_data *gdata, ktime_t stamp)
+{
+	struct gcore_state *state = gdata->state->state;
+	unsigned long irq_flags;
+	u64 keys = 0, pressed;
+	int i;
+
+	/* raw_event and the ep1 urbs may both be here */
+	spin_lock_irqsave(&gdata->state_lock, irq_flags);
+
+	WRITE_ONCE(state->seq, state->seq + 1);
+	smp_wmb();
+
+	for (i = 0; i < GCORE_KEY_BYTES; i++)
+		keys |= (u64)READ_ONCE(gdata->key_state[i]) <<
+			gdata->key_scancode[i];
+
+	pressed = keys & ~state->keys & gdata->mkey_mask;
+	for (i = 0; i < GCORE_MBANKS; i++)
+		if (pressed & BIT_ULL(gdata->mkeys[i]))
+			state->mbank = i + 1;
+
+	state->keys = keys;
+	memcpy(state->axes, gdata->axis_state, sizeof(state->axes));
+	state->time_ns = ktime_to_ns(stamp);
+
+	smp_wmb();
+	WRITE_ONCE(state->seq, state->seq + 1);
+
+	spin_unlock_irqrestore(&gdata->state_lock, irq_flags);
+}
+
+static int gcore_state_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct gcore_state_page *page = gcore_state_data(file);
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, page->state, vma->vm_pgoff);
+}
+
+static void gcore_state_free(struct kref *kref)
+{
+	struct gcore_state_page *page =
+		container_of(kref, struct gcore_state_page, kref);
+
+	vfree(page->state);
+	kfree(page);
+}
+
+static int gcore_state_open(struct inode *inode, struct file *file)
+{
+	struct gcore_state_page *page = gcore_state_data(file);
+
+	/* match kref_put in gcore_state_release */
+	kref_get(&page->kref);
+
+	return nonseekable_open(inode, file);
+}
+
+static int gcore_state_release(struct inode *inode, struct file *file)
+{
+	struct gcore_state_page *page = gcore_state_data(file);
+
+	/* match kref_get in gcore_state_open */
+	kref_put(&page->kref, gcore_state_free);
+
+	return 0;
+}
+
+static const struct file_operations gcore_state_fops = {
+	.owner		= THIS_MODULE,
+	.open		= gcore_state_open,
+	.release	= gcore_state_release,
+	.mmap		= gcore_state_mmap,
+};
+
+/* The state page is optional, the device works without it */
+static void gcore_state_probe(struct gcore_data *gdata)
+{
+	struct hid_device *hdev = gdata->hdev;
+	struct gcore_state_page *page;
+
+	BUILD_BUG_ON(sizeof(page->state->axes) != GCORE_AXES);
+
+	page = kzalloc(sizeof(*page), GFP_KERNEL);
+	if (page == NULL)
+		goto err;
+
+	page->state = vmalloc_user(PAGE_SIZE);
+	if (page->state == NULL)
+		goto err_free_page;
+
+	kref_init(&page->kref);
+
+	snprintf(page->name, sizeof(page->name), "gstate%u", hdev->id);
+	page->miscdev.minor = MISC_DYNAMIC_MINOR;
+	page->miscdev.name = page->name;
+	page->miscdev.fops = &gcore_state_fops;
+	page->miscdev.parent = &hdev->dev;
+
+	if (misc_register(&page->miscdev))
+		goto err_free_state;
+
+	gdata->state = page;
+	return;
+
+err_free_state:
+	vfree(page->state);
+err_free_page:
+	kfree(page);
+err:
+	dev_warn(&hdev->dev, "%s failed to register the key state page\n",
+		 gdata->name);
+}
+
+/* Called once raw_event and the ep1 urbs can no longer run */
+static void gcore_state_remove(struct gcore_data *gdata)
+{
+	struct gcore_state_page *page = gdata->state;
+
+	if (page == NULL)
+		return;
+
+	misc_deregister(&page->miscdev);
+
+	gdata->state = NULL;
+	kref_put(&page->kref, gcore_state_free);
+}
+
+
+/*
+ * The input report of the layout is decoded by gcore_input_report() and
+ * nothing else, so hid-input makes no input device for vendor collections
+ * and doesn't map the fields of that report. Other collections go to
+ * hid-input as usual.
+ */
+int gcore_hid_open(struct gcore_data *gdata,
+		   const struct gcore_report_layout *layout)
 {
 	struct hid_device *hdev = gdata->hdev;
 	int error;
 
+	error = gcore_input_plan(gdata, layout);
+	if (error) {
+		dev_err(&hdev->dev, "%s invalid input report layout\n",
+			gdata->name);
+		goto err_no_cleanup;
+	}
+
 	dbg_hid("Preparing to parse %s hid reports\n", gdata->name);
 
 	/* Parse the device reports and start it up */
@@ -75,8 +594,7 @@ int gcore_hid_open(struct gcore_data *gdata)
 		goto err_no_cleanup;
 	}
 
-	error = hid_hw_start(hdev,
-			     HID_CONNECT_DEFAULT | HID_CONNECT_HIDINPUT_FORCE);
+	error = hid_hw_start(hdev, HID_CONNECT_DEFAULT);
 	if (error) {
 		dev_err(&hdev->dev, "%s hardware start failed\n", gdata->name);
 		error = -EINVAL;
@@ -94,6 +612,9 @@ int gcore_hid_open(struct gcore_data *gdata)
 		goto err_cleanup_hid;
 	}
 
+	gcore_ring_probe(gdata);
+	gcore_state_probe(gdata);
+
 	return 0;
 
 err_cleanup_hid:
@@ -111,10 +632,92 @@ void gcore_hid_close(struct gcore_data *gdata)
 
 	hdev->ll_driver->close(hdev);
 	hid_hw_stop(hdev);
+
+	gcore_ring_remove(gdata);
+	gcore_state_remove(gdata);
+
+	/* Allocated by gcore_input_probe(), still written until now */
+	debugfs_remove_recursive(gdata->debugfs);
+	gdata->debugfs = NULL;
+	free_percpu(gdata->stats);
+	gdata->stats = NULL;
 }
 EXPORT_SYMBOL_GPL(gcore_hid_close);
 
 
+/*
+ * The keymap is the direct-indexed keycode table of the input device,
+ * which gcore_input_report_key() reads without taking the event lock.
+ * Entries are replaced here, under the event lock, with single stores.
+ */
+static int gcore_input_setkeycode(struct input_dev *idev,
+				  const struct input_keymap_entry *ke,
+				  unsigned int *old_keycode)
+{
+	unsigned int *keycode = idev->keycode;
+	unsigned int index;
+	int i, error;
+
+	if (ke->flags & INPUT_KEYMAP_BY_INDEX) {
+		index = ke->index;
+	} else {
+		error = input_scancode_to_scalar(ke, &index);
+		if (error)
+			return error;
+	}
+
+	if (index >= idev->keycodemax || ke->keycode > KEY_MAX)
+		return -EINVAL;
+
+	*old_keycode = keycode[index];
+	WRITE_ONCE(keycode[index], ke->keycode);
+
+	/* Keep the old key advertised while another scancode has it */
+	__clear_bit(*old_keycode, idev->keybit);
+	for (i = 0; i < idev->keycodemax; i++) {
+		if (keycode[i] == *old_keycode) {
+			__set_bit(*old_keycode, idev->keybit);
+			break;
+		}
+	}
+
+	__set_bit(ke->keycode, idev->keybit);
+	return 0;
+}
+
+
+
+static inline int gcore_stats_bucket(ktime_t delta)
+{
+	return min_t(int, fls64(ktime_to_ns(delta)), GCORE_STATS_BUCKETS - 1);
+}
+
+static int gcore_stats_show(struct seq_file *s, void *unused)
+{
+	struct gcore_data *gdata = s->private;
+	u64 latency[GCORE_STATS_BUCKETS] = { };
+	u64 interval[GCORE_STATS_BUCKETS] = { };
+	struct gcore_stats *stats;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(gdata->stats, cpu);
+		for (i = 0; i < GCORE_STATS_BUCKETS; i++) {
+			latency[i] += stats->latency[i];
+			interval[i] += stats->interval[i];
+		}
+	}
+
+	/* One line per bucket: upper bound in ns, latency, interval */
+	seq_puts(s, "below_ns latency interval\n");
+	for (i = 0; i < GCORE_STATS_BUCKETS - 1; i++)
+		seq_printf(s, "%llu %llu %llu\n", 1ULL << i,
+			   latency[i], interval[i]);
+	seq_printf(s, "inf %llu %llu\n", latency[i], interval[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gcore_stats);
 
 int gcore_input_probe(struct gcore_data *gdata,
 		      const unsigned int default_keymap[],
@@ -159,6 +762,7 @@ int gcore_input_probe(struct gcore_data *gdata,
 	keycode = gdata->input_dev->keycode;
 	gdata->input_dev->keycodemax = keymap_size;
 	gdata->input_dev->keycodesize = sizeof(unsigned int);
+	gdata->input_dev->setkeycode = gcore_input_setkeycode;
 	for (i = 0; i < keymap_size; i++) {
 		keycode[i] = default_keymap[i];
 		__set_bit(keycode[i], gdata->input_dev->keybit);
@@ -176,8 +780,24 @@ int gcore_input_probe(struct gcore_data *gdata,
 		goto err_cleanup_input_dev_keycode;
 	}
 
+	gdata->stats = alloc_percpu(struct gcore_stats);
+	if (gdata->stats == NULL) {
+		error = -ENOMEM;
+		goto err_cleanup_input_dev_reg;
+	}
+
+	gdata->debugfs = debugfs_create_dir(dev_name(&hdev->dev),
+					    gcore_debugfs_root);
+	debugfs_create_file("input_stats", 0444, gdata->debugfs, gdata,
+			    &gcore_stats_fops);
+
 	return 0;
 
+err_cleanup_input_dev_reg:
+	input_unregister_device(gdata->input_dev);
+	kfree(gdata->input_dev->keycode);
+	return error;
+
 err_cleanup_input_dev_keycode:
 	kfree(gdata->input_dev->keycode);
 
@@ -190,21 +810,20 @@ err_no_cleanup:
 EXPORT_SYMBOL_GPL(gcore_input_probe);
 
 
+/* Called from raw_event for every key bit, so look the key up lock-free */
 void gcore_input_report_key(struct gcore_data *gdata, int scancode, int value)
 {
 	struct input_dev *idev = gdata->input_dev;
-	int error;
+	unsigned int keycode = KEY_RESERVED;
+
+	if (scancode >= 0 && scancode < idev->keycodemax)
+		keycode = READ_ONCE(((unsigned int *)idev->keycode)[scancode]);
 
-	struct input_keymap_entry ke = {
-		.flags	  = 0,
-		.len	  = sizeof(scancode),
-	};
-	*((int *) ke.scancode) = scancode;
+	trace_lg4l_key(gdata->hdev, scancode, keycode, value);
 
-	error = input_get_keycode(idev, &ke);
-	if (!error && ke.keycode != KEY_UNKNOWN && ke.keycode != KEY_RESERVED) {
+	if (keycode != KEY_UNKNOWN && keycode != KEY_RESERVED) {
 		/* Only report mapped keys */
-		input_report_key(idev, ke.keycode, value);
+		input_report_key(idev, keycode, value);
 	} else if (!!value) {
 		/* Or report MSC_SCAN on keypress of an unmapped key */
 		input_event(idev, EV_MSC, MSC_SCAN, scancode);
@@ -213,6 +832,338 @@ void gcore_input_report_key(struct gcore_data *gdata, int scancode, int value)
 EXPORT_SYMBOL_GPL(gcore_input_report_key);
 
 
+/*
+ * Report the keys of a report byte that changed since the last time.
+ * Bit i of bits is the key at scancode + i. Each byte of a report is
+ * remembered in its own key_state slot, so reports coming in on different
+ * endpoints don't race on the state. Returns whether any key changed,
+ * i.e. whether an input_sync() is due.
+ */
+bool gcore_input_report_keys(struct gcore_data *gdata, int slot, u8 bits,
+			     int scancode)
+{
+	u8 changed = bits ^ gdata->key_state[slot];
+
+	if (likely(!changed))
+		return false;
+
+	gdata->key_state[slot] = bits;
+	gdata->key_scancode[slot] = scancode;
+
+	/* Only walk the keys that changed */
+	for (; changed; changed &= changed - 1)
+		gcore_input_report_key(gdata, scancode + __ffs(changed),
+				       bits & changed & -changed);
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(gcore_input_report_keys);
+
+
+/*
+ * HID-BPF hooks of the input decoder.
+ *
+ * fmod_ret programs attach to gcore_bpf_report_pre(), called before the
+ * report is decoded, whose non-zero return leaves the report undecoded,
+ * and to gcore_bpf_report_post(), called once the decoder has reported
+ * its events and before input_sync(), whose positive return syncs even
+ * when the decoder saw no change. Within the hooks the programs can read
+ * and rewrite the report with gcore_bpf_get_data() and report events of
+ * their own with the kfuncs below.
+ *
+ * Module kfuncs need module BTF, and these macros 6.9.
+ */
+#if IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+
+__bpf_hook_start();
+
+noinline int gcore_bpf_report_pre(struct gcore_data *gdata, u8 *data,
+				  int size)
+{
+	return 0;
+}
+
+noinline int gcore_bpf_report_post(struct gcore_data *gdata, u8 *data,
+				   int size)
+{
+	return 0;
+}
+
+__bpf_hook_end();
+
+__bpf_kfunc_start_defs();
+
+/* rdwr_buf_size bytes of the report from offset, only within the hooks */
+__bpf_kfunc u8 *gcore_bpf_get_data(struct gcore_data *gdata,
+				   unsigned int offset,
+				   const size_t rdwr_buf_size)
+{
+	if (gdata->bpf_data == NULL || offset > gdata->bpf_size ||
+	    rdwr_buf_size > gdata->bpf_size - offset)
+		return NULL;
+
+	return gdata->bpf_data + offset;
+}
+
+/* Report a key through the keymap, as the decoder does */
+__bpf_kfunc void gcore_bpf_report_key(struct gcore_data *gdata, int scancode,
+				      int value)
+{
+	gcore_input_report_key(gdata, scancode, value);
+}
+
+/* Report any key, axis or scan event the input device supports */
+__bpf_kfunc int gcore_bpf_input_event(struct gcore_data *gdata,
+				      unsigned int type, unsigned int code,
+				      int value)
+{
+	if (type != EV_KEY && type != EV_ABS && type != EV_MSC)
+		return -EINVAL;
+
+	input_event(gdata->input_dev, type, code, value);
+	return 0;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(gcore_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, gcore_bpf_get_data, KF_RET_NULL | KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, gcore_bpf_report_key, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, gcore_bpf_input_event, KF_TRUSTED_ARGS)
+BTF_KFUNCS_END(gcore_bpf_kfunc_ids)
+
+BTF_SET8_START(gcore_bpf_fmodret_ids)
+BTF_ID_FLAGS(func, gcore_bpf_report_pre)
+BTF_ID_FLAGS(func, gcore_bpf_report_post)
+BTF_SET8_END(gcore_bpf_fmodret_ids)
+
+static bool gcore_bpf_set_contains(const struct btf_id_set8 *set, u32 id)
+{
+	u32 i;
+
+	for (i = 0; i < set->cnt; i++)
+		if (set->pairs[i].id == id)
+			return true;
+	return false;
+}
+
+/*
+ * The kfuncs work on the report being decoded, so only the programs
+ * attached to the hooks above may call them, on the CPU and at the time
+ * the report is there.
+ */
+static int gcore_bpf_kfunc_filter(const struct bpf_prog *prog, u32 kfunc_id)
+{
+	if (!gcore_bpf_set_contains(&gcore_bpf_kfunc_ids, kfunc_id))
+		return 0;
+
+	if (prog->expected_attach_type == BPF_MODIFY_RETURN &&
+	    prog->aux->mod == THIS_MODULE &&
+	    gcore_bpf_set_contains(&gcore_bpf_fmodret_ids,
+				   prog->aux->attach_btf_id))
+		return 0;
+
+	return -EACCES;
+}
+
+static const struct btf_kfunc_id_set gcore_bpf_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &gcore_bpf_kfunc_ids,
+	.filter = gcore_bpf_kfunc_filter,
+};
+
+static const struct btf_kfunc_id_set gcore_bpf_fmodret_set = {
+	.owner = THIS_MODULE,
+	.set = &gcore_bpf_fmodret_ids,
+};
+
+static int __init gcore_bpf_init(void)
+{
+	int error;
+
+	error = register_btf_fmodret_id_set(&gcore_bpf_fmodret_set);
+	if (error)
+		return error;
+
+	return register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING,
+					 &gcore_bpf_kfunc_set);
+}
+
+#else
+
+static inline int gcore_bpf_report_pre(struct gcore_data *gdata, u8 *data,
+				       int size)
+{
+	return 0;
+}
+
+static inline int gcore_bpf_report_post(struct gcore_data *gdata, u8 *data,
+					int size)
+{
+	return 0;
+}
+
+static inline int gcore_bpf_init(void)
+{
+	return 0;
+}
+
+#endif
+
+
+/*
+ * Decode an input report with the plan of the device: key bytes use key
+ * slots 0 and up in layout order. This is the raw_event result for the
+ * report: it is handed to hidraw here and the HID core is told to stop,
+ * as there is nothing left for it to parse. Reports too short for the
+ * plan are left to the HID core.
+ */
+int gcore_input_report(struct gcore_data *gdata, u8 *raw_data, int size)
+{
+	const struct gcore_report_keys *keys = gdata->report_keys;
+	const struct gcore_report_axis *axes = gdata->report_axes;
+	struct hid_device *hdev = gdata->hdev;
+	ktime_t stamp = ktime_get();
+	bool changed = false;
+	u8 value;
+	int i;
+
+	if (unlikely(size < gdata->report_size))
+		return 0;
+
+	if (gdata->last_report)
+		this_cpu_inc(gdata->stats->interval[
+			gcore_stats_bucket(ktime_sub(stamp, gdata->last_report))]);
+	gdata->last_report = stamp;
+
+	if (gdata->ring && smp_load_acquire(&gdata->ring->open))
+		gcore_ring_push(gdata->ring, stamp, gdata->report_id,
+				raw_data, size);
+
+	gdata->bpf_data = raw_data;
+	gdata->bpf_size = size;
+
+	if (unlikely(gcore_bpf_report_pre(gdata, raw_data, size)))
+		goto out;
+
+	for (i = 0; i < gdata->report_key_count; i++)
+		changed |= gcore_input_report_keys(gdata, i,
+				raw_data[keys[i].offset] & keys[i].mask,
+				keys[i].scancode);
+
+	for (i = 0; i < gdata->report_axis_count; i++) {
+		value = raw_data[axes[i].offset];
+		if (value == gdata->axis_state[i])
+			continue;
+		gdata->axis_state[i] = value;
+		input_report_abs(gdata->input_dev, axes[i].code, value);
+		changed = true;
+	}
+
+	if (gcore_bpf_report_post(gdata, raw_data, size) > 0)
+		changed = true;
+
+	if (changed)
+		gcore_input_sync(gdata, stamp);
+
+out:
+	gdata->bpf_data = NULL;
+
+	if (hdev->claimed & HID_CLAIMED_HIDRAW)
+		hidraw_report_event(hdev, raw_data, size);
+
+	/* A negative raw_event result ends the processing of the report */
+	return -EALREADY;
+}
+EXPORT_SYMBOL_GPL(gcore_input_report);
+
+
+/* input_sync() with the events stamped with the arrival of their report */
+void gcore_input_sync(struct gcore_data *gdata, ktime_t stamp)
+{
+	if (gdata->state)
+		gcore_state_publish(gdata, stamp);
+
+	input_set_timestamp(gdata->input_dev, stamp);
+	input_sync(gdata->input_dev);
+
+	this_cpu_inc(gdata->stats->latency[
+		gcore_stats_bucket(ktime_sub(ktime_get(), stamp))]);
+}
+EXPORT_SYMBOL_GPL(gcore_input_sync);
+
+
+/* hid_hw_request(), traced with the time it took */
+void gcore_hw_request(struct hid_device *hdev, struct hid_report *report,
+		      int reqtype)
+{
+	ktime_t start;
+
+	if (!trace_lg4l_hw_request_enabled()) {
+		hid_hw_request(hdev, report, reqtype);
+		return;
+	}
+
+	start = ktime_get();
+	hid_hw_request(hdev, report, reqtype);
+	trace_lg4l_hw_request(hdev, report, reqtype,
+			      ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+EXPORT_SYMBOL_GPL(gcore_hw_request);
+
+
+static bool gcore_usb_microframes(struct usb_device *usb_dev)
+{
+	return usb_dev->speed == USB_SPEED_HIGH ||
+		usb_dev->speed >= USB_SPEED_SUPER;
+}
+
+/*
+ * The interval argument of usb_fill_int_urb() polling every ms: frames at
+ * full and low speed, an exponent of microframes above. The bInterval of an
+ * interrupt IN endpoint is the longest period the device asks for, so only
+ * the bus limits the interval from below.
+ */
+int gcore_int_urb_interval(struct usb_device *usb_dev, unsigned int ms)
+{
+	ms = clamp_val(ms, 1, 255);
+
+	if (gcore_usb_microframes(usb_dev))
+		return min(ilog2(ms * 8) + 1, 16);
+	return ms;
+}
+EXPORT_SYMBOL_GPL(gcore_int_urb_interval);
+
+/* Polls per second of an interrupt urb, as the host controller runs it */
+unsigned int gcore_int_urb_rate(struct urb *urb)
+{
+	if (urb->dev == NULL || urb->interval <= 0)
+		return 0;
+	if (gcore_usb_microframes(urb->dev))
+		return 8000 / urb->interval;
+	return 1000 / urb->interval;
+}
+EXPORT_SYMBOL_GPL(gcore_int_urb_rate);
+
+
+/* hid_driver.input_mapping: keep hid-input away from the decoded report */
+int gcore_input_mapping(struct hid_device *hdev, struct hid_input *hi,
+			struct hid_field *field, struct hid_usage *usage,
+			unsigned long **bit, int *max)
+{
+	struct gcore_data *gdata = hid_get_gdata(hdev);
+
+	if (field->report->type == HID_INPUT_REPORT &&
+	    field->report->id == gdata->report_id)
+		return -1;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gcore_input_mapping);
+
+
+/* The stats go in gcore_hid_close(), once reports have stopped */
 void gcore_input_remove(struct gcore_data *gdata)
 {
 	input_unregister_device(gdata->input_dev);
@@ -389,6 +1340,23 @@ ssize_t gcore_minor_show(struct device *dev,
 EXPORT_SYMBOL_GPL(gcore_minor_show);
 
 
+static int __init gcore_init(void)
+{
+	gcore_debugfs_root = debugfs_create_dir("hid-gcore", NULL);
+
+	if (gcore_bpf_init())
+		pr_warn("hid-gcore: failed to register the BPF hooks\n");
+
+	return 0;
+}
+
+static void __exit gcore_exit(void)
+{
+	debugfs_remove_recursive(gcore_debugfs_root);
+}
+
+module_init(gcore_init);
+module_exit(gcore_exit);
 
 MODULE_DESCRIPTION("Logitech HID core functions");
 MODULE_AUTHOR("Rick L Vinyard Jr (rvinyard@cs.nmsu.edu)");
@@ -3,6 +3,47 @@
 
 /* See hid-gfb.h */
 struct gfb_data;
+/* See hid-gcore.c */
+struct gcore_ring;
+struct gcore_state_page;
+
+/* Bytes of key bits remembered by gcore_input_report_keys() */
+#define GCORE_KEY_BYTES 8
+/* Axes of an input report */
+#define GCORE_AXES 2
+/* M-keys selecting a bank: M1, M2 and M3 */
+#define GCORE_MBANKS 3
+/* Histogram buckets of struct gcore_stats, bucket b counts [2^(b-1), 2^b) ns */
+#define GCORE_STATS_BUCKETS 32
+
+/* A byte of key bits in an input report */
+struct gcore_report_keys {
+	u8 offset;		       /* byte in the report */
+	u8 mask;		       /* key bits, the others are ignored */
+	u8 scancode;		       /* scancode of bit 0 */
+};
+
+/* A byte holding the position of an absolute axis */
+struct gcore_report_axis {
+	u8 offset;		       /* byte in the report */
+	u16 code;		       /* ABS_ code */
+};
+
+/* Where the keys and axes of a model are in its input report */
+struct gcore_report_layout {
+	u8 report_id;		       /* the report, claimed from hid-input */
+	const struct gcore_report_keys *keys;
+	int key_count;		       /* at most GCORE_KEY_BYTES */
+	const struct gcore_report_axis *axes;
+	int axis_count;		       /* at most GCORE_AXES */
+	u8 mkeys[GCORE_MBANKS];	       /* scancodes of M1 to M3 */
+};
+
+/* Per-CPU input timing histograms, shown in debugfs */
+struct gcore_stats {
+	u64 latency[GCORE_STATS_BUCKETS];  /* report arrival to input_sync */
+	u64 interval[GCORE_STATS_BUCKETS]; /* between input reports */
+};
 
 /* Private driver data that is common for G-series drivers
  *
@@ -26,6 +67,35 @@ struct gcore_data {
 	struct led_classdev **led_cdev; /* led devices */
 
 	spinlock_t lock;	       /* global device lock */
+	bool ready;		       /* init handshake done, set once */
+
+	/* input report decoding plan, made from the report layout */
+	struct gcore_report_keys report_keys[GCORE_KEY_BYTES];
+	int report_key_count;
+	struct gcore_report_axis report_axes[GCORE_AXES];
+	int report_axis_count;
+	int report_size;	       /* bytes the plan reads */
+	int report_id;
+
+	u8 key_state[GCORE_KEY_BYTES]; /* key bits of the last reports */
+	u8 key_scancode[GCORE_KEY_BYTES]; /* scancode of bit 0 of key_state */
+	u8 axis_state[GCORE_AXES];     /* axis positions of the last report */
+
+	struct gcore_stats __percpu *stats;
+	ktime_t last_report;	       /* arrival of the last input report */
+	struct dentry *debugfs;	       /* per-device debugfs directory */
+
+	struct gcore_ring *ring;       /* raw report ring (may be NULL) */
+
+	/* key state page (may be NULL) and its writers lock */
+	struct gcore_state_page *state;
+	spinlock_t state_lock;
+	u8 mkeys[GCORE_MBANKS];
+	u64 mkey_mask;		       /* bits of mkeys */
+
+	/* report seen by the BPF hooks, NULL outside of them */
+	u8 *bpf_data;
+	unsigned int bpf_size;
 
 	void *data;		       /* specific driver data */
 };
@@ -47,7 +117,8 @@ struct gcore_data {
 struct gcore_data *gcore_alloc_data(const char *name, struct hid_device *hdev);
 void gcore_free_data(struct gcore_data *gdata);
 
-int gcore_hid_open(struct gcore_data *gdata);
+int gcore_hid_open(struct gcore_data *gdata,
+		   const struct gcore_report_layout *layout);
 void gcore_hid_close(struct gcore_data *gdata);
 
 int gcore_input_probe(struct gcore_data *gdata,
@@ -62,6 +133,21 @@ struct hid_device *gcore_led_classdev_to_hdev(struct led_classdev *led_cdev);
 
 /** Input helpers. */
 void gcore_input_report_key(struct gcore_data *gdata, int scancode, int value);
+bool gcore_input_report_keys(struct gcore_data *gdata, int slot, u8 bits,
+			     int scancode);
+int gcore_input_report(struct gcore_data *gdata, u8 *raw_data, int size);
+void gcore_input_sync(struct gcore_data *gdata, ktime_t stamp);
+int gcore_input_mapping(struct hid_device *hdev, struct hid_input *hi,
+			struct hid_field *field, struct hid_usage *usage,
+			unsigned long **bit, int *max);
+
+/** Output helpers. */
+void gcore_hw_request(struct hid_device *hdev, struct hid_report *report,
+		      int reqtype);
+
+/** USB helpers. */
+int gcore_int_urb_interval(struct usb_device *usb_dev, unsigned int ms);
+unsigned int gcore_int_urb_rate(struct urb *urb);
 
 /** Common sysfs attributes. */
 ssize_t gcore_name_show(struct device *dev, struct device_attribute *attr,
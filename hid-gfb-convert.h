@@ -0,0 +1,346 @@
+#ifndef GFB_CONVERT_H_INCLUDED
+#define GFB_CONVERT_H_INCLUDED		1
+
+/*
+ * The pixel format conversions of hid-gfb.c. They are kept apart from the
+ * driver, which includes this file once, so that tools/gfb-bench can build
+ * the very same code in userspace.
+ */
+
+#include "hid-gfb-panel.h"
+
+static char hdata[512] = {
+	0x10, 0x0f, 0x00, 0x58, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3f,
+	0x01, 0xef, 0x00, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+	0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23,
+	0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+	0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+	0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53,
+	0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b,
+	0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+	0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83,
+	0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b,
+	0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3,
+	0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+	0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb,
+	0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
+	0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf, 0xe0, 0xe1, 0xe2, 0xe3,
+	0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb,
+	0xfc, 0xfd, 0xfe, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13,
+	0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b,
+	0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+	0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43,
+	0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b,
+	0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+	0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73,
+	0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b,
+	0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+	0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3,
+	0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+	0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb,
+	0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+	0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3,
+	0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+	0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb,
+	0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+	0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+/*
+ * Converters
+ *
+ * A converter updates the x,y,w,h area of a vbitmap, in panel coordinates,
+ * from an image in the fb format. The orientation tells where each panel
+ * pixel is in the fb, so rotating and flipping is folded into the loops
+ * that reorder the pixels for the panel anyway. Each panel lists the
+ * converters suited to it, the first one being the default; the
+ * fb_converter attribute switches between them.
+ */
+
+static inline int gfb_fb_x(const struct gfb_orientation *o, int x, int y)
+{
+	return o->x0 + x * o->xx + y * o->xy;
+}
+
+static inline int gfb_fb_y(const struct gfb_orientation *o, int x, int y)
+{
+	return o->y0 + x * o->yx + y * o->yy;
+}
+
+/* Column by column; writes are sequential, reads stride over lines */
+static void gfb_qvga_convert_columns(const struct gfb_panel *panel,
+				     const struct gfb_orientation *o,
+				     const u8 *bitmap, u8 *vbitmap,
+				     int x, int y, int w, int h)
+{
+	int yres, stride, step;
+	int col, row;
+	const u16 *src;
+	u16 *dst;
+
+	/* Set the image message header */
+	memcpy(vbitmap, &hdata, sizeof(hdata));
+
+	/* LCD is a portrait mode one so we have to rotate the framebuffer */
+
+	yres = panel->var.yres;
+	stride = o->line_length / 2;
+	step = o->yy * stride + o->xy;	/* fb pixels between panel rows */
+
+	for (col = x; col < x + w; ++col) {
+		src = (const u16 *)bitmap + gfb_fb_y(o, col, y) * stride +
+			gfb_fb_x(o, col, y);
+		dst = (u16 *)(vbitmap + sizeof(hdata)) + col * yres + y;
+		for (row = 0; row < h; ++row, src += step)
+			*dst++ = *src;
+	}
+}
+
+/*
+ * Transpose in 16x16 pixel tiles so that both the source lines and the
+ * destination columns of a tile stay in the cache
+ */
+static void gfb_qvga_convert_tiled(const struct gfb_panel *panel,
+				   const struct gfb_orientation *o,
+				   const u8 *bitmap, u8 *vbitmap,
+				   int x, int y, int w, int h)
+{
+	int yres, stride, step;
+	int tx, ty, tw, th;
+	int col, row;
+	const u16 *src;
+	u16 *dst;
+
+	/* Set the image message header */
+	memcpy(vbitmap, &hdata, sizeof(hdata));
+
+	yres = panel->var.yres;
+	stride = o->line_length / 2;
+	step = o->yy * stride + o->xy;
+
+	for (ty = y; ty < y + h; ty += 16) {
+		th = min(16, y + h - ty);
+		for (tx = x; tx < x + w; tx += 16) {
+			tw = min(16, x + w - tx);
+			for (col = tx; col < tx + tw; ++col) {
+				src = (const u16 *)bitmap +
+					gfb_fb_y(o, col, ty) * stride +
+					gfb_fb_x(o, col, ty);
+				dst = (u16 *)(vbitmap + sizeof(hdata)) +
+					col * yres + ty;
+				for (row = 0; row < th; ++row, src += step)
+					*dst++ = *src;
+			}
+		}
+	}
+}
+
+static void gfb_mono_convert_bits(const struct gfb_panel *panel,
+				  const struct gfb_orientation *o,
+				  const u8 *bitmap, u8 *vbitmap,
+				  int x, int y, int w, int h)
+{
+	int xres, yres, ll;
+	int band, col, bit, bits;
+	int fx, fy;
+	u8 *dst;
+	u8 value;
+
+	/* Set the magic number */
+	vbitmap[0] = 0x03;
+
+	/*
+	 * Translate the XBM format screen_base into the format needed by the
+	 * G15. This format places the pixels in a vertical rather than
+	 * horizontal format. Assuming a grid with 0,0 in the upper left corner
+	 * and 159,42 in the lower right corner, the first byte contains the
+	 * pixels 0,0 through 0,7 and the second byte contains the pixels 1,0
+	 * through 1,7. Within the byte, bit 0 represents 0,0; bit 1 0,1; etc.
+	 *
+	 * The offset is adjusted by 32 within the image message.
+	 *
+	 * Every band touched by the area is rebuilt from scratch, so the
+	 * bytes outside of it are left alone.
+	 */
+
+	xres = panel->var.xres;
+	yres = panel->var.yres;
+	ll = o->line_length;
+
+	for (band = y / 8; band <= (y + h - 1) / 8; ++band) {
+		/* each band is 8 pixels vertically, the last one may be less */
+		bits = min(8, yres - band * 8);
+		dst = vbitmap + 32 + band * xres + x;
+		for (col = x; col < x + w; ++col) {
+			fx = gfb_fb_x(o, col, band * 8);
+			fy = gfb_fb_y(o, col, band * 8);
+			value = 0x00;
+			for (bit = 0 ; bit < bits ; ++bit) {
+				if (bitmap[fy * ll + fx / 8] & (0x01 << (fx % 8)))
+					value |= (0x01 << bit);
+				fx += o->xy;
+				fy += o->yy;
+			}
+			*dst++ = value;
+		}
+	}
+}
+
+/*
+ * Same output as gfb_mono_convert_bits(), but every source byte is read
+ * once and spread over the 8 columns it covers. That only works while fb
+ * lines stay panel lines, rotations by 90 degrees go bit by bit.
+ */
+static void gfb_mono_convert_bytes(const struct gfb_panel *panel,
+				   const struct gfb_orientation *o,
+				   const u8 *bitmap, u8 *vbitmap,
+				   int x, int y, int w, int h)
+{
+	int xres, yres, ll;
+	int band, bx, fx, fx1, fx2, bit, bits, i;
+	const u8 *row_start;
+	u8 out[8];
+	u8 byte;
+
+	if (o->xy || o->yx) {
+		gfb_mono_convert_bits(panel, o, bitmap, vbitmap, x, y, w, h);
+		return;
+	}
+
+	/* Set the magic number */
+	vbitmap[0] = 0x03;
+
+	xres = panel->var.xres;
+	yres = panel->var.yres;
+	ll = o->line_length;
+
+	/* fb columns of the area */
+	fx1 = min(gfb_fb_x(o, x, 0), gfb_fb_x(o, x + w - 1, 0));
+	fx2 = max(gfb_fb_x(o, x, 0), gfb_fb_x(o, x + w - 1, 0)) + 1;
+
+	for (band = y / 8; band <= (y + h - 1) / 8; ++band) {
+		bits = min(8, yres - band * 8);
+		for (bx = fx1 / 8; bx <= (fx2 - 1) / 8; ++bx) {
+			memset(out, 0, sizeof(out));
+			for (bit = 0; bit < bits; ++bit) {
+				row_start = bitmap +
+					gfb_fb_y(o, 0, band * 8 + bit) * ll;
+				byte = row_start[bx];
+				for (i = 0; byte; ++i, byte >>= 1)
+					if (byte & 0x01)
+						out[i] |= 0x01 << bit;
+			}
+
+			fx = max(fx1, bx * 8);
+			for (; fx < min(fx2, bx * 8 + 8); ++fx)
+				vbitmap[32 + band * xres +
+					(fx - o->x0) * o->xx] = out[fx % 8];
+		}
+	}
+}
+
+static const struct gfb_converter gfb_mono_converters[] = {
+	{ "bytes", gfb_mono_convert_bytes },
+	{ "bits", gfb_mono_convert_bits },
+	{ }
+};
+
+static const struct gfb_converter gfb_qvga_converters[] = {
+	{ "columns", gfb_qvga_convert_columns },
+	{ "tiled", gfb_qvga_convert_tiled },
+	{ }
+};
+
+/* Orientations are described in hid-gfb.c */
+static void gfb_orientation_init(struct gfb_orientation *o,
+				 const struct gfb_panel *panel,
+				 u32 rotate, u8 flip)
+{
+	int xmax = panel->var.xres - 1;
+	int ymax = panel->var.yres - 1;
+
+	memset(o, 0, sizeof(*o));
+
+	switch (rotate) {
+	case FB_ROTATE_UR:
+		o->xx = 1;
+		o->yy = 1;
+		break;
+	case FB_ROTATE_CW:
+		o->xy = 1;
+		o->yx = -1;
+		o->y0 = xmax;
+		break;
+	case FB_ROTATE_UD:
+		o->xx = -1;
+		o->yy = -1;
+		o->x0 = xmax;
+		o->y0 = ymax;
+		break;
+	case FB_ROTATE_CCW:
+		o->xy = -1;
+		o->yx = 1;
+		o->x0 = ymax;
+		break;
+	}
+
+	if (rotate == FB_ROTATE_CW || rotate == FB_ROTATE_CCW) {
+		o->xres = panel->var.yres;
+		o->yres = panel->var.xres;
+		o->line_length = ALIGN(DIV_ROUND_UP(o->xres *
+				       panel->var.bits_per_pixel, 8), 4);
+	} else {
+		o->xres = panel->var.xres;
+		o->yres = panel->var.yres;
+		o->line_length = panel->fix.line_length;
+	}
+
+	/* Flips mirror the rotated image */
+	if (flip & GFB_FLIP_H) {
+		o->xx = -o->xx;
+		o->xy = -o->xy;
+		o->x0 = o->xres - 1 - o->x0;
+	}
+	if (flip & GFB_FLIP_V) {
+		o->yx = -o->yx;
+		o->yy = -o->yy;
+		o->y0 = o->yres - 1 - o->y0;
+	}
+}
+
+/* Blame vfb.c if things go wrong in gfb_truecolor */
+static u32 gfb_truecolor(const struct fb_var_screeninfo *var, unsigned red,
+			 unsigned green, unsigned blue, unsigned transp)
+{
+	/* grayscale works only partially under directcolor */
+	if (var->grayscale) {
+		/* grayscale = 0.30*R + 0.59*G + 0.11*B */
+		red = green = blue =
+				  (red * 77 + green * 151 + blue * 28) >> 8;
+	}
+
+#define CNVT_TOHW(val, width) ((((val)<<(width))+0x7FFF-(val))>>16)
+
+	red = CNVT_TOHW(red, var->red.length);
+	green = CNVT_TOHW(green, var->green.length);
+	blue = CNVT_TOHW(blue, var->blue.length);
+	transp = CNVT_TOHW(transp, var->transp.length);
+
+#undef CNVT_TOHW
+
+	return (red << var->red.offset) |
+	       (green << var->green.offset) |
+	       (blue << var->blue.offset) |
+	       (transp << var->transp.offset);
+}
+
+#endif
@@ -0,0 +1,337 @@
+/***************************************************************************
+ *   This program is free software: you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation, either version 2 of the License, or	   *
+ *   (at your option) any later version.				   *
+ *									   *
+ *   This driver is distributed in the hope that it will be useful, but	   *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of		   *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU	   *
+ *   General Public License for more details.				   *
+ *									   *
+ *   You should have received a copy of the GNU General Public License	   *
+ *   along with this software. If not see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+
+/*
+ * Headless gfb panels
+ *
+ * Each panel is a platform device with a real gfb framebuffer (and its
+ * text and tap devices) whose frames go to a simulated transport instead
+ * of USB. A frame keeps the transport busy for latency_us plus its size
+ * divided by bandwidth_kbs, which is what the send path would see from a
+ * device. The device attributes report what was transmitted:
+ *
+ *   frames       number of frames transmitted
+ *   bytes        bytes transmitted, transfer headers included
+ *   transfer_ns  simulated time spent transmitting
+ *   frame        the last frame transmitted, in the panel format
+ *
+ * Writing anything to reset clears the counters.
+ */
+
+#include <linux/fb.h>
+#include <linux/hrtimer.h>
+#include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/vmalloc.h>
+
+#include "hid-gfb.h"
+
+#define GFB_DUMMY_NAME "gfb-dummy"
+#define GFB_DUMMY_MAX 8
+
+static unsigned int mono = 1;
+module_param(mono, uint, 0444);
+MODULE_PARM_DESC(mono, "Number of 160x43 monochrome panels (default: 1)");
+
+static unsigned int qvga = 1;
+module_param(qvga, uint, 0444);
+MODULE_PARM_DESC(qvga, "Number of 320x240 RGB565 panels (default: 1)");
+
+static unsigned int latency_us;
+module_param(latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "Simulated transfer latency per frame (default: 0)");
+
+static unsigned int bandwidth_kbs;
+module_param(bandwidth_kbs, uint, 0644);
+MODULE_PARM_DESC(bandwidth_kbs, "Simulated bandwidth in kB/s (default: 0, unlimited)");
+
+struct gfb_dummy {
+	struct platform_device *pdev;
+	struct gfb_data *gfb_data;
+	struct hrtimer timer;
+
+	spinlock_t lock;	/* protects the counters, frame and stopping */
+	bool stopping;		/* no more transfers are started */
+	u64 frames;
+	u64 bytes;
+	u64 transfer_ns;
+	u8 *frame;		/* last frame transmitted */
+	size_t frame_size;
+};
+
+static struct gfb_dummy *gfb_dummies[GFB_DUMMY_MAX];
+
+static enum hrtimer_restart gfb_dummy_transfer_done(struct hrtimer *timer)
+{
+	struct gfb_dummy *dummy = container_of(timer, struct gfb_dummy, timer);
+
+	gfb_fb_send_done(dummy->gfb_data);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Called with fb_urb_lock held, see struct gfb_transport */
+static int gfb_dummy_submit(struct gfb_data *data)
+{
+	struct gfb_dummy *dummy = data->transport_data;
+	size_t size = data->fb_vbitmap_size;
+	u64 ns = (u64)READ_ONCE(latency_us) * NSEC_PER_USEC;
+	unsigned int bandwidth = READ_ONCE(bandwidth_kbs);
+
+	if (bandwidth)
+		ns += div_u64((u64)size * USEC_PER_SEC, bandwidth);
+
+	spin_lock(&dummy->lock);
+	if (dummy->stopping) {
+		spin_unlock(&dummy->lock);
+		return -ENODEV;
+	}
+	memcpy(dummy->frame, data->fb_vbitmap, size);
+	dummy->frames++;
+	dummy->bytes += size;
+	dummy->transfer_ns += ns;
+
+	if (ns == 0) {
+		spin_unlock(&dummy->lock);
+		return 1;
+	}
+
+	hrtimer_start(&dummy->timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+	spin_unlock(&dummy->lock);
+	return 0;
+}
+
+static const struct gfb_transport gfb_dummy_transport = {
+	.name = "dummy",
+	.submit = gfb_dummy_submit,
+};
+
+static ssize_t frames_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct gfb_dummy *dummy = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(dummy->frames));
+}
+
+static ssize_t bytes_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct gfb_dummy *dummy = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(dummy->bytes));
+}
+
+static ssize_t transfer_ns_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct gfb_dummy *dummy = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(dummy->transfer_ns));
+}
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct gfb_dummy *dummy = dev_get_drvdata(dev);
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&dummy->lock, irq_flags);
+	dummy->frames = 0;
+	dummy->bytes = 0;
+	dummy->transfer_ns = 0;
+	spin_unlock_irqrestore(&dummy->lock, irq_flags);
+
+	return count;
+}
+
+static ssize_t frame_read(struct file *file, struct kobject *kobj,
+			  struct bin_attribute *attr, char *buf,
+			  loff_t off, size_t count)
+{
+	struct gfb_dummy *dummy = dev_get_drvdata(kobj_to_dev(kobj));
+	unsigned long irq_flags;
+
+	if (off >= dummy->frame_size)
+		return 0;
+	count = min_t(size_t, count, dummy->frame_size - off);
+
+	spin_lock_irqsave(&dummy->lock, irq_flags);
+	memcpy(buf, dummy->frame + off, count);
+	spin_unlock_irqrestore(&dummy->lock, irq_flags);
+
+	return count;
+}
+
+static DEVICE_ATTR(frames, 0444, frames_show, NULL);
+static DEVICE_ATTR(bytes, 0444, bytes_show, NULL);
+static DEVICE_ATTR(transfer_ns, 0444, transfer_ns_show, NULL);
+static DEVICE_ATTR(reset, 0200, NULL, reset_store);
+static BIN_ATTR_RO(frame, 0);
+
+static struct attribute *gfb_dummy_attrs[] = {
+	&dev_attr_frames.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_transfer_ns.attr,
+	&dev_attr_reset.attr,
+	NULL,	 /* need to NULL terminate the list of attributes */
+};
+
+static struct bin_attribute *gfb_dummy_bin_attrs[] = {
+	&bin_attr_frame,
+	NULL,
+};
+
+static struct attribute_group gfb_dummy_attr_group = {
+	.attrs = gfb_dummy_attrs,
+	.bin_attrs = gfb_dummy_bin_attrs,
+};
+
+static void gfb_dummy_destroy(struct gfb_dummy *dummy)
+{
+	unsigned long irq_flags;
+
+	/* Complete the last transfer while the gfb data is still around */
+	spin_lock_irqsave(&dummy->lock, irq_flags);
+	dummy->stopping = true;
+	spin_unlock_irqrestore(&dummy->lock, irq_flags);
+	hrtimer_cancel(&dummy->timer);
+
+	/* After this, the transport is not entered anymore */
+	sysfs_remove_group(&dummy->pdev->dev.kobj, &gfb_dummy_attr_group);
+	gfb_remove(dummy->gfb_data);
+
+	platform_device_unregister(dummy->pdev);
+	vfree(dummy->frame);
+	kfree(dummy);
+}
+
+static struct gfb_dummy *gfb_dummy_create(int id, int panel_type)
+{
+	struct gfb_dummy *dummy;
+	unsigned long irq_flags;
+	int error;
+
+	dummy = kzalloc(sizeof(struct gfb_dummy), GFP_KERNEL);
+	if (dummy == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock_init(&dummy->lock);
+	dummy->stopping = true;	/* until there is a frame to copy to */
+	hrtimer_init(&dummy->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dummy->timer.function = gfb_dummy_transfer_done;
+
+	dummy->pdev = platform_device_register_simple(GFB_DUMMY_NAME, id,
+						      NULL, 0);
+	if (IS_ERR(dummy->pdev)) {
+		error = PTR_ERR(dummy->pdev);
+		goto err_cleanup_dummy;
+	}
+	platform_set_drvdata(dummy->pdev, dummy);
+
+	dummy->gfb_data = gfb_probe_transport(&dummy->pdev->dev, panel_type,
+					      &gfb_dummy_transport, dummy);
+	if (dummy->gfb_data == NULL) {
+		error = -ENOMEM;
+		goto err_cleanup_pdev;
+	}
+
+	dummy->frame = vzalloc(dummy->gfb_data->fb_vbitmap_size);
+	if (dummy->frame == NULL) {
+		error = -ENOMEM;
+		goto err_cleanup_gfb;
+	}
+
+	error = sysfs_create_group(&dummy->pdev->dev.kobj,
+				   &gfb_dummy_attr_group);
+	if (error)
+		goto err_cleanup_gfb;
+
+	spin_lock_irqsave(&dummy->lock, irq_flags);
+	dummy->frame_size = dummy->gfb_data->fb_vbitmap_size;
+	dummy->stopping = false;
+	spin_unlock_irqrestore(&dummy->lock, irq_flags);
+
+	dev_info(&dummy->pdev->dev, "%s panel on fb%d\n",
+		 dummy->gfb_data->panel->name,
+		 dummy->gfb_data->fb_info->node);
+
+	return dummy;
+
+err_cleanup_gfb:
+	gfb_remove(dummy->gfb_data);
+	vfree(dummy->frame);
+
+err_cleanup_pdev:
+	platform_device_unregister(dummy->pdev);
+
+err_cleanup_dummy:
+	kfree(dummy);
+	return ERR_PTR(error);
+}
+
+static void gfb_dummy_exit(void)
+{
+	int i;
+
+	for (i = 0; i < GFB_DUMMY_MAX; i++) {
+		if (gfb_dummies[i])
+			gfb_dummy_destroy(gfb_dummies[i]);
+		gfb_dummies[i] = NULL;
+	}
+}
+
+static int __init gfb_dummy_init(void)
+{
+	struct gfb_dummy *dummy;
+	int panel_type;
+	int i;
+
+	if (mono + qvga > GFB_DUMMY_MAX) {
+		pr_err(GFB_DUMMY_NAME ": at most %d panels\n", GFB_DUMMY_MAX);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < mono + qvga; i++) {
+		panel_type = i < mono ? GFB_PANEL_TYPE_160_43_1 :
+			GFB_PANEL_TYPE_320_240_16;
+
+		dummy = gfb_dummy_create(i, panel_type);
+		if (IS_ERR(dummy)) {
+			gfb_dummy_exit();
+			return PTR_ERR(dummy);
+		}
+		gfb_dummies[i] = dummy;
+	}
+
+	return 0;
+}
+
+static void __exit gfb_dummy_cleanup(void)
+{
+	gfb_dummy_exit();
+}
+
+module_init(gfb_dummy_init);
+module_exit(gfb_dummy_cleanup);
+
+MODULE_DESCRIPTION("Headless Logitech GamePanel framebuffers for benchmarks");
+MODULE_LICENSE("GPL");
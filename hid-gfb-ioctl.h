@@ -0,0 +1,155 @@
+#ifndef HID_GFB_IOCTL_H_INCLUDED
+#define HID_GFB_IOCTL_H_INCLUDED		1
+
+/*
+ * Userspace interface of the gfb framebuffers, on top of the standard
+ * fbdev ioctls. This header is shared by the driver and by the tools.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define GFB_IOC_MAGIC 'g'
+
+/* Sprite cache */
+#define GFB_SPRITE_MAX 64	/* sprite ids are 0 .. GFB_SPRITE_MAX-1 */
+#define GFB_BLIT_MAX 256	/* blits per GFB_IOC_BLIT call */
+
+#define GFB_SPRITE_MASKED 0x01	/* a transparency mask is supplied */
+
+/*
+ * Upload a sprite into the cache, replacing any sprite with the same id.
+ *
+ * The pixels are in the framebuffer format, rows packed without padding:
+ * DIV_ROUND_UP(width, 8) bytes per row on monochrome panels (bit 0 is the
+ * leftmost pixel), width * 2 bytes per row on RGB565 panels.
+ *
+ * The optional mask uses one bit per pixel with the monochrome layout;
+ * only pixels whose mask bit is set are drawn.
+ */
+struct gfb_sprite_upload {
+	__u32 id;
+	__u32 flags;		/* GFB_SPRITE_ values */
+	__u16 width;
+	__u16 height;
+	__u32 reserved;		/* must be 0 */
+	__u64 pixels;		/* user pointer */
+	__u64 mask;		/* user pointer, used with GFB_SPRITE_MASKED */
+};
+
+/* Draw cached sprite id with its top left corner at x,y (clipped) */
+struct gfb_blit {
+	__u16 id;
+	__u16 flags;		/* must be 0 */
+	__s16 x;
+	__s16 y;
+};
+
+/* Apply count blits in order, then send the frame once */
+struct gfb_blit_batch {
+	__u32 count;
+	__u32 reserved;		/* must be 0 */
+	__u64 blits;		/* user pointer to struct gfb_blit[count] */
+};
+
+/* Animation playback */
+#define GFB_ANIM_MAX_FRAMES 64
+
+#define GFB_ANIM_FORMAT_FB	0	/* frames in the framebuffer format */
+#define GFB_ANIM_FORMAT_NATIVE	1	/* frames in the panel format */
+
+/*
+ * Preload an animation, replacing (and stopping) the current one.
+ *
+ * The frames are stored back to back. GFB_ANIM_FORMAT_FB frames are
+ * line_length * yres bytes, laid out like the framebuffer; they are
+ * converted once at load time, in the orientation of that time.
+ * GFB_ANIM_FORMAT_NATIVE frames are what the panel receives, without the
+ * transfer header: DIV_ROUND_UP(yres, 8) * xres bytes of
+ * vertical 8 pixel columns on monochrome panels, xres * yres RGB565 pixels
+ * in column-major order on QVGA panels.
+ *
+ * Each frame stays on screen for its duration, rounded up to the fb update
+ * interval. Playback loops until GFB_IOC_ANIM_STOP or until a client draws
+ * on the panel by any means.
+ */
+struct gfb_anim_load {
+	__u32 count;
+	__u32 format;		/* GFB_ANIM_FORMAT_ value */
+	__u64 frames;		/* user pointer */
+	__u64 durations;	/* user pointer to __u32 milliseconds per frame */
+};
+
+/*
+ * Frame tap
+ *
+ * /dev/fbtapN streams the frames sent to the panel, in the panel format
+ * without the transfer header (see struct gfb_anim_load), cut into tiles of
+ * GFB_TAP_TILE bytes. Each record lists the tiles that differ from the
+ * previous record; the first record after open, after a reader fell too
+ * far behind and after GFB_IOC_TAP_KEYFRAME is a keyframe carrying all
+ * tiles. Frames sent faster than they are diffed are merged into the next
+ * record, seq then skips their numbers.
+ */
+#define GFB_TAP_TILE 64
+
+#define GFB_TAP_KEYFRAME 0x01
+
+struct gfb_tap_record {
+	__u32 size;		/* bytes in the record, this header included */
+	__u32 seq;		/* number of the frame sent */
+	__u32 flags;		/* GFB_TAP_ values */
+	__u32 tiles;		/* number of struct gfb_tap_tile that follow */
+};
+
+struct gfb_tap_tile {
+	__u32 index;		/* offset in the frame / GFB_TAP_TILE */
+	__u8 data[GFB_TAP_TILE]; /* zero padded past the end of the frame */
+};
+
+/*
+ * Frame queue
+ *
+ * /dev/fbqueueN takes complete frames from one client at a time, laid out
+ * like the framebuffer (line_length * yres bytes). Each frame is sent no
+ * earlier than its present time, in submission order; a frame is dropped
+ * when a later one is due too. For every frame submitted, read() returns a
+ * struct gfb_queue_event telling when it was sent or that it was dropped.
+ *
+ * There are GFB_QUEUE_SLOTS slots, and a slot is free again once the
+ * event of its frame has been read. GFB_IOC_QUEUE_SUBMIT waits for a free
+ * slot (EAGAIN with O_NONBLOCK, or when only reading events would free
+ * one); poll() reports POLLOUT when a slot is free and POLLIN when events
+ * are ready. GFB_IOC_QUEUE_DROP drops all frames not sent yet.
+ */
+#define GFB_QUEUE_SLOTS 4
+
+#define GFB_QUEUE_SHOWN		0	/* the frame was sent to the panel */
+#define GFB_QUEUE_DROPPED	1	/* the frame was not sent */
+
+struct gfb_queue_frame {
+	__u64 frame;		/* user pointer */
+	__u64 present_ns;	/* CLOCK_MONOTONIC, 0 for as soon as possible */
+	__u64 cookie;		/* passed back in the event */
+	__u32 flags;		/* must be 0 */
+	__u32 reserved;		/* must be 0 */
+};
+
+struct gfb_queue_event {
+	__u64 cookie;
+	__u64 time_ns;		/* CLOCK_MONOTONIC time it was sent or dropped */
+	__u32 status;		/* GFB_QUEUE_ value */
+	__u32 reserved;
+};
+
+#define GFB_IOC_SPRITE_UPLOAD	_IOW(GFB_IOC_MAGIC, 0x01, struct gfb_sprite_upload)
+#define GFB_IOC_SPRITE_FREE	_IOW(GFB_IOC_MAGIC, 0x02, __u32)
+#define GFB_IOC_BLIT		_IOW(GFB_IOC_MAGIC, 0x03, struct gfb_blit_batch)
+#define GFB_IOC_ANIM_LOAD	_IOW(GFB_IOC_MAGIC, 0x10, struct gfb_anim_load)
+#define GFB_IOC_ANIM_START	_IO(GFB_IOC_MAGIC, 0x11)
+#define GFB_IOC_ANIM_STOP	_IO(GFB_IOC_MAGIC, 0x12)
+#define GFB_IOC_QUEUE_SUBMIT	_IOW(GFB_IOC_MAGIC, 0x20, struct gfb_queue_frame)
+#define GFB_IOC_QUEUE_DROP	_IO(GFB_IOC_MAGIC, 0x21)
+#define GFB_IOC_TAP_KEYFRAME	_IO(GFB_IOC_MAGIC, 0x30)
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef GFB_PANEL_TYPES_H_INCLUDED
+#define GFB_PANEL_TYPES_H_INCLUDED	1
+
+/*
+ * The panel description and the converter interface. These don't depend
+ * on the rest of the driver, so tools/gfb-bench builds against them too.
+ */
+
+#include <linux/fb.h>
+
+struct gfb_panel;
+struct gfb_panel_ops;
+struct gfb_transport;
+
+/* Bits of the fb_flip attribute, applied after var.rotate */
+#define GFB_FLIP_H	0x01
+#define GFB_FLIP_V	0x02
+#define GFB_FLIPS	4
+
+/*
+ * Where panel pixel x,y is taken from in the fb for one rotation and flip:
+ * at fb x0 + x * xx + y * xy, y0 + x * yx + y * yy.
+ */
+struct gfb_orientation {
+	int xx, xy, yx, yy;
+	int x0, y0;
+	u32 xres, yres;		/* fb geometry in this orientation */
+	u32 line_length;
+};
+
+/* Converts an area of an fb format image into the panel format */
+struct gfb_converter {
+	const char *name;
+	/* x, y, w, h is in panel coordinates */
+	void (*convert)(const struct gfb_panel *panel,
+			const struct gfb_orientation *o,
+			const u8 *bitmap, u8 *vbitmap,
+			int x, int y, int w, int h);
+};
+
+/* Bits of struct gfb_panel caps */
+#define GFB_PANEL_MIRROR	0x01	/* fb_mirror can sample into it */
+#define GFB_PANEL_SPAN		0x02	/* can be a cell of the span fb */
+
+/* Everything that differs between panel models */
+struct gfb_panel {
+	const char *name;
+	struct fb_fix_screeninfo fix;
+	struct fb_var_screeninfo var;
+	size_t header_size;	/* bytes in front of the pixels in a vbitmap */
+	size_t vbitmap_size;
+	int damage_rows;	/* converted areas are aligned to this */
+	unsigned int caps;	/* GFB_PANEL_ bits */
+	const struct gfb_converter *converters; /* default first */
+	const struct gfb_panel_ops *ops;
+	const struct gfb_transport *transport;
+};
+
+#endif
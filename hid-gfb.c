@@ -16,10 +16,15 @@
  *   You should have received a copy of the GNU General Public License	   *
  *   along with this software. If not see <http://www.gnu.org/licenses/>.  *
  ***************************************************************************/
+#include <linux/compat.h>
 #include <linux/fb.h>
+#include <linux/firmware.h>
+#include <linux/font.h>
+#include <linux/fs.h>
 #include <linux/hid.h>
 #include <linux/init.h>
 #include <linux/input.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/sysfs.h>
@@ -27,18 +32,42 @@
 #include <linux/usb.h>
 #include <linux/vmalloc.h>
 #include <linux/leds.h>
+#include <linux/major.h>
 #include <linux/completion.h>
 #include <linux/delay.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/string.h>
 
 #include "../hid-ids.h"
 #include "hid-gcore.h"
+#include "hid-gcore-trace.h"
 #include "hid-gfb.h"
+#include "hid-gfb-ioctl.h"
+#include "hid-gfb-convert.h"
 
 #define GFB_NAME "Logitech GamePanel Framebuffer"
 
 /* Framebuffer defines */
 #define GFB_UPDATE_RATE_LIMIT (30)
 #define GFB_UPDATE_RATE_DEFAULT (30)
+#define GFB_WRITE_BAND_SIZE (8 * 1024) /* bytes of fb lines per conversion */
+
+/* Text device defines */
+#define GFB_TEXT_CELL_UNKNOWN (0xFFFF)
+#define GFB_TEXT_GLYPHS (256)
+#define GFB_TEXT_WRITE_MAX (PAGE_SIZE)
+
+/* Frame tap defines */
+#define GFB_TAP_RING_SIZE (512 * 1024) /* power of two */
+
+/* Spanning defines */
+#define GFB_SPAN_MAX (16) /* panels */
+#define GFB_SPAN_PANEL_XRES (320)
+#define GFB_SPAN_PANEL_YRES (240)
+
+/* Sprite cache defines */
+#define GFB_SPRITE_CACHE_SIZE (1024 * 1024) /* bytes per device */
 
 /* Convenience macros */
 #define dev_get_gfbdata(dev)					\
@@ -46,261 +75,413 @@
 
 static uint32_t pseudo_palette[16];
 
+static char *text_font;
+module_param(text_font, charp, 0444);
+MODULE_PARM_DESC(text_font, "Font of the text devices (default: first of 6x8, VGA8x8, MINI4x6, ...)");
+
+static bool loopback;
+module_param(loopback, bool, 0444);
+MODULE_PARM_DESC(loopback, "Drop frames instead of sending them to the panels, for tests (default: false)");
+
+static bool splash = true;
+module_param(splash, bool, 0444);
+MODULE_PARM_DESC(splash, "Show gfb/splash-*.bin from the firmware path at probe (default: true)");
+
+/* Fonts tried in order when text_font is not set or not available */
+static const char * const gfb_text_fonts[] = {
+	"6x8", "VGA8x8", "MINI4x6", "6x10", "ProFont6x11", "7x14", "VGA8x16",
+};
+
 /* Forward decl. */
 static void gfb_free_data(struct kref *kref);
 
-/* Unlock the urb so we can reuse it */
-static void gfb_fb_urb_completion(struct urb *urb)
+/*
+ * Transports
+ *
+ * A transport starts sending fb_vbitmap to the panel. It is called with
+ * fb_urb_lock held and returns 0 once the frame is in flight, calling
+ * gfb_fb_send_done() when the vbitmap may be reused, 1 if it was consumed
+ * on the spot, or a negative error.
+ */
+
+/* Unlock the vbitmap so we can reuse it */
+void gfb_fb_send_done(struct gfb_data *data)
 {
-	/* we need to unlock fb_vbitmap regardless of urb success status */
 	unsigned long irq_flags;
-	struct gfb_data *data = urb->context;
 
 	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
 	data->fb_vbitmap_busy = false;
 	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
 }
+EXPORT_SYMBOL_GPL(gfb_fb_send_done);
 
-/* Send the current framebuffer vbitmap as an interrupt message */
-static int gfb_fb_send(struct gfb_data *data)
+static void gfb_fb_urb_completion(struct urb *urb)
+{
+	struct gfb_data *data = urb->context;
+
+	trace_lg4l_urb_complete(data->hdev, urb, urb->status);
+
+	/* we need to unlock fb_vbitmap regardless of urb success status */
+	gfb_fb_send_done(data);
+}
+
+/* Send the vbitmap on endpoint 2 of the interface */
+static int gfb_usb_submit(struct gfb_data *data, bool bulk)
 {
 	struct usb_interface *intf;
 	struct usb_device *usb_dev;
-	struct hid_device *hdev = data->hdev;
-
 	struct usb_host_endpoint *ep;
 	unsigned int pipe;
-	int retval = 0;
-	unsigned long irq_flags;
+	int ret;
 
-	/* This would fail down below if the device was removed. */
-	if (data->virtualized)
+	/* Get the usb device to send the image on */
+	intf = to_usb_interface(data->hdev->dev.parent);
+	usb_dev = interface_to_usbdev(intf);
+
+	if (bulk)
+		pipe = usb_sndbulkpipe(usb_dev, 0x02);
+	else
+		pipe = usb_sndintpipe(usb_dev, 0x02);
+
+	ep = (usb_pipein(pipe) ?
+	      usb_dev->ep_in : usb_dev->ep_out)[usb_pipeendpoint(pipe)];
+
+	if (unlikely(!ep))
 		return -ENODEV;
 
+	if (bulk)
+		usb_fill_bulk_urb(data->fb_urb, usb_dev, pipe,
+				  data->fb_vbitmap,
+				  data->fb_vbitmap_size,
+				  gfb_fb_urb_completion, data);
+	else
+		usb_fill_int_urb(data->fb_urb, usb_dev, pipe,
+				 data->fb_vbitmap,
+				 data->fb_vbitmap_size,
+				 gfb_fb_urb_completion, data,
+				 ep->desc.bInterval);
+
+	data->fb_urb->actual_length = 0;
+
+	/* atomic since we're holding a spinlock */
+	ret = usb_submit_urb(data->fb_urb, GFP_ATOMIC);
+	trace_lg4l_urb_submit(data->hdev, data->fb_urb, ret);
+	return ret;
+}
+
+static int gfb_usb_int_submit(struct gfb_data *data)
+{
+	return gfb_usb_submit(data, false);
+}
+
+static int gfb_usb_bulk_submit(struct gfb_data *data)
+{
+	return gfb_usb_submit(data, true);
+}
+
+/* Frames are dropped as soon as they are ready, for tests */
+static int gfb_loopback_submit(struct gfb_data *data)
+{
+	return 1;
+}
+
+static const struct gfb_transport gfb_usb_int_transport = {
+	.name = "usb-int",
+	.submit = gfb_usb_int_submit,
+};
+
+static const struct gfb_transport gfb_usb_bulk_transport = {
+	.name = "usb-bulk",
+	.submit = gfb_usb_bulk_submit,
+};
+
+static const struct gfb_transport gfb_loopback_transport = {
+	.name = "loopback",
+	.submit = gfb_loopback_submit,
+};
+
+/*
+ * Send the current framebuffer vbitmap through the transport, or return
+ * -EBUSY if the previous one is still in flight
+ */
+static void gfb_tap_snapshot(struct gfb_data *data);
+
+static int gfb_fb_try_send(struct gfb_data *data)
+{
+	int retval;
+	unsigned long irq_flags;
+
 	/*
 	 * Try and lock the framebuffer urb to prevent access if we have
-	 * submitted it. If we can't lock it we'll have to delay this update
-	 * until the next framebuffer interval.
-	 *
-	 * Fortunately, we already have the infrastructure in place with the
-	 * framebuffer deferred I/O driver to schedule the delayed update.
+	 * submitted it.
 	 */
 
 	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
-	if (likely(!data->fb_vbitmap_busy)) {
-		/* Get the usb device to send the image on */
-		intf = to_usb_interface(hdev->dev.parent);
-		usb_dev = interface_to_usbdev(intf);
-
-		switch (data->panel_type) {
-		case GFB_PANEL_TYPE_160_43_1:
-			pipe = usb_sndintpipe(usb_dev, 0x02);
-			break;
-		case GFB_PANEL_TYPE_320_240_16:
-			pipe = usb_sndbulkpipe(usb_dev, 0x02);
-			break;
-		default:
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return -EINVAL;
-		}
 
-		ep = (usb_pipein(pipe) ?
-		      usb_dev->ep_in : usb_dev->ep_out)[usb_pipeendpoint(pipe)];
+	/*
+	 * This would fail down below if the device was removed. Checked
+	 * under the lock, so gfb_remove() can wait for the transport.
+	 */
+	if (data->virtualized) {
+		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+		return -ENODEV;
+	}
+
+	if (unlikely(data->fb_vbitmap_busy)) {
+		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+		return -EBUSY;
+	}
 
-		if (unlikely(!ep)) {
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return -ENODEV;
-		}
+	retval = data->transport->submit(data);
+	if (unlikely(retval < 0)) {
+		/*
+		 * Nothing is in flight, so the completion won't be called
+		 * and the vbitmap stays unlocked.
+		 */
+		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+		return retval;
+	}
 
-		switch (data->panel_type) {
-		case GFB_PANEL_TYPE_160_43_1:
-			usb_fill_int_urb(data->fb_urb, usb_dev, pipe,
-					 data->fb_vbitmap,
-					 data->fb_vbitmap_size,
-					 gfb_fb_urb_completion, data,
-					 ep->desc.bInterval);
-			break;
-		case GFB_PANEL_TYPE_320_240_16:
-			usb_fill_bulk_urb(data->fb_urb, usb_dev, pipe,
-					  data->fb_vbitmap,
-					  data->fb_vbitmap_size,
-					  gfb_fb_urb_completion, data);
-			break;
-		default:
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return -EINVAL;
-		}
+	/* Mark the softlock unless the frame is already consumed */
+	data->fb_vbitmap_busy = (retval == 0);
 
-		data->fb_urb->actual_length = 0;
-
-		/* atomic since we're holding a spinlock */
-		retval = usb_submit_urb(data->fb_urb, GFP_ATOMIC);
-		if (unlikely(retval < 0)) {
-			/*
-			 * We need to unlock the framebuffer urb lock since
-			 * the urb submission failed and therefore
-			 * g19_fb_urb_completion() won't be called.
-			 */
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return retval;
-		}
+	if (atomic_read(&data->tap_readers))
+		gfb_tap_snapshot(data);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
 
-		/* All succeeded - mark the softlock and unlock the spinlock */
-		data->fb_vbitmap_busy = true;
-		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-	} else {
-		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+	return 0;
+}
+
+/* Send the current framebuffer vbitmap as an interrupt message */
+static int gfb_fb_send(struct gfb_data *data)
+{
+	int retval = gfb_fb_try_send(data);
+
+	/*
+	 * If we can't lock the urb we'll have to delay this update until the
+	 * next framebuffer interval.
+	 *
+	 * Fortunately, we already have the infrastructure in place with the
+	 * framebuffer deferred I/O driver to schedule the delayed update.
+	 */
+	if (retval == -EBUSY) {
 		schedule_delayed_work(&data->fb_info->deferred_work,
 				      data->fb_defio.delay);
+		retval = 0;
 	}
 
 	return retval;
 }
 
 
-static char hdata[512] = {
-	0x10, 0x0f, 0x00, 0x58, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3f,
-	0x01, 0xef, 0x00, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-	0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23,
-	0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
-	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
-	0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
-	0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53,
-	0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
-	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b,
-	0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
-	0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83,
-	0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
-	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b,
-	0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
-	0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3,
-	0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
-	0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb,
-	0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
-	0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf, 0xe0, 0xe1, 0xe2, 0xe3,
-	0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
-	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb,
-	0xfc, 0xfd, 0xfe, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13,
-	0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
-	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b,
-	0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-	0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43,
-	0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
-	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b,
-	0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
-	0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73,
-	0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
-	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b,
-	0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
-	0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3,
-	0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
-	0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb,
-	0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
-	0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3,
-	0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
-	0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb,
-	0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
-	0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+/* Drawing routines of the panels, see the text device and the sprites */
+static void gfb_text_mono_column(struct gfb_data *data, int x, int y, int h,
+				 u32 bits, bool direct);
+static void gfb_text_qvga_column(struct gfb_data *data, int x, int y, int h,
+				 u32 bits, bool direct);
+static void gfb_sprite_draw_mono(struct gfb_data *data,
+				 const struct gfb_sprite *sprite,
+				 int sx, int sy, int dx, int dy, int w, int h);
+static void gfb_sprite_draw_qvga(struct gfb_data *data,
+				 const struct gfb_sprite *sprite,
+				 int sx, int sy, int dx, int dy, int w, int h);
+
+static const struct gfb_panel_ops gfb_mono_ops = {
+	.text_column = gfb_text_mono_column,
+	.sprite_draw = gfb_sprite_draw_mono,
 };
 
-/* Update fb_vbitmap from the screen_base and send to the device */
-static void gfb_fb_qvga_update(struct gfb_data *data)
-{
-	int xres, yres;
-	int col, row;
-	u16 *src, *dst;
-
-	/* Set the image message header */
-	memcpy(data->fb_vbitmap, &hdata, sizeof(hdata));
+static const struct gfb_panel_ops gfb_qvga_ops = {
+	.text_column = gfb_text_qvga_column,
+	.sprite_draw = gfb_sprite_draw_qvga,
+};
 
-	/* LCD is a portrait mode one so we have to rotate the framebuffer */
+/* The panels, indexed by GFB_PANEL_TYPE_ values */
+static const struct gfb_panel gfb_panels[] = {
+	[GFB_PANEL_TYPE_160_43_1] = {
+		.name = "mono",
+		.fix = {
+			.id = "GFB_MONO",
+			.type = FB_TYPE_PACKED_PIXELS,
+			.visual = FB_VISUAL_MONO01,
+			.xpanstep = 0,
+			.ypanstep = 0,
+			.ywrapstep = 0,
+			.line_length = 32, /* = xres*bpp/8 + 12 bytes padding */
+			.accel = FB_ACCEL_NONE,
+		},
+		.var = {
+			.xres = 160,
+			.yres = 43,
+			.xres_virtual = 160,
+			.yres_virtual = 43,
+			.bits_per_pixel = 1,
+		},
+		/*
+		 * The native monochrome format uses vertical bits. Therefore
+		 * the number of bytes needed to represent the first column is
+		 * 43/8 (rows/bits) rounded up.
+		 * Additionally, the format requires a padding of 32 bits in
+		 * front of theimage data.
+		 *
+		 * Therefore the vbitmap size must be:
+		 *   160 * ceil(43/8) + 32 = 160 * 6 + 32 = 992
+		 */
+		.header_size = 32,
+		.vbitmap_size = 992, /* = 32 + ceil(yres/8) * xres */
+		.damage_rows = 8,
+		.converters = gfb_mono_converters,
+		.ops = &gfb_mono_ops,
+		.transport = &gfb_usb_int_transport,
+	},
+	[GFB_PANEL_TYPE_320_240_16] = {
+		.name = "qvga",
+		.fix = {
+			.id = "GFB_QVGA",
+			.type = FB_TYPE_PACKED_PIXELS,
+			.visual = FB_VISUAL_TRUECOLOR,
+			.xpanstep = 0,
+			.ypanstep = 0,
+			.ywrapstep = 0,
+			.line_length = 640, /*	 = xres * bpp/8 */
+			.accel = FB_ACCEL_NONE,
+		},
+		.var = {
+			.xres = 320,
+			.yres = 240,
+			.xres_virtual = 320,
+			.yres_virtual = 240,
+			.bits_per_pixel = 16,
+			.red	    = {11, 5, 0}, /* RGB565 */
+			.green	    = { 5, 6, 0},
+			.blue	    = { 0, 5, 0},
+			.transp	    = { 0, 0, 0},
+		},
+		.header_size = sizeof(hdata),
+		.vbitmap_size = 154112, /* = yres * line_length +
+					 *   sizeof(hdata) */
+		.damage_rows = 1,
+		.caps = GFB_PANEL_MIRROR | GFB_PANEL_SPAN,
+		.converters = gfb_qvga_converters,
+		.ops = &gfb_qvga_ops,
+		.transport = &gfb_usb_bulk_transport,
+	},
+};
 
-	src = (u16 *)data->fb_bitmap;
-	dst = (u16 *)(data->fb_vbitmap + sizeof(hdata));
+/* Convert the x,y,w,h area of an fb image into the device format */
+static int gfb_convert_rect(struct gfb_data *data, const u8 *bitmap,
+			    u8 *vbitmap, int x, int y, int w, int h)
+{
+	const struct gfb_converter *converter = READ_ONCE(data->converter);
+	const struct gfb_orientation *o = READ_ONCE(data->orientation);
+	int rows = data->panel->damage_rows;
+	int fx2, fy2;
+	int x1, y1, x2, y2;
+
+	/* The caller may have measured the fb before it was rotated */
+	fx2 = min_t(int, x + w, o->xres) - 1;
+	fy2 = min_t(int, y + h, o->yres) - 1;
+	x = max(x, 0);
+	y = max(y, 0);
+	if (fx2 < x || fy2 < y)
+		return 0;
+
+	/* Panel area of the fb area, from two opposite corners */
+	x1 = (x - o->x0) * o->xx + (y - o->y0) * o->yx;
+	y1 = (x - o->x0) * o->xy + (y - o->y0) * o->yy;
+	x2 = (fx2 - o->x0) * o->xx + (fy2 - o->y0) * o->yx;
+	y2 = (fx2 - o->x0) * o->xy + (fy2 - o->y0) * o->yy;
+
+	x = min(x1, x2);
+	w = max(x1, x2) + 1 - x;
+	y = min(y1, y2);
+	y2 = max(y1, y2) + 1;
+
+	/* Whole units of damage, as the panel format packs rows together */
+	y = rounddown(y, rows);
+	h = min_t(int, roundup(y2, rows), data->panel->var.yres) - y;
+
+	trace_lg4l_convert_start(data->fb_info, x, y, w, h);
+	converter->convert(data->panel, o, bitmap, vbitmap, x, y, w, h);
+	trace_lg4l_convert_end(data->fb_info, x, y, w, h);
+	return 0;
+}
 
-	xres = data->fb_info->var.xres;
-	yres = data->fb_info->var.yres;
-	for (col = 0; col < xres; ++col)
-		for (row = 0; row < yres; ++row)
-			*dst++ = src[row * xres + col];
+/* Convert the x,y,w,h area of fb_bitmap into fb_vbitmap */
+static int gfb_fb_convert_rect(struct gfb_data *data,
+			       int x, int y, int w, int h)
+{
+	return gfb_convert_rect(data, data->fb_bitmap, data->fb_vbitmap,
+				x, y, w, h);
 }
 
-static void gfb_fb_mono_update(struct gfb_data *data)
+/* Convert the whole fb_bitmap into the device format in fb_vbitmap */
+static int gfb_fb_convert(struct gfb_data *data)
 {
-	int xres, yres, ll;
-	int band, bands, col, bit;
-	u8 *dst, *src, *row_start;
-	u8 mask;
+	WRITE_ONCE(data->fb_vbitmap_stale, false);
+	return gfb_fb_convert_rect(data, 0, 0, data->fb_info->var.xres,
+				   data->fb_info->var.yres);
+}
 
-	/* Clear the vbitmap (we only flip bits to 1 later on) */
-	memset(data->fb_vbitmap, 0x00, data->fb_vbitmap_size);
+/*
+ * Convert the x,y,w,h area of fb_bitmap for a partial update, or all of it
+ * if an animation or a queued frame replaced the vbitmap since the last
+ * conversion.
+ */
+static int gfb_fb_convert_damage(struct gfb_data *data,
+				 int x, int y, int w, int h)
+{
+	if (READ_ONCE(data->fb_vbitmap_stale))
+		return gfb_fb_convert(data);
+	return gfb_fb_convert_rect(data, x, y, w, h);
+}
 
-	/* Set the magic number */
-	data->fb_vbitmap[0] = 0x03;
+/*
+ * Stop the animation because a client draws on the panel.
+ *
+ * This may be called in atomic context, so a running frame is not waited
+ * for; taking anim_lock is enough to know it is not halfway through
+ * replacing the vbitmap, and it won't send another one. The vbitmap still
+ * holds the last frame, so the next update converts the whole bitmap.
+ */
+static void gfb_anim_stop(struct gfb_data *data)
+{
+	unsigned long irq_flags;
 
-	/*
-	 * Translate the XBM format screen_base into the format needed by the
-	 * G15. This format places the pixels in a vertical rather than
-	 * horizontal format. Assuming a grid with 0,0 in the upper left corner
-	 * and 159,42 in the lower right corner, the first byte contains the
-	 * pixels 0,0 through 0,7 and the second byte contains the pixels 1,0
-	 * through 1,7. Within the byte, bit 0 represents 0,0; bit 1 0,1; etc.
-	 *
-	 * The offset is adjusted by 32 within the image message.
-	 */
+	if (likely(!data->anim_playing))
+		return;
 
-	xres = data->fb_info->var.xres;
-	yres = data->fb_info->var.yres;
-	ll = data->fb_info->fix.line_length;
-
-	dst = data->fb_vbitmap + 32;
-
-	bands = (yres + 7) / 8; /* poor man's ceil(yres/8) */
-	for (band = 0; band < bands ; ++band) {
-		/* each band is 8 pixels vertically */
-		row_start = data->fb_bitmap + band * 8 * ll;
-		for (col = 0; col < xres; ++col) {
-			src = row_start + col / 8;
-			mask = 0x01 << (col % 8);
-			for (bit = 0 ; bit < 8 ; ++bit) {
-				if (*src & mask)
-					*dst |= (0x01 << bit);
-				src += ll;
-			}
-			++dst;
-		}
+	spin_lock_irqsave(&data->anim_lock, irq_flags);
+	if (data->anim_playing) {
+		data->anim_playing = false;
+		WRITE_ONCE(data->fb_vbitmap_stale, true);
+		data->text_stale = true;
 	}
+	spin_unlock_irqrestore(&data->anim_lock, irq_flags);
+
+	cancel_delayed_work(&data->anim_work);
 }
 
 static int gfb_fb_update(struct gfb_data *data)
 {
-	int result = 0;
+	gfb_anim_stop(data);
 
-	switch (data->panel_type) {
-	case GFB_PANEL_TYPE_160_43_1:
-		gfb_fb_mono_update(data);
-		result = gfb_fb_send(data);
-		break;
-	case GFB_PANEL_TYPE_320_240_16:
-		gfb_fb_qvga_update(data);
-		result = gfb_fb_send(data);
-		break;
-	default:
-		break;
-	}
-	return result;
+	/* The text device can no longer trust what it believes is shown */
+	data->text_stale = true;
+
+	if (gfb_fb_convert(data) < 0)
+		return 0;
+	return gfb_fb_send(data);
 }
 
 /* Callback from deferred IO workqueue */
 static void gfb_fb_deferred_io(struct fb_info *info, struct list_head *pagelist)
 {
+	trace_lg4l_defio(info);
 	gfb_fb_update(info->par);
 }
 
 
-/* Blame vfb.c if things go wrong in gfb_fb_setcolreg */
-
 static int gfb_fb_setcolreg(unsigned regno, unsigned red, unsigned green,
 			    unsigned blue, unsigned transp,
 			    struct fb_info *info)
@@ -308,30 +489,9 @@ static int gfb_fb_setcolreg(unsigned regno, unsigned red, unsigned green,
 	if (regno >= 16)
 		return 1;
 
-	/* grayscale works only partially under directcolor */
-	if (info->var.grayscale) {
-		/* grayscale = 0.30*R + 0.59*G + 0.11*B */
-		red = green = blue =
-				  (red * 77 + green * 151 + blue * 28) >> 8;
-	}
-
 	/* Truecolor has hardware independent palette */
 	if (info->fix.visual == FB_VISUAL_TRUECOLOR) {
-		u32 v;
-
-#define CNVT_TOHW(val, width) ((((val)<<(width))+0x7FFF-(val))>>16)
-
-		red = CNVT_TOHW(red, info->var.red.length);
-		green = CNVT_TOHW(green, info->var.green.length);
-		blue = CNVT_TOHW(blue, info->var.blue.length);
-		transp = CNVT_TOHW(transp, info->var.transp.length);
-
-#undef CNVT_TOHW
-
-		v = (red << info->var.red.offset) |
-		    (green << info->var.green.offset) |
-		    (blue << info->var.blue.offset) |
-		    (transp << info->var.transp.offset);
+		u32 v = gfb_truecolor(&info->var, red, green, blue, transp);
 
 		switch (info->var.bits_per_pixel) {
 		case 8:
@@ -365,174 +525,2756 @@ static void gfb_fb_copyarea(struct fb_info *info,
 {
 	struct gfb_data *par = info->par;
 
-	sys_copyarea(info, area);
-	gfb_fb_update(par);
+	sys_copyarea(info, area);
+	gfb_fb_update(par);
+}
+
+/* Stub to call the system default and update the image on the gfb */
+static void gfb_fb_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+	struct gfb_data *par = info->par;
+
+	sys_imageblit(info, image);
+	gfb_fb_update(par);
+}
+
+
+/*
+ * Each open file and the device itself count in fb_count, the last one to
+ * go frees the framebuffer.
+ */
+static bool gfb_count_get(struct gfb_data *data)
+{
+	/* If the USB device is gone, we don't accept new opens */
+	return !data->virtualized && atomic_inc_not_zero(&data->fb_count);
+}
+
+static void gfb_count_put(struct gfb_data *data, unsigned long delay)
+{
+	if (atomic_dec_and_test(&data->fb_count))
+		schedule_delayed_work(&data->free_framebuffer_work, delay);
+}
+
+static int gfb_fb_open(struct fb_info *info, int user)
+{
+	struct gfb_data *dev = info->par;
+
+	if (!gfb_count_get(dev))
+		return -ENODEV;
+
+	/* match kref_put in gfb_fb_release */
+	kref_get(&dev->kref);
+
+	return 0;
+}
+
+
+static int gfb_fb_release(struct fb_info *info, int user)
+{
+	struct gfb_data *dev = info->par;
+
+	gfb_count_put(dev, HZ);
+
+	/* match kref_get in gfb_fb_open */
+	kref_put(&dev->kref, gfb_free_data);
+
+	return 0;
+}
+
+/*
+ * Writes are copied into fb_bitmap a band of lines at a time, and each band
+ * is converted right away while it is still in the cache. Only the lines
+ * the write touched are converted, so small writes at an offset stay cheap.
+ * Otherwise this behaves like fb_sys_write().
+ */
+static ssize_t gfb_fb_write(struct fb_info *info, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct gfb_data *data = info->par;
+	unsigned long p = *ppos;
+	unsigned long total_size = info->screen_size ?: info->fix.smem_len;
+	u32 ll = info->fix.line_length;
+	size_t band_size, done = 0, end;
+	int row, error = 0;
+
+	if (info->state != FBINFO_STATE_RUNNING)
+		return -EPERM;
+
+	if (p > total_size)
+		return -EFBIG;
+
+	if (count > total_size) {
+		error = -EFBIG;
+		count = total_size;
+	}
+
+	if (count + p > total_size) {
+		if (!error)
+			error = -ENOSPC;
+		count = total_size - p;
+	}
+
+	band_size = max_t(size_t, GFB_WRITE_BAND_SIZE / ll, 1) * ll;
+
+	/* No animation frame may land on the bands once converted */
+	if (count)
+		gfb_anim_stop(data);
+
+	while (done < count) {
+		/* Up to the end of the band the write is in */
+		end = min_t(size_t, count,
+			    rounddown(p + done, band_size) + band_size - p);
+
+		if (copy_from_user(data->fb_bitmap + p + done, buf + done,
+				   end - done)) {
+			error = -EFAULT;
+			break;
+		}
+
+		/* A stale vbitmap is converted whole at the end */
+		row = (p + done) / ll;
+		if (!READ_ONCE(data->fb_vbitmap_stale))
+			gfb_fb_convert_rect(data, 0, row, info->var.xres,
+					    DIV_ROUND_UP(p + end, ll) - row);
+		done = end;
+	}
+
+	if (done) {
+		*ppos += done;
+		data->text_stale = true;
+		if (READ_ONCE(data->fb_vbitmap_stale))
+			gfb_fb_convert(data);
+		gfb_fb_send(data);
+	}
+
+	return done ? done : error;
+}
+
+/*
+ * Sprite cache
+ *
+ * Clients upload small bitmaps once with GFB_IOC_SPRITE_UPLOAD and then
+ * draw them by id with GFB_IOC_BLIT. A batch of blits is drawn into
+ * fb_bitmap, only the area it covers is converted, and the frame is sent
+ * once. The fb core calls fb_ioctl with the fb_info lock held, which also
+ * serializes all accesses to the cache.
+ */
+
+static void gfb_sprite_free(struct gfb_data *data, u32 id)
+{
+	struct gfb_sprite *sprite = data->sprites[id];
+
+	if (sprite == NULL)
+		return;
+
+	data->sprite_bytes -= sprite->size;
+	data->sprites[id] = NULL;
+
+	kfree(sprite->pixels);
+	kfree(sprite->mask);
+	kfree(sprite);
+}
+
+static int gfb_sprite_upload(struct gfb_data *data, void __user *argp)
+{
+	struct gfb_sprite_upload upload;
+	struct gfb_sprite *sprite;
+	size_t mask_size;
+	int error;
+
+	if (copy_from_user(&upload, argp, sizeof(upload)))
+		return -EFAULT;
+
+	if (upload.id >= GFB_SPRITE_MAX || upload.reserved != 0 ||
+	    (upload.flags & ~GFB_SPRITE_MASKED) ||
+	    upload.width == 0 || upload.width > data->fb_info->var.xres ||
+	    upload.height == 0 || upload.height > data->fb_info->var.yres)
+		return -EINVAL;
+
+	sprite = kzalloc(sizeof(struct gfb_sprite), GFP_KERNEL);
+	if (sprite == NULL)
+		return -ENOMEM;
+
+	sprite->width = upload.width;
+	sprite->height = upload.height;
+	sprite->stride = DIV_ROUND_UP(upload.width *
+				      data->fb_info->var.bits_per_pixel, 8);
+	sprite->size = sprite->stride * sprite->height;
+
+	mask_size = DIV_ROUND_UP(upload.width, 8) * upload.height;
+	if (upload.flags & GFB_SPRITE_MASKED)
+		sprite->size += mask_size;
+
+	/* The replaced sprite does not count against the new one */
+	if (data->sprite_bytes + sprite->size -
+	    (data->sprites[upload.id] ? data->sprites[upload.id]->size : 0) >
+	    GFB_SPRITE_CACHE_SIZE) {
+		error = -ENOSPC;
+		goto err_cleanup_sprite;
+	}
+
+	sprite->pixels = memdup_user(u64_to_user_ptr(upload.pixels),
+				     sprite->stride * sprite->height);
+	if (IS_ERR(sprite->pixels)) {
+		error = PTR_ERR(sprite->pixels);
+		sprite->pixels = NULL;
+		goto err_cleanup_sprite;
+	}
+
+	if (upload.flags & GFB_SPRITE_MASKED) {
+		sprite->mask = memdup_user(u64_to_user_ptr(upload.mask),
+					   mask_size);
+		if (IS_ERR(sprite->mask)) {
+			error = PTR_ERR(sprite->mask);
+			sprite->mask = NULL;
+			goto err_cleanup_sprite;
+		}
+	}
+
+	gfb_sprite_free(data, upload.id);
+	data->sprites[upload.id] = sprite;
+	data->sprite_bytes += sprite->size;
+
+	return 0;
+
+err_cleanup_sprite:
+	kfree(sprite->pixels);
+	kfree(sprite);
+	return error;
+}
+
+/* Draw the w x h part of a sprite starting at sx,sy at dx,dy (clipped) */
+static void gfb_sprite_draw_mono(struct gfb_data *data,
+				 const struct gfb_sprite *sprite,
+				 int sx, int sy, int dx, int dy, int w, int h)
+{
+	int ll = data->fb_info->fix.line_length;
+	int mask_stride = DIV_ROUND_UP(sprite->width, 8);
+	const u8 *src, *mask;
+	u8 *dst;
+	int row, col, scol, dcol;
+
+	for (row = 0; row < h; ++row) {
+		src = sprite->pixels + (sy + row) * sprite->stride;
+		mask = sprite->mask ? sprite->mask + (sy + row) * mask_stride
+			: NULL;
+		dst = data->fb_bitmap + (dy + row) * ll;
+
+		for (col = 0; col < w; ++col) {
+			scol = sx + col;
+			dcol = dx + col;
+			if (mask && !(mask[scol / 8] & (0x01 << (scol % 8))))
+				continue;
+			if (src[scol / 8] & (0x01 << (scol % 8)))
+				dst[dcol / 8] |= 0x01 << (dcol % 8);
+			else
+				dst[dcol / 8] &= ~(0x01 << (dcol % 8));
+		}
+	}
+}
+
+static void gfb_sprite_draw_qvga(struct gfb_data *data,
+				 const struct gfb_sprite *sprite,
+				 int sx, int sy, int dx, int dy, int w, int h)
+{
+	int xres = data->fb_info->var.xres;
+	int mask_stride = DIV_ROUND_UP(sprite->width, 8);
+	const u16 *src;
+	const u8 *mask;
+	u16 *dst;
+	int row, col, scol;
+
+	for (row = 0; row < h; ++row) {
+		src = (const u16 *)(sprite->pixels +
+				    (sy + row) * sprite->stride) + sx;
+		dst = (u16 *)data->fb_bitmap + (dy + row) * xres + dx;
+
+		if (sprite->mask == NULL) {
+			memcpy(dst, src, w * sizeof(u16));
+			continue;
+		}
+
+		mask = sprite->mask + (sy + row) * mask_stride;
+		for (col = 0; col < w; ++col) {
+			scol = sx + col;
+			if (mask[scol / 8] & (0x01 << (scol % 8)))
+				dst[col] = src[col];
+		}
+	}
+}
+
+static int gfb_sprite_blit(struct gfb_data *data, void __user *argp)
+{
+	struct gfb_blit_batch batch;
+	struct gfb_blit *blits;
+	const struct gfb_sprite *sprite;
+	int xres = data->fb_info->var.xres;
+	int yres = data->fb_info->var.yres;
+	int x1 = xres, y1 = yres, x2 = 0, y2 = 0;
+	int i, sx, sy, dx, dy, w, h;
+	int error = 0;
+
+	if (data->virtualized)
+		return -ENODEV;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.reserved != 0 || batch.count > GFB_BLIT_MAX)
+		return -EINVAL;
+	if (batch.count == 0)
+		return 0;
+
+	blits = memdup_user(u64_to_user_ptr(batch.blits),
+			    batch.count * sizeof(struct gfb_blit));
+	if (IS_ERR(blits))
+		return PTR_ERR(blits);
+
+	for (i = 0; i < batch.count; i++) {
+		if (blits[i].id >= GFB_SPRITE_MAX || blits[i].flags != 0 ||
+		    data->sprites[blits[i].id] == NULL) {
+			error = -EINVAL;
+			break;
+		}
+		sprite = data->sprites[blits[i].id];
+
+		/* Clip against the screen */
+		dx = max_t(int, blits[i].x, 0);
+		dy = max_t(int, blits[i].y, 0);
+		sx = dx - blits[i].x;
+		sy = dy - blits[i].y;
+		w = min_t(int, sprite->width - sx, xres - dx);
+		h = min_t(int, sprite->height - sy, yres - dy);
+		if (w <= 0 || h <= 0)
+			continue;
+
+		data->panel->ops->sprite_draw(data, sprite, sx, sy, dx, dy,
+					      w, h);
+
+		x1 = min(x1, dx);
+		y1 = min(y1, dy);
+		x2 = max(x2, dx + w);
+		y2 = max(y2, dy + h);
+	}
+
+	kfree(blits);
+
+	/* Send whatever was drawn, even if a later blit was rejected */
+	if (x2 > x1 && y2 > y1) {
+		gfb_anim_stop(data);
+		data->text_stale = true;
+		gfb_fb_convert_damage(data, x1, y1, x2 - x1, y2 - y1);
+		gfb_fb_send(data);
+	}
+
+	return error;
+}
+
+
+/*
+ * Animation playback
+ *
+ * The frames are preloaded as complete vbitmaps, so showing one is a copy
+ * into fb_vbitmap and a submission, run from a delayed work that acts as
+ * the frame clock. Playback never goes through the deferred I/O path: if
+ * the urb is still busy the frame is retried on the next tick, and any
+ * deferred I/O therefore comes from a client and stops the animation.
+ */
+
+static void gfb_anim_work(struct work_struct *work)
+{
+	struct gfb_data *data = container_of(work, struct gfb_data,
+					     anim_work.work);
+	unsigned long irq_flags;
+	unsigned long delay = 1;
+	int retval;
+
+	spin_lock_irqsave(&data->anim_lock, irq_flags);
+
+	if (!data->anim_playing)
+		goto out;
+
+	/* Don't overwrite the vbitmap while the urb still reads from it */
+	if (!data->fb_vbitmap_busy) {
+		memcpy(data->fb_vbitmap,
+		       data->anim_frames +
+		       data->anim_frame * data->fb_vbitmap_size,
+		       data->fb_vbitmap_size);
+
+		retval = gfb_fb_try_send(data);
+		if (retval == -ENODEV) {
+			data->anim_playing = false;
+			goto out;
+		}
+		if (retval != -EBUSY) {
+			delay = data->anim_delays[data->anim_frame];
+			data->anim_frame = (data->anim_frame + 1) %
+				data->anim_count;
+		}
+	}
+
+	schedule_delayed_work(&data->anim_work, delay);
+
+out:
+	spin_unlock_irqrestore(&data->anim_lock, irq_flags);
+}
+
+/* Stop the animation and wait for the frame clock to be idle */
+static void gfb_anim_halt(struct gfb_data *data)
+{
+	gfb_anim_stop(data);
+	cancel_delayed_work_sync(&data->anim_work);
+}
+
+static void gfb_anim_unload(struct gfb_data *data)
+{
+	gfb_anim_halt(data);
+
+	vfree(data->anim_frames);
+	kfree(data->anim_delays);
+	data->anim_frames = NULL;
+	data->anim_delays = NULL;
+	data->anim_count = 0;
+}
+
+static int gfb_anim_load(struct gfb_data *data, void __user *argp)
+{
+	struct gfb_anim_load load;
+	size_t header_size = data->panel->header_size;
+	size_t frame_size;
+	const u8 __user *src;
+	unsigned long *delays;
+	u32 __user *durations;
+	u8 *frames, *frame, *bitmap = NULL;
+	u32 ms;
+	int i, error;
+
+	if (copy_from_user(&load, argp, sizeof(load)))
+		return -EFAULT;
+
+	if (load.count == 0 || load.count > GFB_ANIM_MAX_FRAMES)
+		return -EINVAL;
+
+	switch (load.format) {
+	case GFB_ANIM_FORMAT_FB:
+		/* in the orientation at load time */
+		frame_size = data->fb_info->fix.line_length *
+			data->fb_info->var.yres;
+		break;
+	case GFB_ANIM_FORMAT_NATIVE:
+		frame_size = data->fb_vbitmap_size - header_size;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	delays = kcalloc(load.count, sizeof(unsigned long), GFP_KERNEL);
+	if (delays == NULL)
+		return -ENOMEM;
+
+	durations = u64_to_user_ptr(load.durations);
+	for (i = 0; i < load.count; i++) {
+		if (get_user(ms, durations + i)) {
+			error = -EFAULT;
+			goto err_cleanup_delays;
+		}
+		delays[i] = max(msecs_to_jiffies(ms), data->fb_defio.delay);
+	}
+
+	frames = vzalloc(load.count * data->fb_vbitmap_size);
+	if (frames == NULL) {
+		error = -ENOMEM;
+		goto err_cleanup_delays;
+	}
+
+	if (load.format == GFB_ANIM_FORMAT_FB) {
+		bitmap = vmalloc(frame_size);
+		if (bitmap == NULL) {
+			error = -ENOMEM;
+			goto err_cleanup_frames;
+		}
+	}
+
+	src = u64_to_user_ptr(load.frames);
+	for (i = 0; i < load.count; i++, src += frame_size) {
+		frame = frames + i * data->fb_vbitmap_size;
+
+		if (load.format == GFB_ANIM_FORMAT_FB) {
+			if (copy_from_user(bitmap, src, frame_size)) {
+				error = -EFAULT;
+				goto err_cleanup_bitmap;
+			}
+			gfb_convert_rect(data, bitmap, frame, 0, 0,
+					 data->fb_info->var.xres,
+					 data->fb_info->var.yres);
+		} else {
+			memcpy(frame, data->fb_vbitmap, header_size);
+			if (copy_from_user(frame + header_size, src,
+					   frame_size)) {
+				error = -EFAULT;
+				goto err_cleanup_bitmap;
+			}
+		}
+	}
+
+	vfree(bitmap);
+
+	gfb_anim_unload(data);
+	data->anim_frames = frames;
+	data->anim_delays = delays;
+	data->anim_count = load.count;
+
+	return 0;
+
+err_cleanup_bitmap:
+	vfree(bitmap);
+
+err_cleanup_frames:
+	vfree(frames);
+
+err_cleanup_delays:
+	kfree(delays);
+	return error;
+}
+
+static int gfb_anim_start(struct gfb_data *data)
+{
+	unsigned long irq_flags;
+
+	if (data->virtualized)
+		return -ENODEV;
+	if (data->anim_count == 0)
+		return -EINVAL;
+	if (data->mirror_on)
+		return -EBUSY;
+
+	gfb_anim_halt(data);
+
+	spin_lock_irqsave(&data->anim_lock, irq_flags);
+	data->anim_frame = 0;
+	data->anim_playing = true;
+	spin_unlock_irqrestore(&data->anim_lock, irq_flags);
+
+	schedule_delayed_work(&data->anim_work, 0);
+
+	return 0;
+}
+
+static int gfb_fb_ioctl(struct fb_info *info, unsigned int cmd,
+			unsigned long arg)
+{
+	struct gfb_data *data = info->par;
+	void __user *argp = (void __user *)arg;
+	u32 id;
+
+	switch (cmd) {
+	case GFB_IOC_SPRITE_UPLOAD:
+		return gfb_sprite_upload(data, argp);
+	case GFB_IOC_SPRITE_FREE:
+		if (get_user(id, (u32 __user *)argp))
+			return -EFAULT;
+		if (id >= GFB_SPRITE_MAX)
+			return -EINVAL;
+		gfb_sprite_free(data, id);
+		return 0;
+	case GFB_IOC_BLIT:
+		return gfb_sprite_blit(data, argp);
+	case GFB_IOC_ANIM_LOAD:
+		return gfb_anim_load(data, argp);
+	case GFB_IOC_ANIM_START:
+		return gfb_anim_start(data);
+	case GFB_IOC_ANIM_STOP:
+		/* Show the framebuffer contents again */
+		gfb_anim_halt(data);
+		return gfb_fb_update(data);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static int gfb_fb_compat_ioctl(struct fb_info *info, unsigned int cmd,
+			       unsigned long arg)
+{
+	int ret;
+
+	/* all structures have the same layout on 32 and 64 bits */
+	lock_fb_info(info);
+	ret = gfb_fb_ioctl(info, cmd, (unsigned long)compat_ptr(arg));
+	unlock_fb_info(info);
+
+	return ret;
+}
+#endif
+
+static int gfb_fb_check_var(struct fb_var_screeninfo *var,
+			    struct fb_info *info);
+static int gfb_fb_set_par(struct fb_info *info);
+
+static struct fb_ops gfb_ops = {
+	.owner = THIS_MODULE,
+	.fb_check_var = gfb_fb_check_var,
+	.fb_set_par   = gfb_fb_set_par,
+	.fb_read      = fb_sys_read,
+	.fb_open      = gfb_fb_open,
+	.fb_release   = gfb_fb_release,
+	.fb_write     = gfb_fb_write,
+	.fb_setcolreg = gfb_fb_setcolreg,
+	.fb_fillrect  = gfb_fb_fillrect,
+	.fb_copyarea  = gfb_fb_copyarea,
+	.fb_imageblit = gfb_fb_imageblit,
+	.fb_ioctl     = gfb_fb_ioctl,
+#ifdef CONFIG_COMPAT
+	.fb_compat_ioctl = gfb_fb_compat_ioctl,
+#endif
+};
+
+/*
+ * Text device
+ *
+ * Each panel gets a character device accepting lines of the form
+ * "ROW COL TEXT". The text is drawn in character cells using a kernel
+ * font whose glyphs are pre-rendered as bit columns, so a cell can be
+ * written straight into the device-format vbitmap without running the
+ * full frame conversion. Only cells whose character changed are drawn;
+ * the fb bitmap is kept in sync so fb readers see the same image.
+ *
+ * The line "clear" blanks the whole panel.
+ */
+
+#define gfb_text_data(file)						\
+	container_of((file)->private_data, struct gfb_data, text_miscdev)
+
+static const struct font_desc *gfb_text_find_font(const char *name)
+{
+	const struct font_desc *font = find_font(name);
+
+	/* glyph columns are cached as 32 bit masks */
+	if (font == NULL || font->height > 32)
+		return NULL;
+	return font;
+}
+
+/* Pick the text font and cache its glyphs as vertical bit columns */
+static int gfb_text_init_glyphs(struct gfb_data *data)
+{
+	const struct font_desc *font = NULL;
+	const u8 *glyph;
+	int i, c, col, row, pitch;
+	u32 bits;
+
+	if (text_font != NULL)
+		font = gfb_text_find_font(text_font);
+	for (i = 0; font == NULL && i < ARRAY_SIZE(gfb_text_fonts); i++)
+		font = gfb_text_find_font(gfb_text_fonts[i]);
+	if (font == NULL)
+		return -ENOENT;
+
+	data->text_glyphs = kcalloc(GFB_TEXT_GLYPHS * font->width,
+				    sizeof(u32), GFP_KERNEL);
+	if (data->text_glyphs == NULL)
+		return -ENOMEM;
+
+	pitch = DIV_ROUND_UP(font->width, 8);
+	for (c = 0; c < GFB_TEXT_GLYPHS; c++) {
+		glyph = (const u8 *)font->data + c * pitch * font->height;
+		for (col = 0; col < font->width; col++) {
+			bits = 0;
+			for (row = 0; row < font->height; row++)
+				if (glyph[row * pitch + col / 8] &
+				    (0x80 >> (col % 8)))
+					bits |= BIT(row);
+			data->text_glyphs[c * font->width + col] = bits;
+		}
+	}
+
+	data->text_font = font;
+	return 0;
+}
+
+/* Draw one glyph column of height h at x,y on a monochrome panel */
+static void gfb_text_mono_column(struct gfb_data *data, int x, int y, int h,
+				 u32 bits, bool direct)
+{
+	int xres = data->panel->var.xres;
+	int ll = data->fb_info->fix.line_length;
+	u8 *src = data->fb_bitmap + y * ll + x / 8;
+	u8 *dst = data->fb_vbitmap + 32 + (y / 8) * xres + x;
+	u8 mask = 0x01 << (x % 8);
+	u64 vbits = (u64)bits << (y % 8);
+	u64 vmask = ((BIT_ULL(h) - 1)) << (y % 8);
+	int row;
+
+	for (row = 0; row < h; ++row, src += ll) {
+		if (bits & BIT(row))
+			*src |= mask;
+		else
+			*src &= ~mask;
+	}
+
+	if (!direct)
+		return;
+
+	/* a column may straddle two of the 8 pixel high bands */
+	for (; vmask; vmask >>= 8, vbits >>= 8, dst += xres)
+		*dst = (*dst & ~(u8)vmask) | (u8)vbits;
+}
+
+/* Draw one glyph column of height h at x,y on a QVGA panel */
+static void gfb_text_qvga_column(struct gfb_data *data, int x, int y, int h,
+				 u32 bits, bool direct)
+{
+	int xres = data->fb_info->var.xres;
+	int yres = data->panel->var.yres;
+	u16 *src = (u16 *)data->fb_bitmap + y * xres + x;
+	u16 *dst = (u16 *)(data->fb_vbitmap + sizeof(hdata)) + x * yres + y;
+	u16 pixel;
+	int row;
+
+	/* the vbitmap is transposed, so a column is contiguous there */
+	for (row = 0; row < h; ++row, src += xres) {
+		pixel = (bits & BIT(row)) ? 0xFFFF : 0x0000;
+		*src = pixel;
+		if (direct)
+			*dst++ = pixel;
+	}
+}
+
+static void gfb_text_render_cell(struct gfb_data *data, int row, int col,
+				 u8 c)
+{
+	int w = data->text_font->width;
+	int h = data->text_font->height;
+	const u32 *glyph = data->text_glyphs + c * w;
+	/* the vbitmap can be drawn along only when it isn't reoriented */
+	bool direct = data->orientation ==
+		&data->orientations[FB_ROTATE_UR][0];
+	int x;
+
+	for (x = 0; x < w; ++x)
+		data->panel->ops->text_column(data, col * w + x, row * h, h,
+					      glyph[x], direct);
+
+	if (!direct)
+		gfb_fb_convert_rect(data, col * w, row * h, w, h);
+}
+
+static void gfb_text_clear(struct gfb_data *data)
+{
+	int i;
+
+	for (i = 0; i < data->text_rows * data->text_cols; i++)
+		data->text_cells[i] = ' ';
+
+	memset(data->fb_bitmap, 0x00, data->fb_info->fix.smem_len);
+	gfb_fb_convert(data);
+}
+
+/* Apply one "ROW COL TEXT" line; sets *dirty if any cell changed */
+static int gfb_text_put_line(struct gfb_data *data, const char *line,
+			     bool *dirty)
+{
+	int row, col, offset = 0;
+	u16 *cell;
+
+	if (*line == '\0')
+		return 0;
+
+	if (strcmp(line, "clear") == 0) {
+		gfb_text_clear(data);
+		*dirty = true;
+		return 0;
+	}
+
+	if (sscanf(line, "%d %d%n", &row, &col, &offset) != 2)
+		return -EINVAL;
+	if (row < 0 || row >= data->text_rows ||
+	    col < 0 || col >= data->text_cols)
+		return -EINVAL;
+
+	/* a single blank separates the column from the text */
+	line += offset;
+	if (*line == ' ')
+		++line;
+
+	cell = data->text_cells + row * data->text_cols + col;
+	for (; *line && col < data->text_cols; ++line, ++col, ++cell) {
+		if (*cell == (u8)*line)
+			continue;
+		*cell = (u8)*line;
+		gfb_text_render_cell(data, row, col, *cell);
+		*dirty = true;
+	}
+
+	return 0;
+}
+
+static ssize_t gfb_text_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct gfb_data *data = gfb_text_data(file);
+	char *kbuf, *next, *line;
+	bool dirty = false;
+	ssize_t result;
+	int i, error;
+
+	if (count > GFB_TEXT_WRITE_MAX)
+		count = GFB_TEXT_WRITE_MAX;
+	result = count;
+
+	kbuf = memdup_user_nul(buf, count);
+	if (IS_ERR(kbuf))
+		return PTR_ERR(kbuf);
+
+	/* Same order as gfb_set_orientation(): the fb_info, then the cells */
+	lock_fb_info(data->fb_info);
+	mutex_lock(&data->text_lock);
+
+	if (data->virtualized) {
+		result = -ENODEV;
+		goto out;
+	}
+
+	/* Somebody drew on the fb: redraw every cell we are asked to */
+	if (data->text_stale) {
+		data->text_stale = false;
+		for (i = 0; i < data->text_rows * data->text_cols; i++)
+			data->text_cells[i] = GFB_TEXT_CELL_UNKNOWN;
+	}
+
+	next = kbuf;
+	while ((line = strsep(&next, "\n")) != NULL) {
+		error = gfb_text_put_line(data, line, &dirty);
+		if (error) {
+			result = error;
+			break;
+		}
+	}
+
+	if (dirty) {
+		gfb_anim_stop(data);
+		/* The cells drawn straight into the vbitmap are in the bitmap */
+		if (READ_ONCE(data->fb_vbitmap_stale))
+			gfb_fb_convert(data);
+		gfb_fb_send(data);
+	}
+
+out:
+	mutex_unlock(&data->text_lock);
+	unlock_fb_info(data->fb_info);
+	kfree(kbuf);
+	return result;
+}
+
+static int gfb_text_open(struct inode *inode, struct file *file)
+{
+	struct gfb_data *data = gfb_text_data(file);
+
+	if (!gfb_count_get(data))
+		return -ENODEV;
+
+	/* match kref_put in gfb_text_release */
+	kref_get(&data->kref);
+
+	return nonseekable_open(inode, file);
+}
+
+static int gfb_text_release(struct inode *inode, struct file *file)
+{
+	struct gfb_data *data = gfb_text_data(file);
+
+	gfb_count_put(data, HZ);
+
+	/* match kref_get in gfb_text_open */
+	kref_put(&data->kref, gfb_free_data);
+
+	return 0;
+}
+
+static const struct file_operations gfb_text_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = gfb_text_open,
+	.release = gfb_text_release,
+	.write	 = gfb_text_write,
+};
+
+/* Fit the cells to the fb geometry; called with text_lock held */
+static void gfb_text_layout(struct gfb_data *data)
+{
+	int i;
+
+	data->text_cols = data->fb_info->var.xres / data->text_font->width;
+	data->text_rows = data->fb_info->var.yres / data->text_font->height;
+
+	for (i = 0; i < data->text_rows * data->text_cols; i++)
+		data->text_cells[i] = GFB_TEXT_CELL_UNKNOWN;
+}
+
+/* Register the text device; the panel works without one on failure */
+static void gfb_text_probe(struct gfb_data *data)
+{
+	int xres = data->panel->var.xres;
+	int yres = data->panel->var.yres;
+	int cells, error;
+
+	error = gfb_text_init_glyphs(data);
+	if (error) {
+		dev_warn(data->dev, GFB_NAME " no usable font for the text device\n");
+		return;
+	}
+
+	/* enough for the panel rotated either way */
+	cells = max((xres / data->text_font->width) *
+		    (yres / data->text_font->height),
+		    (yres / data->text_font->width) *
+		    (xres / data->text_font->height));
+
+	data->text_cells = kmalloc_array(cells, sizeof(u16), GFP_KERNEL);
+	if (data->text_cells == NULL)
+		goto err_cleanup_glyphs;
+	gfb_text_layout(data);
+
+	snprintf(data->text_name, sizeof(data->text_name), "fbtext%d",
+		 data->fb_info->node);
+	data->text_miscdev.minor = MISC_DYNAMIC_MINOR;
+	data->text_miscdev.name = data->text_name;
+	data->text_miscdev.fops = &gfb_text_fops;
+	data->text_miscdev.parent = data->dev;
+
+	error = misc_register(&data->text_miscdev);
+	if (error) {
+		dev_warn(data->dev, GFB_NAME " failed to register the text device\n");
+		goto err_cleanup_cells;
+	}
+
+	return;
+
+err_cleanup_cells:
+	kfree(data->text_cells);
+	data->text_cells = NULL;
+
+err_cleanup_glyphs:
+	kfree(data->text_glyphs);
+	data->text_glyphs = NULL;
+	data->text_font = NULL;
+}
+
+static void gfb_text_remove(struct gfb_data *data)
+{
+	if (data->text_cells != NULL)
+		misc_deregister(&data->text_miscdev);
+}
+
+
+/*
+ * The "fb_node" attribute
+ */
+ssize_t gfb_fb_node_show(struct device *dev,
+			 struct device_attribute *attr,
+			 char *buf)
+{
+	unsigned fb_node;
+	struct gfb_data *data = dev_get_gfbdata(dev);
+
+	if (!data)
+		return -ENODATA;
+
+	fb_node = data->fb_info->node;
+
+	return sprintf(buf, "%u\n", fb_node);
+}
+EXPORT_SYMBOL_GPL(gfb_fb_node_show);
+
+/*
+ * The "fb_update_rate" attribute
+ */
+ssize_t gfb_fb_update_rate_show(struct device *dev,
+				struct device_attribute *attr,
+				char *buf)
+{
+	unsigned fb_update_rate;
+	struct gfb_data *data = dev_get_gfbdata(dev);
+
+	if (!data)
+		return -ENODATA;
+
+	fb_update_rate = data->fb_update_rate;
+
+	return sprintf(buf, "%u\n", fb_update_rate);
+}
+EXPORT_SYMBOL_GPL(gfb_fb_update_rate_show);
+
+static ssize_t gfb_set_fb_update_rate(struct gfb_data *data,
+				      unsigned fb_update_rate)
+{
+	if (fb_update_rate > GFB_UPDATE_RATE_LIMIT)
+		data->fb_update_rate = GFB_UPDATE_RATE_LIMIT;
+	else if (fb_update_rate == 0)
+		data->fb_update_rate = 1;
+	else
+		data->fb_update_rate = fb_update_rate;
+
+	data->fb_defio.delay = HZ / data->fb_update_rate;
+
+	return 0;
+}
+
+ssize_t gfb_fb_update_rate_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int i;
+	unsigned u;
+	ssize_t set_result;
+
+	struct gfb_data *data = dev_get_gfbdata(dev);
+
+	if (!data)
+		return -ENODATA;
+
+	i = kstrtouint(buf, 0, &u);
+	if (i != 0) {
+		dev_warn(dev, GFB_NAME " unrecognized input: %s", buf);
+		return -EINVAL;
+	}
+
+	set_result = gfb_set_fb_update_rate(data, u);
+
+	if (set_result < 0)
+		return set_result;
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_update_rate_store);
+
+/* Lists the converters of the panel, the one in use in brackets */
+ssize_t gfb_fb_converter_show(struct device *dev,
+			      struct device_attribute *attr,
+			      char *buf)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+	const struct gfb_converter *converter;
+	ssize_t len = 0;
+
+	if (!data)
+		return -ENODATA;
+
+	for (converter = data->panel->converters; converter->name;
+	     converter++)
+		len += sprintf(buf + len,
+			       converter == data->converter ? "[%s] " : "%s ",
+			       converter->name);
+	buf[len - 1] = '\n';
+
+	return len;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_converter_show);
+
+ssize_t gfb_fb_converter_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+	const struct gfb_converter *converter;
+
+	if (!data)
+		return -ENODATA;
+
+	for (converter = data->panel->converters; converter->name;
+	     converter++) {
+		if (sysfs_streq(buf, converter->name)) {
+			WRITE_ONCE(data->converter, converter);
+			return count;
+		}
+	}
+
+	dev_warn(dev, GFB_NAME " unrecognized input: %s", buf);
+	return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_converter_store);
+
+
+/*
+ * Framebuffer mirror
+ *
+ * A rectangle of another framebuffer is sampled on our own frame clock,
+ * scaled to the panel with nearest neighbour sampling and converted to
+ * RGB565 in the same pass, straight into the vbitmap. The fb bitmap is
+ * left alone, so clients drawing meanwhile are overwritten on the next
+ * tick. Only RGB565 panels support it.
+ *
+ * The source is held open like any client would, which keeps its fb_info
+ * and memory around until the mirror stops. It is sampled under its own
+ * lock and checked on every tick, so a mode change or unregistering it
+ * only pauses the mirror.
+ */
+
+/* fb_open() leaves the fb_info in private_data */
+#define gfb_mirror_info(data)						\
+	((struct fb_info *)(data)->mirror_file->private_data)
+
+/* Called with the source fb locked */
+static bool gfb_mirror_usable(struct gfb_data *data, struct fb_info *src)
+{
+	/* Cleared when the source is unregistered */
+	if (src->dev == NULL || src->screen_base == NULL)
+		return false;
+
+	if (src->fix.visual != FB_VISUAL_TRUECOLOR &&
+	    src->fix.visual != FB_VISUAL_DIRECTCOLOR)
+		return false;
+
+	switch (src->var.bits_per_pixel) {
+	case 16:
+	case 24:
+	case 32:
+		break;
+	default:
+		return false;
+	}
+
+	/* The rectangle is relative to the visible (panned) area */
+	if (src->var.xoffset + data->mirror_x + data->mirror_w >
+	    src->var.xres_virtual ||
+	    src->var.yoffset + data->mirror_y + data->mirror_h >
+	    src->var.yres_virtual)
+		return false;
+
+	return true;
+}
+
+/* Scale a colour channel of a source pixel to bits wide */
+static inline u16 gfb_mirror_channel(u32 pixel, const struct fb_bitfield *f,
+				     unsigned int bits)
+{
+	u32 v = (pixel >> f->offset) & ((1 << f->length) - 1);
+
+	if (f->length >= bits)
+		return v >> (f->length - bits);
+	return v << (bits - f->length);
+}
+
+/* Source byte offset of fb column fx or fb row fy of the mirrored area */
+static u32 gfb_mirror_xoff(struct gfb_data *data, struct fb_info *src,
+			   const struct gfb_orientation *o, int fx)
+{
+	return (src->var.xoffset + data->mirror_x +
+		fx * data->mirror_w / o->xres) * (src->var.bits_per_pixel / 8);
+}
+
+static u32 gfb_mirror_yoff(struct gfb_data *data, struct fb_info *src,
+			   const struct gfb_orientation *o, int fy)
+{
+	return (src->var.yoffset + data->mirror_y +
+		fy * data->mirror_h / o->yres) * src->fix.line_length;
+}
+
+static void gfb_mirror_sample(struct gfb_data *data, struct fb_info *src)
+{
+	const struct fb_var_screeninfo *var = &src->var;
+	const struct gfb_orientation *o = READ_ONCE(data->orientation);
+	u32 xres = data->panel->var.xres;
+	u32 yres = data->panel->var.yres;
+	u32 bytespp = var->bits_per_pixel / 8;
+	u16 *dst = (u16 *)(data->fb_vbitmap + sizeof(hdata));
+	u32 *xoff = data->mirror_xoff;
+	u32 *yoff = data->mirror_xoff + xres;
+	const u8 __iomem *line;
+	const u8 __iomem *p;
+	u32 pixel;
+	u32 x, y;
+
+	memcpy(data->fb_vbitmap, hdata, sizeof(hdata));
+
+	/*
+	 * Each fb coordinate follows a single panel axis, so the source
+	 * offset of a panel pixel is a column part plus a row part
+	 */
+	for (x = 0; x < xres; x++)
+		xoff[x] = o->xx ?
+			gfb_mirror_xoff(data, src, o, gfb_fb_x(o, x, 0)) :
+			gfb_mirror_yoff(data, src, o, gfb_fb_y(o, x, 0));
+	for (y = 0; y < yres; y++)
+		yoff[y] = o->xy ?
+			gfb_mirror_xoff(data, src, o, gfb_fb_x(o, 0, y)) :
+			gfb_mirror_yoff(data, src, o, gfb_fb_y(o, 0, y));
+
+	/* Walk the panel row by row, the source may well be slow io memory */
+	for (y = 0; y < yres; y++) {
+		line = (const u8 __iomem *)src->screen_base + yoff[y];
+
+		for (x = 0; x < xres; x++) {
+			p = line + xoff[x];
+
+			switch (bytespp) {
+			case 2:
+				pixel = fb_readw(p);
+				break;
+			case 3:
+				pixel = fb_readb(p) | fb_readb(p + 1) << 8 |
+					fb_readb(p + 2) << 16;
+				break;
+			default:
+				pixel = fb_readl(p);
+				break;
+			}
+
+			dst[x * yres + y] =
+				gfb_mirror_channel(pixel, &var->red, 5) << 11 |
+				gfb_mirror_channel(pixel, &var->green, 6) << 5 |
+				gfb_mirror_channel(pixel, &var->blue, 5);
+		}
+	}
+}
+
+static void gfb_mirror_work(struct work_struct *work)
+{
+	struct gfb_data *data = container_of(work, struct gfb_data,
+					     mirror_work.work);
+	struct fb_info *src;
+	unsigned long delay = HZ / data->mirror_rate;
+	bool usable;
+
+	if (!data->mirror_on)
+		return;
+
+	/* Don't overwrite the vbitmap while the urb still reads from it */
+	if (data->fb_vbitmap_busy) {
+		delay = 1;
+	} else {
+		src = gfb_mirror_info(data);
+
+		lock_fb_info(src);
+		usable = gfb_mirror_usable(data, src);
+		if (usable)
+			gfb_mirror_sample(data, src);
+		unlock_fb_info(src);
+
+		if (usable && gfb_fb_try_send(data) == -EBUSY)
+			delay = 1;
+	}
+
+	schedule_delayed_work(&data->mirror_work, delay);
+}
+
+/* Called with mirror_lock held */
+static void gfb_mirror_stop(struct gfb_data *data)
+{
+	if (!data->mirror_on)
+		return;
+
+	data->mirror_on = false;
+	cancel_delayed_work_sync(&data->mirror_work);
+
+	kfree(data->mirror_xoff);
+	data->mirror_xoff = NULL;
+
+	filp_close(data->mirror_file, NULL);
+	data->mirror_file = NULL;
+
+	/* Show the framebuffer contents again */
+	if (!data->virtualized)
+		gfb_fb_update(data);
+}
+
+ssize_t gfb_fb_mirror_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+	ssize_t len;
+
+	if (!data)
+		return -ENODATA;
+
+	mutex_lock(&data->mirror_lock);
+	if (data->mirror_on)
+		len = sprintf(buf, "%d %u %u %u %u %u\n", data->mirror_fb,
+			      data->mirror_x, data->mirror_y,
+			      data->mirror_w, data->mirror_h,
+			      data->mirror_rate);
+	else
+		len = sprintf(buf, "off\n");
+	mutex_unlock(&data->mirror_lock);
+
+	return len;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_mirror_show);
+
+/*
+ * Accepts "FB X Y W H RATE" to mirror the WxH rectangle at X,Y of
+ * /dev/fbFB RATE times per second, or "off".
+ */
+ssize_t gfb_fb_mirror_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+	struct file *file;
+	char path[16];
+	bool usable;
+	int fb;
+	u32 x, y, w, h, rate;
+	ssize_t retval = count;
+
+	if (!data)
+		return -ENODATA;
+
+	if (sysfs_streq(buf, "off")) {
+		mutex_lock(&data->mirror_lock);
+		gfb_mirror_stop(data);
+		mutex_unlock(&data->mirror_lock);
+		return count;
+	}
+
+	if (sscanf(buf, "%d %u %u %u %u %u", &fb, &x, &y, &w, &h, &rate) != 6) {
+		dev_warn(dev, GFB_NAME " unrecognized input: %s", buf);
+		return -EINVAL;
+	}
+
+	if (!(data->panel->caps & GFB_PANEL_MIRROR))
+		return -EOPNOTSUPP;
+	if (fb < 0 || fb >= FB_MAX || w == 0 || h == 0 ||
+	    w > U16_MAX || h > U16_MAX || x > U16_MAX || y > U16_MAX)
+		return -EINVAL;
+	if (rate == 0 || rate > GFB_UPDATE_RATE_LIMIT)
+		return -EINVAL;
+	if (fb == data->fb_info->node)
+		return -EINVAL;
+
+	mutex_lock(&data->mirror_lock);
+
+	if (data->virtualized) {
+		retval = -ENODEV;
+		goto out;
+	}
+
+	gfb_mirror_stop(data);
+	gfb_anim_halt(data);
+
+	/* Holding the source open is what keeps it alive */
+	snprintf(path, sizeof(path), "/dev/fb%d", fb);
+	file = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(file)) {
+		retval = PTR_ERR(file);
+		goto out;
+	}
+	if (imajor(file_inode(file)) != FB_MAJOR) {
+		filp_close(file, NULL);
+		retval = -EINVAL;
+		goto out;
+	}
+
+	data->mirror_xoff = kcalloc(data->panel->var.xres +
+				    data->panel->var.yres, sizeof(u32),
+				    GFP_KERNEL);
+	if (data->mirror_xoff == NULL) {
+		filp_close(file, NULL);
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	data->mirror_file = file;
+
+	data->mirror_fb = fb;
+	data->mirror_x = x;
+	data->mirror_y = y;
+	data->mirror_w = w;
+	data->mirror_h = h;
+	data->mirror_rate = rate;
+
+	lock_fb_info(gfb_mirror_info(data));
+	usable = gfb_mirror_usable(data, gfb_mirror_info(data));
+	unlock_fb_info(gfb_mirror_info(data));
+	if (!usable)
+		dev_info(dev, GFB_NAME " mirror source fb%d is not usable yet\n",
+			 fb);
+
+	data->mirror_on = true;
+	schedule_delayed_work(&data->mirror_work, 0);
+
+out:
+	mutex_unlock(&data->mirror_lock);
+	return retval;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_mirror_store);
+
+
+/*
+ * Spanning
+ *
+ * With the span_cols and span_rows parameters set, an extra framebuffer
+ * covers a grid of that many RGB565 panels, which join a cell of the grid
+ * through their fb_span attribute. Drawing on the span framebuffer only
+ * records damage. Its deferred I/O work is the common frame clock: it
+ * copies each damaged slice into the fb of its panel, converts the panels
+ * in parallel and then submits them back to back. Panels without damage
+ * send nothing.
+ */
+
+static unsigned int span_cols;
+module_param(span_cols, uint, 0444);
+MODULE_PARM_DESC(span_cols, "Columns of panels in the span framebuffer (default: 0, no spanning)");
+
+static unsigned int span_rows;
+module_param(span_rows, uint, 0444);
+MODULE_PARM_DESC(span_rows, "Rows of panels in the span framebuffer (default: 0, no spanning)");
+
+struct gfb_span {
+	struct fb_info *fb_info;
+	struct fb_deferred_io fb_defio;
+	u8 *fb_bitmap;
+	u32 pseudo_palette[16];
+
+	spinlock_t damage_lock;
+	int x1, y1, x2, y2;	/* damaged area, empty when x1 >= x2 */
+
+	struct mutex lock;	/* protects panels and their span_ fields */
+	struct gfb_data *panels[GFB_SPAN_MAX];	/* by grid cell */
+};
+
+static struct gfb_span *gfb_span;
+
+static void gfb_span_merge_damage(struct gfb_span *span,
+				  int x, int y, int w, int h)
+{
+	int xres = span->fb_info->var.xres;
+	int yres = span->fb_info->var.yres;
+	unsigned long irq_flags;
+
+	x = clamp(x, 0, xres);
+	y = clamp(y, 0, yres);
+	w = clamp(w, 0, xres - x);
+	h = clamp(h, 0, yres - y);
+	if (w == 0 || h == 0)
+		return;
+
+	spin_lock_irqsave(&span->damage_lock, irq_flags);
+	if (span->x1 >= span->x2) {
+		span->x1 = x;
+		span->y1 = y;
+		span->x2 = x + w;
+		span->y2 = y + h;
+	} else {
+		span->x1 = min(span->x1, x);
+		span->y1 = min(span->y1, y);
+		span->x2 = max(span->x2, x + w);
+		span->y2 = max(span->y2, y + h);
+	}
+	spin_unlock_irqrestore(&span->damage_lock, irq_flags);
+}
+
+/* Record damage and make sure the next frame tick handles it */
+static void gfb_span_damage(struct gfb_span *span, int x, int y, int w, int h)
+{
+	gfb_span_merge_damage(span, x, y, w, h);
+	schedule_delayed_work(&span->fb_info->deferred_work,
+			      span->fb_defio.delay);
+}
+
+/* Copy the damaged slice of a panel into its fb and convert it */
+static void gfb_span_panel_work(struct work_struct *work)
+{
+	struct gfb_data *data = container_of(work, struct gfb_data,
+					     span_work);
+	struct gfb_span *span = gfb_span;
+	u32 src_pitch = span->fb_info->fix.line_length;
+	u32 dst_pitch = data->fb_info->fix.line_length;
+	int col = data->span_cell % span_cols;
+	int row = data->span_cell / span_cols;
+	const u8 *src;
+	u8 *dst;
+	int y;
+
+	src = span->fb_bitmap +
+		(row * GFB_SPAN_PANEL_YRES + data->span_y) * src_pitch +
+		(col * GFB_SPAN_PANEL_XRES + data->span_x) * 2;
+	dst = data->fb_bitmap + data->span_y * dst_pitch + data->span_x * 2;
+
+	for (y = 0; y < data->span_h; y++, src += src_pitch, dst += dst_pitch)
+		memcpy(dst, src, data->span_w * 2);
+
+	gfb_anim_stop(data);
+	data->text_stale = true;
+	gfb_fb_convert_damage(data, data->span_x, data->span_y,
+			      data->span_w, data->span_h);
+}
+
+static void gfb_span_deferred_io(struct fb_info *info,
+				 struct list_head *pagelist)
+{
+	struct gfb_span *span = info->par;
+	u32 line_length = info->fix.line_length;
+	struct fb_deferred_io_pageref *pageref;
+	struct gfb_data *data;
+	unsigned long irq_flags;
+	int x1, y1, x2, y2;
+	int px, py;
+	int i;
+
+	trace_lg4l_defio(info);
+
+	/* Pages written through mmap damage whole lines */
+	list_for_each_entry(pageref, pagelist, list) {
+		y1 = pageref->offset / line_length;
+		y2 = DIV_ROUND_UP(pageref->offset + PAGE_SIZE, line_length);
+		gfb_span_merge_damage(span, 0, y1, info->var.xres, y2 - y1);
+	}
+
+	spin_lock_irqsave(&span->damage_lock, irq_flags);
+	x1 = span->x1;
+	y1 = span->y1;
+	x2 = span->x2;
+	y2 = span->y2;
+	span->x1 = span->x2 = 0;
+	spin_unlock_irqrestore(&span->damage_lock, irq_flags);
+
+	if (x1 >= x2)
+		return;
+
+	mutex_lock(&span->lock);
+
+	for (i = 0; i < GFB_SPAN_MAX; i++) {
+		data = span->panels[i];
+		if (data == NULL)
+			continue;
+
+		px = (i % span_cols) * GFB_SPAN_PANEL_XRES;
+		py = (i / span_cols) * GFB_SPAN_PANEL_YRES;
+
+		data->span_x = max(x1, px) - px;
+		data->span_y = max(y1, py) - py;
+		data->span_w = min(x2, px + GFB_SPAN_PANEL_XRES) - px -
+			data->span_x;
+		data->span_h = min(y2, py + GFB_SPAN_PANEL_YRES) - py -
+			data->span_y;
+
+		if (data->span_w <= 0 || data->span_h <= 0) {
+			data->span_w = 0;
+			continue;
+		}
+
+		queue_work(system_unbound_wq, &data->span_work);
+	}
+
+	for (i = 0; i < GFB_SPAN_MAX; i++) {
+		data = span->panels[i];
+		if (data != NULL && data->span_w > 0)
+			flush_work(&data->span_work);
+	}
+
+	/* All panels are converted, start their transfers together */
+	for (i = 0; i < GFB_SPAN_MAX; i++) {
+		data = span->panels[i];
+		if (data != NULL && data->span_w > 0)
+			gfb_fb_send(data);
+	}
+
+	mutex_unlock(&span->lock);
+}
+
+static ssize_t gfb_span_write(struct fb_info *info, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	u32 line_length = info->fix.line_length;
+	loff_t start = *ppos;
+	ssize_t result;
+
+	result = fb_sys_write(info, buf, count, ppos);
+	if (result > 0)
+		gfb_span_damage(info->par, 0, start / line_length,
+				info->var.xres,
+				(start + result - 1) / line_length -
+				start / line_length + 1);
+	return result;
+}
+
+static void gfb_span_fillrect(struct fb_info *info,
+			      const struct fb_fillrect *rect)
+{
+	sys_fillrect(info, rect);
+	gfb_span_damage(info->par, rect->dx, rect->dy,
+			rect->width, rect->height);
+}
+
+static void gfb_span_copyarea(struct fb_info *info,
+			      const struct fb_copyarea *area)
+{
+	sys_copyarea(info, area);
+	gfb_span_damage(info->par, area->dx, area->dy,
+			area->width, area->height);
+}
+
+static void gfb_span_imageblit(struct fb_info *info,
+			       const struct fb_image *image)
+{
+	sys_imageblit(info, image);
+	gfb_span_damage(info->par, image->dx, image->dy,
+			image->width, image->height);
+}
+
+static struct fb_ops gfb_span_ops = {
+	.owner = THIS_MODULE,
+	.fb_read      = fb_sys_read,
+	.fb_write     = gfb_span_write,
+	.fb_setcolreg = gfb_fb_setcolreg,
+	.fb_fillrect  = gfb_span_fillrect,
+	.fb_copyarea  = gfb_span_copyarea,
+	.fb_imageblit = gfb_span_imageblit,
+};
+
+static int gfb_span_create(void)
+{
+	struct gfb_span *span;
+	struct fb_info *info;
+	int error;
+
+	if (span_cols * span_rows > GFB_SPAN_MAX) {
+		pr_err(GFB_NAME ": span of %ux%u panels, at most %d are supported\n",
+		       span_cols, span_rows, GFB_SPAN_MAX);
+		return -EINVAL;
+	}
+
+	span = kzalloc(sizeof(struct gfb_span), GFP_KERNEL);
+	if (span == NULL)
+		return -ENOMEM;
+
+	info = framebuffer_alloc(0, NULL);
+	if (info == NULL) {
+		error = -ENOMEM;
+		goto err_cleanup_span;
+	}
+	span->fb_info = info;
+
+	info->fix = (struct fb_fix_screeninfo) {
+		.id = "GFB_SPAN",
+		.type = FB_TYPE_PACKED_PIXELS,
+		.visual = FB_VISUAL_TRUECOLOR,
+		.line_length = span_cols * GFB_SPAN_PANEL_XRES * 2,
+		.accel = FB_ACCEL_NONE,
+	};
+	info->var = (struct fb_var_screeninfo) {
+		.xres = span_cols * GFB_SPAN_PANEL_XRES,
+		.yres = span_rows * GFB_SPAN_PANEL_YRES,
+		.xres_virtual = span_cols * GFB_SPAN_PANEL_XRES,
+		.yres_virtual = span_rows * GFB_SPAN_PANEL_YRES,
+		.bits_per_pixel = 16,
+		.red	    = {11, 5, 0}, /* RGB565 */
+		.green	    = { 5, 6, 0},
+		.blue	    = { 0, 5, 0},
+		.transp	    = { 0, 0, 0},
+	};
+	info->fix.smem_len = info->fix.line_length * info->var.yres;
+	info->pseudo_palette = span->pseudo_palette;
+	info->fbops = &gfb_span_ops;
+	info->par = span;
+
+	span->fb_bitmap = vzalloc(info->fix.smem_len);
+	if (span->fb_bitmap == NULL) {
+		error = -ENOMEM;
+		goto err_cleanup_fb;
+	}
+	info->screen_base = (char __force __iomem *) span->fb_bitmap;
+
+	spin_lock_init(&span->damage_lock);
+	mutex_init(&span->lock);
+
+	span->fb_defio = (struct fb_deferred_io) {
+		.delay = HZ / GFB_UPDATE_RATE_DEFAULT,
+		.deferred_io = gfb_span_deferred_io,
+	};
+	info->fbdefio = &span->fb_defio;
+	fb_deferred_io_init(info);
+
+	error = register_framebuffer(info);
+	if (error < 0)
+		goto err_cleanup_fb_deferred;
+
+	gfb_span = span;
+
+	return 0;
+
+err_cleanup_fb_deferred:
+	fb_deferred_io_cleanup(info);
+	vfree(span->fb_bitmap);
+
+err_cleanup_fb:
+	framebuffer_release(info);
+
+err_cleanup_span:
+	kfree(span);
+	return error;
+}
+
+static void gfb_span_destroy(void)
+{
+	struct gfb_span *span = gfb_span;
+
+	if (span == NULL)
+		return;
+
+	fb_deferred_io_cleanup(span->fb_info);
+	unregister_framebuffer(span->fb_info);
+	framebuffer_release(span->fb_info);
+	vfree(span->fb_bitmap);
+	kfree(span);
+
+	gfb_span = NULL;
+}
+
+/* Called with the span lock held */
+static void gfb_span_leave(struct gfb_data *data)
+{
+	if (data->span_cell < 0)
+		return;
+
+	gfb_span->panels[data->span_cell] = NULL;
+	data->span_cell = -1;
+}
+
+ssize_t gfb_fb_span_show(struct device *dev,
+			 struct device_attribute *attr,
+			 char *buf)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+	ssize_t len;
+
+	if (!data)
+		return -ENODATA;
+	if (gfb_span == NULL)
+		return sprintf(buf, "off\n");
+
+	mutex_lock(&gfb_span->lock);
+	if (data->span_cell < 0)
+		len = sprintf(buf, "off\n");
+	else
+		len = sprintf(buf, "%u %u\n", data->span_cell % span_cols,
+			      data->span_cell / span_cols);
+	mutex_unlock(&gfb_span->lock);
+
+	return len;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_span_show);
+
+/* Accepts "COL ROW" to show that cell of the span framebuffer, or "off" */
+ssize_t gfb_fb_span_store(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+	struct gfb_span *span = gfb_span;
+	unsigned int col, row;
+	int cell;
+	ssize_t retval = count;
+
+	if (!data)
+		return -ENODATA;
+	if (span == NULL)
+		return -ENODEV;
+
+	if (sysfs_streq(buf, "off")) {
+		mutex_lock(&span->lock);
+		gfb_span_leave(data);
+		mutex_unlock(&span->lock);
+		return count;
+	}
+
+	if (sscanf(buf, "%u %u", &col, &row) != 2) {
+		dev_warn(dev, GFB_NAME " unrecognized input: %s", buf);
+		return -EINVAL;
+	}
+
+	if (!(data->panel->caps & GFB_PANEL_SPAN))
+		return -EOPNOTSUPP;
+	if (col >= span_cols || row >= span_rows)
+		return -EINVAL;
+	cell = row * span_cols + col;
+
+	/* Keeps the panel from being rotated meanwhile, see check_var */
+	lock_fb_info(data->fb_info);
+	mutex_lock(&span->lock);
+
+	if (data->virtualized) {
+		retval = -ENODEV;
+		goto out;
+	}
+	if (data->fb_info->var.xres != GFB_SPAN_PANEL_XRES) {
+		retval = -EBUSY;
+		goto out;
+	}
+	if (span->panels[cell] != NULL && span->panels[cell] != data) {
+		retval = -EBUSY;
+		goto out;
+	}
+
+	gfb_span_leave(data);
+	span->panels[cell] = data;
+	data->span_cell = cell;
+
+	gfb_span_damage(span, col * GFB_SPAN_PANEL_XRES,
+			row * GFB_SPAN_PANEL_YRES,
+			GFB_SPAN_PANEL_XRES, GFB_SPAN_PANEL_YRES);
+
+out:
+	mutex_unlock(&span->lock);
+	unlock_fb_info(data->fb_info);
+	return retval;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_span_store);
+
+static struct fb_deferred_io gfb_fb_defio = {
+	.delay = HZ / GFB_UPDATE_RATE_DEFAULT,
+	.deferred_io = gfb_fb_deferred_io,
+};
+
+
+/*
+ * Orientation
+ *
+ * Panels mounted rotated or upside down are handled with var.rotate, set
+ * through FBIOPUT_VSCREENINFO or the rotate attribute of the fb device,
+ * and the fb_flip attribute. Clients then draw in the orientation they
+ * see and the converters pick every pixel up from where it ended up, so
+ * no extra pass over the frame is made. Rotating by 90 degrees swaps the
+ * fb geometry, which is not possible while the panel is a span cell.
+ */
+
+static const char * const gfb_flip_names[] = {
+	[0] = "none",
+	[GFB_FLIP_H] = "h",
+	[GFB_FLIP_V] = "v",
+	[GFB_FLIP_H | GFB_FLIP_V] = "hv",
+};
+
+static void gfb_orientation_probe(struct gfb_data *data)
+{
+	u32 rotate;
+	u8 flip;
+
+	for (rotate = FB_ROTATE_UR; rotate <= FB_ROTATE_CCW; rotate++)
+		for (flip = 0; flip < GFB_FLIPS; flip++)
+			gfb_orientation_init(&data->orientations[rotate][flip],
+					     data->panel, rotate, flip);
+
+	data->orientation = &data->orientations[FB_ROTATE_UR][0];
+}
+
+/* Switch to var.rotate and flip; called with the fb_info lock held */
+static void gfb_set_orientation(struct gfb_data *data)
+{
+	struct fb_info *info = data->fb_info;
+	const struct gfb_orientation *o =
+		&data->orientations[info->var.rotate][data->flip];
+	bool reshaped = o->xres != data->orientation->xres;
+
+	if (o == data->orientation)
+		return;
+
+	/* The text device lays its cells out under text_lock */
+	mutex_lock(&data->text_lock);
+	info->fix.line_length = o->line_length;
+	WRITE_ONCE(data->orientation, o);
+	if (data->text_cells != NULL)
+		gfb_text_layout(data);
+	mutex_unlock(&data->text_lock);
+
+	/* The contents make no sense in the new geometry */
+	if (reshaped)
+		memset(data->fb_bitmap, 0x00, info->fix.smem_len);
+
+	if (!data->virtualized)
+		gfb_fb_update(data);
+}
+
+static int gfb_fb_check_var(struct fb_var_screeninfo *var,
+			    struct fb_info *info)
+{
+	struct gfb_data *data = info->par;
+	const struct gfb_orientation *o;
+	u32 activate = var->activate;
+	u32 rotate = var->rotate;
+	int error = 0;
+
+	if (rotate > FB_ROTATE_CCW)
+		return -EINVAL;
+	o = &data->orientations[rotate][data->flip];
+
+	if (o->xres != data->panel->var.xres && gfb_span) {
+		mutex_lock(&gfb_span->lock);
+		if (data->span_cell >= 0)
+			error = -EBUSY;
+		mutex_unlock(&gfb_span->lock);
+		if (error)
+			return error;
+	}
+
+	/* Only the orientation can be changed */
+	*var = data->panel->var;
+	var->xres = o->xres;
+	var->yres = o->yres;
+	var->xres_virtual = o->xres;
+	var->yres_virtual = o->yres;
+	var->rotate = rotate;
+	var->activate = activate;
+
+	return 0;
+}
+
+static int gfb_fb_set_par(struct fb_info *info)
+{
+	gfb_set_orientation(info->par);
+	return 0;
+}
+
+/*
+ * The "fb_flip" attribute
+ */
+ssize_t gfb_fb_flip_show(struct device *dev,
+			 struct device_attribute *attr,
+			 char *buf)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+
+	if (!data)
+		return -ENODATA;
+
+	return sprintf(buf, "%s\n", gfb_flip_names[data->flip]);
+}
+EXPORT_SYMBOL_GPL(gfb_fb_flip_show);
+
+/* Accepts "none", "h", "v" or "hv" */
+ssize_t gfb_fb_flip_store(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct gfb_data *data = dev_get_gfbdata(dev);
+	u8 flip;
+
+	if (!data)
+		return -ENODATA;
+
+	for (flip = 0; flip < ARRAY_SIZE(gfb_flip_names); flip++)
+		if (sysfs_streq(buf, gfb_flip_names[flip]))
+			break;
+	if (flip == ARRAY_SIZE(gfb_flip_names)) {
+		dev_warn(dev, GFB_NAME " unrecognized input: %s", buf);
+		return -EINVAL;
+	}
+
+	lock_fb_info(data->fb_info);
+	data->flip = flip;
+	gfb_set_orientation(data);
+	unlock_fb_info(data->fb_info);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(gfb_fb_flip_store);
+
+/*
+ * Frame tap
+ *
+ * The send path only copies every frame it submits into tap_snap, under
+ * fb_urb_lock, which keeps the vbitmap stable. The tap work then diffs it
+ * against tap_prev and appends a record of the changed tiles to a byte
+ * ring, under tap_lock; a frame sent before the work got to the previous
+ * one replaces it. Readers never take a lock to follow the ring: they copy
+ * a record out, then check that the writer did not lap them meanwhile, in
+ * which case they start over from a keyframe built from tap_prev. Nothing
+ * is computed while no reader is open.
+ */
+
+struct gfb_tap_reader {
+	struct gfb_data *data;
+	struct mutex lock;	/* serializes reads and keyframe requests */
+	unsigned long pos;	/* next ring byte to read */
+	u8 *record;		/* staged record, gfb_tap_record_max() bytes */
+	size_t len;		/* bytes staged */
+	size_t off;		/* bytes of the staged record already read */
+};
+
+static size_t gfb_tap_record_max(struct gfb_data *data)
+{
+	return sizeof(struct gfb_tap_record) +
+		data->tap_tiles * sizeof(struct gfb_tap_tile);
+}
+
+/* Ring bytes that can be read back safely behind tap_head */
+static unsigned long gfb_tap_window(struct gfb_data *data)
+{
+	/* The writer may be overwriting up to one record past tap_head */
+	return GFB_TAP_RING_SIZE - gfb_tap_record_max(data);
+}
+
+static void gfb_tap_ring_write(struct gfb_data *data, unsigned long pos,
+			       const void *src, size_t len)
+{
+	size_t off = pos & (GFB_TAP_RING_SIZE - 1);
+	size_t part = min_t(size_t, len, GFB_TAP_RING_SIZE - off);
+
+	memcpy(data->tap_ring + off, src, part);
+	memcpy(data->tap_ring, src + part, len - part);
+}
+
+static void gfb_tap_ring_read(struct gfb_data *data, unsigned long pos,
+			      void *dst, size_t len)
+{
+	size_t off = pos & (GFB_TAP_RING_SIZE - 1);
+	size_t part = min_t(size_t, len, GFB_TAP_RING_SIZE - off);
+
+	memcpy(dst, data->tap_ring + off, part);
+	memcpy(dst + part, data->tap_ring, len - part);
+}
+
+/* Hand the frame in fb_vbitmap to the tap work; fb_urb_lock is held */
+static void gfb_tap_snapshot(struct gfb_data *data)
+{
+	size_t header_size = data->panel->header_size;
+
+	memcpy(data->tap_snap, data->fb_vbitmap + header_size,
+	       data->fb_vbitmap_size - header_size);
+	data->tap_snap_seq = ++data->tap_seq;
+	data->tap_snap_full = true;
+
+	schedule_work(&data->tap_work);
+}
+
+/* Append the last frame snapshot to the ring */
+static void gfb_tap_work(struct work_struct *work)
+{
+	struct gfb_data *data = container_of(work, struct gfb_data, tap_work);
+	size_t frame_size = data->fb_vbitmap_size - data->panel->header_size;
+	struct gfb_tap_record record;
+	unsigned long irq_flags;
+	unsigned long pos;
+	size_t off, len;
+	u32 i, seq, tiles = 0;
+	u8 *frame;
+
+	/* Take the snapshot, the send path gets the spare buffer */
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	if (!data->tap_snap_full) {
+		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+		return;
+	}
+	frame = data->tap_snap;
+	data->tap_snap = data->tap_frame;
+	data->tap_frame = frame;
+	data->tap_snap_full = false;
+	seq = data->tap_snap_seq;
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	mutex_lock(&data->tap_lock);
+
+	pos = data->tap_head + sizeof(record);
+	for (i = 0; i < data->tap_tiles; i++) {
+		off = i * GFB_TAP_TILE;
+		len = min_t(size_t, GFB_TAP_TILE, frame_size - off);
+
+		if (!memcmp(data->tap_prev + off, frame + off, len))
+			continue;
+		memcpy(data->tap_prev + off, frame + off, len);
+
+		gfb_tap_ring_write(data, pos, &i, sizeof(i));
+		pos += sizeof(i);
+		gfb_tap_ring_write(data, pos, data->tap_prev + off,
+				   GFB_TAP_TILE);
+		pos += GFB_TAP_TILE;
+		tiles++;
+	}
+
+	if (tiles == 0)
+		goto out;
+
+	record.size = pos - data->tap_head;
+	record.seq = seq;
+	record.flags = 0;
+	record.tiles = tiles;
+	gfb_tap_ring_write(data, data->tap_head, &record, sizeof(record));
+
+	/* Make the record visible before the new head */
+	smp_store_release(&data->tap_head, pos);
+
+	wake_up_interruptible(&data->tap_wait);
+
+out:
+	mutex_unlock(&data->tap_lock);
+}
+
+/* Stage a keyframe of the last frame sent and follow the ring from there */
+static void gfb_tap_keyframe(struct gfb_tap_reader *reader)
+{
+	struct gfb_data *data = reader->data;
+	struct gfb_tap_record *record = (struct gfb_tap_record *)reader->record;
+	struct gfb_tap_tile *tile = (struct gfb_tap_tile *)(record + 1);
+	u32 i;
+
+	mutex_lock(&data->tap_lock);
+
+	for (i = 0; i < data->tap_tiles; i++, tile++) {
+		tile->index = i;
+		memcpy(tile->data, data->tap_prev + i * GFB_TAP_TILE,
+		       GFB_TAP_TILE);
+	}
+	record->size = gfb_tap_record_max(data);
+	record->seq = data->tap_seq;
+	record->flags = GFB_TAP_KEYFRAME;
+	record->tiles = data->tap_tiles;
+
+	reader->pos = data->tap_head;
+
+	mutex_unlock(&data->tap_lock);
+
+	reader->len = record->size;
+	reader->off = 0;
+}
+
+/* Stage the next record of the ring; false if there is none yet */
+static bool gfb_tap_next(struct gfb_tap_reader *reader)
+{
+	struct gfb_data *data = reader->data;
+	struct gfb_tap_record *record = (struct gfb_tap_record *)reader->record;
+	unsigned long head = smp_load_acquire(&data->tap_head);
+
+	if (head == reader->pos)
+		return false;
+
+	if (head - reader->pos <= gfb_tap_window(data)) {
+		gfb_tap_ring_read(data, reader->pos, record, sizeof(*record));
+		if (record->size >= sizeof(*record) &&
+		    record->size <= gfb_tap_record_max(data)) {
+			gfb_tap_ring_read(data, reader->pos + sizeof(*record),
+					  record + 1,
+					  record->size - sizeof(*record));
+
+			/* Still valid if the writer didn't get to it */
+			smp_rmb();
+			head = READ_ONCE(data->tap_head);
+			if (head - reader->pos <= gfb_tap_window(data)) {
+				reader->pos += record->size;
+				reader->len = record->size;
+				reader->off = 0;
+				return true;
+			}
+		}
+	}
+
+	/* Overrun, start over */
+	gfb_tap_keyframe(reader);
+	return true;
+}
+
+static ssize_t gfb_tap_read(struct file *file, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct gfb_tap_reader *reader = file->private_data;
+	struct gfb_data *data = reader->data;
+	size_t done = 0;
+	size_t len;
+	int error = 0;
+
+	mutex_lock(&reader->lock);
+
+	while (done < count) {
+		if (reader->off == reader->len && !gfb_tap_next(reader)) {
+			if (done || data->virtualized)
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				error = -EAGAIN;
+				break;
+			}
+
+			mutex_unlock(&reader->lock);
+			error = wait_event_interruptible(data->tap_wait,
+				smp_load_acquire(&data->tap_head) !=
+				READ_ONCE(reader->pos) || data->virtualized);
+			if (error)
+				return error;
+			mutex_lock(&reader->lock);
+			continue;
+		}
+
+		len = min(reader->len - reader->off, count - done);
+		if (copy_to_user(buf + done, reader->record + reader->off,
+				 len)) {
+			error = -EFAULT;
+			break;
+		}
+
+		reader->off += len;
+		done += len;
+	}
+
+	mutex_unlock(&reader->lock);
+	return done ? done : error;
+}
+
+static long gfb_tap_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct gfb_tap_reader *reader = file->private_data;
+
+	switch (cmd) {
+	case GFB_IOC_TAP_KEYFRAME:
+		/* The staged record is dropped, the keyframe supersedes it */
+		mutex_lock(&reader->lock);
+		gfb_tap_keyframe(reader);
+		mutex_unlock(&reader->lock);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static __poll_t gfb_tap_poll(struct file *file, poll_table *wait)
+{
+	struct gfb_tap_reader *reader = file->private_data;
+	struct gfb_data *data = reader->data;
+
+	poll_wait(file, &data->tap_wait, wait);
+
+	if (reader->off != reader->len ||
+	    smp_load_acquire(&data->tap_head) != reader->pos)
+		return EPOLLIN | EPOLLRDNORM;
+	if (data->virtualized)
+		return EPOLLHUP;
+
+	return 0;
+}
+
+static int gfb_tap_open(struct inode *inode, struct file *file)
+{
+	struct gfb_data *data = container_of(file->private_data,
+					     struct gfb_data, tap_miscdev);
+	size_t header_size = data->panel->header_size;
+	struct gfb_tap_reader *reader;
+	unsigned long irq_flags;
+	int error;
+
+	if (!gfb_count_get(data))
+		return -ENODEV;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (reader == NULL) {
+		error = -ENOMEM;
+		goto err_put_count;
+	}
+	reader->data = data;
+	mutex_init(&reader->lock);
+
+	reader->record = vmalloc(gfb_tap_record_max(data));
+	if (reader->record == NULL) {
+		error = -ENOMEM;
+		goto err_cleanup_reader;
+	}
+
+	mutex_lock(&data->tap_lock);
+
+	if (data->tap_ring == NULL) {
+		data->tap_ring = vmalloc(GFB_TAP_RING_SIZE);
+		data->tap_prev = vzalloc(data->tap_tiles * GFB_TAP_TILE);
+		data->tap_snap = vzalloc(data->tap_tiles * GFB_TAP_TILE);
+		data->tap_frame = vzalloc(data->tap_tiles * GFB_TAP_TILE);
+		if (data->tap_ring == NULL || data->tap_prev == NULL ||
+		    data->tap_snap == NULL || data->tap_frame == NULL) {
+			vfree(data->tap_ring);
+			vfree(data->tap_prev);
+			vfree(data->tap_snap);
+			vfree(data->tap_frame);
+			data->tap_ring = NULL;
+			data->tap_prev = NULL;
+			data->tap_snap = NULL;
+			data->tap_frame = NULL;
+			mutex_unlock(&data->tap_lock);
+			error = -ENOMEM;
+			goto err_cleanup_record;
+		}
+	}
+
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	/* tap_prev wasn't maintained while nobody was reading */
+	if (atomic_read(&data->tap_readers) == 0) {
+		memcpy(data->tap_prev, data->fb_vbitmap + header_size,
+		       data->fb_vbitmap_size - header_size);
+		data->tap_snap_full = false;
+	}
+	atomic_inc(&data->tap_readers);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	mutex_unlock(&data->tap_lock);
+
+	gfb_tap_keyframe(reader);
+	file->private_data = reader;
+
+	/* match kref_put in gfb_tap_release */
+	kref_get(&data->kref);
+
+	return nonseekable_open(inode, file);
+
+err_cleanup_record:
+	vfree(reader->record);
+
+err_cleanup_reader:
+	kfree(reader);
+
+err_put_count:
+	gfb_count_put(data, HZ);
+	return error;
+}
+
+static int gfb_tap_release(struct inode *inode, struct file *file)
+{
+	struct gfb_tap_reader *reader = file->private_data;
+	struct gfb_data *data = reader->data;
+
+	mutex_lock(&data->tap_lock);
+	atomic_dec(&data->tap_readers);
+	mutex_unlock(&data->tap_lock);
+
+	vfree(reader->record);
+	kfree(reader);
+
+	gfb_count_put(data, HZ);
+
+	/* match kref_get in gfb_tap_open */
+	kref_put(&data->kref, gfb_free_data);
+
+	return 0;
+}
+
+static const struct file_operations gfb_tap_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = gfb_tap_open,
+	.release = gfb_tap_release,
+	.read	 = gfb_tap_read,
+	.poll	 = gfb_tap_poll,
+	.unlocked_ioctl = gfb_tap_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static void gfb_tap_probe(struct gfb_data *data)
+{
+	size_t frame_size = data->fb_vbitmap_size -
+		data->panel->header_size;
+
+	data->tap_tiles = DIV_ROUND_UP(frame_size, GFB_TAP_TILE);
+
+	snprintf(data->tap_name, sizeof(data->tap_name), "fbtap%d",
+		 data->fb_info->node);
+	data->tap_miscdev.minor = MISC_DYNAMIC_MINOR;
+	data->tap_miscdev.name = data->tap_name;
+	data->tap_miscdev.fops = &gfb_tap_fops;
+	data->tap_miscdev.parent = data->dev;
+	data->tap_miscdev.mode = 0400;
+
+	if (misc_register(&data->tap_miscdev)) {
+		dev_warn(data->dev, GFB_NAME " failed to register the frame tap\n");
+		data->tap_tiles = 0;
+	}
+}
+
+static void gfb_tap_remove(struct gfb_data *data)
+{
+	if (data->tap_tiles != 0)
+		misc_deregister(&data->tap_miscdev);
+
+	/* No frames are sent anymore, publish the last one */
+	flush_work(&data->tap_work);
+
+	/* Readers see the end of the stream */
+	wake_up_interruptible(&data->tap_wait);
+}
+
+/*
+ * Frame queue
+ *
+ * A single client submits complete frames to /dev/fbqueueN, each to be
+ * shown no earlier than its present time, and reads back when every frame
+ * was sent or that it was dropped. Frames are converted at submit time
+ * into a ring of GFB_QUEUE_SLOTS vbitmaps which the queue work sends in
+ * order, dropping a frame when a later one is due as well. Slot indices
+ * only grow: events are read from queue_read to queue_show, frames wait
+ * from queue_show to queue_write. A slot is reused once the event of its
+ * frame has been read, which paces the client to the panel.
+ */
+
+#define gfb_queue_data(file)						\
+	container_of((file)->private_data, struct gfb_data, queue_miscdev)
+
+static struct gfb_queue_slot *gfb_queue_slot(struct gfb_data *data,
+					     unsigned int i)
+{
+	return &data->queue_slots[i % GFB_QUEUE_SLOTS];
+}
+
+/* Called with queue_lock held */
+static void gfb_queue_complete(struct gfb_data *data, u32 status, u64 now)
+{
+	struct gfb_queue_slot *slot = gfb_queue_slot(data, data->queue_show);
+
+	slot->status = status;
+	slot->time_ns = now;
+	data->queue_show++;
+
+	wake_up_interruptible(&data->queue_wait);
+}
+
+static void gfb_queue_work(struct work_struct *work)
+{
+	struct gfb_data *data = container_of(work, struct gfb_data,
+					     queue_work.work);
+	struct gfb_queue_slot *slot;
+	u64 now;
+	int retval = -EBUSY;
+
+	mutex_lock(&data->queue_lock);
+
+	now = ktime_get_ns();
+	while (data->queue_write - data->queue_show > 1 &&
+	       gfb_queue_slot(data, data->queue_show + 1)->present_ns <= now)
+		gfb_queue_complete(data, GFB_QUEUE_DROPPED, now);
+
+	if (data->queue_show == data->queue_write)
+		goto out;
+
+	slot = gfb_queue_slot(data, data->queue_show);
+	if (slot->present_ns > now) {
+		schedule_delayed_work(&data->queue_work,
+				      max_t(unsigned long, 1,
+					    nsecs_to_jiffies(slot->present_ns -
+							     now)));
+		goto out;
+	}
+
+	/* Don't overwrite the vbitmap while the urb still reads from it */
+	if (!data->fb_vbitmap_busy) {
+		memcpy(data->fb_vbitmap, slot->vbitmap, data->fb_vbitmap_size);
+		/* Later partial updates must not patch the queued frame */
+		WRITE_ONCE(data->fb_vbitmap_stale, true);
+		data->text_stale = true;
+		retval = gfb_fb_try_send(data);
+	}
+	if (retval == -EBUSY) {
+		schedule_delayed_work(&data->queue_work, 1);
+		goto out;
+	}
+
+	gfb_queue_complete(data, retval ? GFB_QUEUE_DROPPED : GFB_QUEUE_SHOWN,
+			   ktime_get_ns());
+
+	if (data->queue_show != data->queue_write)
+		schedule_delayed_work(&data->queue_work, 0);
+
+out:
+	mutex_unlock(&data->queue_lock);
+}
+
+static bool gfb_queue_writable(struct gfb_data *data)
+{
+	unsigned int read = READ_ONCE(data->queue_read);
+	unsigned int show = READ_ONCE(data->queue_show);
+	unsigned int write = READ_ONCE(data->queue_write);
+
+	/* Without frames waiting, only reading events frees slots */
+	return write - read < GFB_QUEUE_SLOTS || show == write ||
+		data->virtualized;
+}
+
+static int gfb_queue_submit(struct gfb_data *data, struct file *file,
+			    void __user *argp)
+{
+	struct gfb_queue_frame frame;
+	struct gfb_queue_slot *slot;
+	size_t frame_size;
+	int error = 0;
+
+	if (copy_from_user(&frame, argp, sizeof(frame)))
+		return -EFAULT;
+
+	if (frame.flags != 0 || frame.reserved != 0)
+		return -EINVAL;
+
+	mutex_lock(&data->queue_lock);
+
+	while (data->queue_write - data->queue_read == GFB_QUEUE_SLOTS) {
+		if (data->queue_show == data->queue_write ||
+		    (file->f_flags & O_NONBLOCK)) {
+			error = -EAGAIN;
+			goto out;
+		}
+
+		mutex_unlock(&data->queue_lock);
+		error = wait_event_interruptible(data->queue_wait,
+						 gfb_queue_writable(data));
+		if (error)
+			return error;
+		mutex_lock(&data->queue_lock);
+	}
+
+	if (data->virtualized) {
+		error = -ENODEV;
+		goto out;
+	}
+
+	/* in the orientation at submit time */
+	frame_size = data->fb_info->fix.line_length * data->fb_info->var.yres;
+	if (copy_from_user(data->queue_bitmap, u64_to_user_ptr(frame.frame),
+			   frame_size)) {
+		error = -EFAULT;
+		goto out;
+	}
+
+	slot = gfb_queue_slot(data, data->queue_write);
+	gfb_convert_rect(data, data->queue_bitmap, slot->vbitmap, 0, 0,
+			 data->fb_info->var.xres, data->fb_info->var.yres);
+	slot->present_ns = frame.present_ns;
+	slot->cookie = frame.cookie;
+	data->queue_write++;
+
+	gfb_anim_stop(data);
+	mod_delayed_work(system_wq, &data->queue_work, 0);
+
+out:
+	mutex_unlock(&data->queue_lock);
+	return error;
 }
 
-/* Stub to call the system default and update the image on the gfb */
-static void gfb_fb_imageblit(struct fb_info *info, const struct fb_image *image)
+/* Drop the frames not sent yet */
+static void gfb_queue_drop(struct gfb_data *data)
 {
-	struct gfb_data *par = info->par;
+	u64 now = ktime_get_ns();
 
-	sys_imageblit(info, image);
-	gfb_fb_update(par);
+	mutex_lock(&data->queue_lock);
+	while (data->queue_show != data->queue_write)
+		gfb_queue_complete(data, GFB_QUEUE_DROPPED, now);
+	mutex_unlock(&data->queue_lock);
 }
 
+static long gfb_queue_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct gfb_data *data = gfb_queue_data(file);
+
+	switch (cmd) {
+	case GFB_IOC_QUEUE_SUBMIT:
+		return gfb_queue_submit(data, file, (void __user *)arg);
+	case GFB_IOC_QUEUE_DROP:
+		gfb_queue_drop(data);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
 
-static int gfb_fb_open(struct fb_info *info, int user)
+#ifdef CONFIG_COMPAT
+/* The structures are laid out alike, only pointers need translating */
+static long gfb_queue_compat_ioctl(struct file *file, unsigned int cmd,
+				   unsigned long arg)
 {
-	struct gfb_data *dev = info->par;
+	return gfb_queue_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
 
-	/* If the USB device is gone, we don't accept new opens */
-	if (dev->virtualized)
-		return -ENODEV;
+static ssize_t gfb_queue_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct gfb_data *data = gfb_queue_data(file);
+	struct gfb_queue_event event;
+	struct gfb_queue_slot *slot;
+	ssize_t done = 0;
+	int error = 0;
 
-	dev->fb_count++;
+	if (count < sizeof(event))
+		return -EINVAL;
 
-	/* match kref_put in gfb_fb_release */
-	kref_get(&dev->kref);
+	mutex_lock(&data->queue_lock);
 
-	return 0;
-}
+	while (data->queue_read == data->queue_show) {
+		if (data->virtualized)
+			goto out;
+		if (file->f_flags & O_NONBLOCK) {
+			error = -EAGAIN;
+			goto out;
+		}
 
+		mutex_unlock(&data->queue_lock);
+		error = wait_event_interruptible(data->queue_wait,
+			READ_ONCE(data->queue_read) !=
+			READ_ONCE(data->queue_show) || data->virtualized);
+		if (error)
+			return error;
+		mutex_lock(&data->queue_lock);
+	}
 
-static int gfb_fb_release(struct fb_info *info, int user)
-{
-	struct gfb_data *dev = info->par;
+	memset(&event, 0, sizeof(event));
+	while (count - done >= sizeof(event) &&
+	       data->queue_read != data->queue_show) {
+		slot = gfb_queue_slot(data, data->queue_read);
+		event.cookie = slot->cookie;
+		event.time_ns = slot->time_ns;
+		event.status = slot->status;
 
-	dev->fb_count--;
+		if (copy_to_user(buf + done, &event, sizeof(event))) {
+			error = -EFAULT;
+			break;
+		}
 
-	if (dev->virtualized && dev->fb_count == 0)
-		schedule_delayed_work(&dev->free_framebuffer_work, HZ);
+		data->queue_read++;
+		done += sizeof(event);
+	}
 
-	/* match kref_get in gfb_fb_open */
-	kref_put(&dev->kref, gfb_free_data);
+	/* Submitters may be waiting for the slots */
+	if (done)
+		wake_up_interruptible(&data->queue_wait);
 
-	return 0;
+out:
+	mutex_unlock(&data->queue_lock);
+	return done ? done : error;
 }
 
-/*
- * this is the slow path from userspace. they can seek and write to
- * the fb. it's inefficient to do anything less than a full screen draw
- */
-static ssize_t gfb_fb_write(struct fb_info *info, const char __user *buf,
-			    size_t count, loff_t *ppos)
+static __poll_t gfb_queue_poll(struct file *file, poll_table *wait)
 {
-	struct gfb_data *par = info->par;
-	ssize_t result;
+	struct gfb_data *data = gfb_queue_data(file);
+	__poll_t mask = 0;
 
-	result = fb_sys_write(info, buf, count, ppos);
-	if (result != -EFAULT && result != -EPERM)
-		result = gfb_fb_update(par);
-	return result;
-}
+	poll_wait(file, &data->queue_wait, wait);
 
-static struct fb_ops gfb_ops = {
-	.owner = THIS_MODULE,
-	.fb_read      = fb_sys_read,
-	.fb_open      = gfb_fb_open,
-	.fb_release   = gfb_fb_release,
-	.fb_write     = gfb_fb_write,
-	.fb_setcolreg = gfb_fb_setcolreg,
-	.fb_fillrect  = gfb_fb_fillrect,
-	.fb_copyarea  = gfb_fb_copyarea,
-	.fb_imageblit = gfb_fb_imageblit,
-};
+	if (READ_ONCE(data->queue_read) != READ_ONCE(data->queue_show))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(data->queue_write) - READ_ONCE(data->queue_read) <
+	    GFB_QUEUE_SLOTS)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	if (data->virtualized)
+		mask |= EPOLLHUP;
 
-/*
- * The "fb_node" attribute
- */
-ssize_t gfb_fb_node_show(struct device *dev,
-			 struct device_attribute *attr,
-			 char *buf)
+	return mask;
+}
+
+static int gfb_queue_open(struct inode *inode, struct file *file)
 {
-	unsigned fb_node;
-	struct gfb_data *data = dev_get_gfbdata(dev);
+	struct gfb_data *data = gfb_queue_data(file);
+	int i, error = 0;
 
-	if (!data)
-		return -ENODATA;
+	if (!gfb_count_get(data))
+		return -ENODEV;
 
-	fb_node = data->fb_info->node;
+	mutex_lock(&data->queue_lock);
 
-	return sprintf(buf, "%u\n", fb_node);
+	/* The queue has a single producer */
+	if (data->queue_frames != NULL) {
+		error = -EBUSY;
+		goto out;
+	}
+
+	data->queue_frames = vzalloc(GFB_QUEUE_SLOTS * data->fb_vbitmap_size);
+	data->queue_bitmap = vmalloc(data->fb_info->fix.smem_len);
+	if (data->queue_frames == NULL || data->queue_bitmap == NULL) {
+		vfree(data->queue_frames);
+		vfree(data->queue_bitmap);
+		data->queue_frames = NULL;
+		data->queue_bitmap = NULL;
+		error = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < GFB_QUEUE_SLOTS; i++)
+		data->queue_slots[i].vbitmap = data->queue_frames +
+			i * data->fb_vbitmap_size;
+	data->queue_read = 0;
+	data->queue_show = 0;
+	data->queue_write = 0;
+
+	/* match kref_put in gfb_queue_release */
+	kref_get(&data->kref);
+
+out:
+	mutex_unlock(&data->queue_lock);
+	if (error) {
+		gfb_count_put(data, HZ);
+		return error;
+	}
+	return nonseekable_open(inode, file);
 }
-EXPORT_SYMBOL_GPL(gfb_fb_node_show);
 
-/*
- * The "fb_update_rate" attribute
- */
-ssize_t gfb_fb_update_rate_show(struct device *dev,
-				struct device_attribute *attr,
-				char *buf)
+static int gfb_queue_release(struct inode *inode, struct file *file)
 {
-	unsigned fb_update_rate;
-	struct gfb_data *data = dev_get_gfbdata(dev);
-
-	if (!data)
-		return -ENODATA;
+	struct gfb_data *data = gfb_queue_data(file);
 
-	fb_update_rate = data->fb_update_rate;
+	/* Nobody is left to tell about the frames still queued */
+	gfb_queue_drop(data);
+	cancel_delayed_work_sync(&data->queue_work);
 
-	return sprintf(buf, "%u\n", fb_update_rate);
-}
-EXPORT_SYMBOL_GPL(gfb_fb_update_rate_show);
+	mutex_lock(&data->queue_lock);
+	vfree(data->queue_frames);
+	vfree(data->queue_bitmap);
+	data->queue_frames = NULL;
+	data->queue_bitmap = NULL;
+	mutex_unlock(&data->queue_lock);
 
-static ssize_t gfb_set_fb_update_rate(struct gfb_data *data,
-				      unsigned fb_update_rate)
-{
-	if (fb_update_rate > GFB_UPDATE_RATE_LIMIT)
-		data->fb_update_rate = GFB_UPDATE_RATE_LIMIT;
-	else if (fb_update_rate == 0)
-		data->fb_update_rate = 1;
-	else
-		data->fb_update_rate = fb_update_rate;
+	gfb_count_put(data, HZ);
 
-	data->fb_defio.delay = HZ / data->fb_update_rate;
+	/* match kref_get in gfb_queue_open */
+	kref_put(&data->kref, gfb_free_data);
 
 	return 0;
 }
 
-ssize_t gfb_fb_update_rate_store(struct device *dev,
-				 struct device_attribute *attr,
-				 const char *buf, size_t count)
-{
-	int i;
-	unsigned u;
-	ssize_t set_result;
-
-	struct gfb_data *data = dev_get_gfbdata(dev);
-
-	if (!data)
-		return -ENODATA;
+static const struct file_operations gfb_queue_fops = {
+	.owner		= THIS_MODULE,
+	.open		= gfb_queue_open,
+	.release	= gfb_queue_release,
+	.read		= gfb_queue_read,
+	.poll		= gfb_queue_poll,
+	.unlocked_ioctl	= gfb_queue_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= gfb_queue_compat_ioctl,
+#endif
+};
 
-	i = kstrtouint(buf, 0, &u);
-	if (i != 0) {
-		dev_warn(dev, GFB_NAME " unrecognized input: %s", buf);
-		return -EINVAL;
+static void gfb_queue_probe(struct gfb_data *data)
+{
+	snprintf(data->queue_name, sizeof(data->queue_name), "fbqueue%d",
+		 data->fb_info->node);
+	data->queue_miscdev.minor = MISC_DYNAMIC_MINOR;
+	data->queue_miscdev.name = data->queue_name;
+	data->queue_miscdev.fops = &gfb_queue_fops;
+	data->queue_miscdev.parent = data->dev;
+
+	if (misc_register(&data->queue_miscdev)) {
+		dev_warn(data->dev, GFB_NAME " failed to register the frame queue\n");
+		data->queue_miscdev.fops = NULL;
 	}
+}
 
-	set_result = gfb_set_fb_update_rate(data, u);
-
-	if (set_result < 0)
-		return set_result;
+static void gfb_queue_remove(struct gfb_data *data)
+{
+	if (data->queue_miscdev.fops != NULL)
+		misc_deregister(&data->queue_miscdev);
 
-	return count;
+	/* Blocked clients see the device is gone */
+	wake_up_interruptible(&data->queue_wait);
 }
-EXPORT_SYMBOL_GPL(gfb_fb_update_rate_store);
-
-static struct fb_deferred_io gfb_fb_defio = {
-	.delay = HZ / GFB_UPDATE_RATE_DEFAULT,
-	.deferred_io = gfb_fb_deferred_io,
-};
 
 
 /* Free the gfb_data structure and the bitmaps. */
 static void gfb_free_data(struct kref *kref)
 {
 	struct gfb_data *data = container_of(kref, struct gfb_data, kref);
+	int i;
+
+	for (i = 0; i < GFB_SPRITE_MAX; i++)
+		gfb_sprite_free(data, i);
 
 	vfree(data->fb_bitmap);
 	kfree(data->fb_vbitmap);
+	vfree(data->anim_frames);
+	kfree(data->anim_delays);
+	vfree(data->tap_ring);
+	vfree(data->tap_prev);
+	vfree(data->tap_snap);
+	vfree(data->tap_frame);
+	kfree(data->mirror_xoff);
+	kfree(data->text_glyphs);
+	kfree(data->text_cells);
 
 	kfree(data);
 }
@@ -546,6 +3288,7 @@ static void gfb_free_framebuffer_work(struct work_struct *work)
 	struct fb_info *info = data->fb_info;
 
 	if (info) {
+		gfb_anim_halt(data);
 		fb_deferred_io_cleanup(info);
 		usb_free_urb(data->fb_urb);
 
@@ -560,13 +3303,109 @@ static void gfb_free_framebuffer_work(struct work_struct *work)
 }
 
 
+/*
+ * Boot splash
+ *
+ * The splash image is requested asynchronously, so the panel shows
+ * something long before a client starts without making probe wait for the
+ * filesystem. It is a raw framebuffer image of smem_len bytes, looked up as
+ * gfb/splash-<product id>.bin first and gfb/splash-mono.bin or
+ * gfb/splash-qvga.bin second. A pending request holds the framebuffer like
+ * an open file handle.
+ */
 
-struct gfb_data *gfb_probe(struct hid_device *hdev,
-			   const int panel_type) {
+static void gfb_splash_show(struct gfb_data *data, const struct firmware *fw)
+{
+	struct fb_info *info = data->fb_info;
+
+	if (fw->size != info->fix.smem_len) {
+		dev_warn(data->dev, GFB_NAME
+			 ": ignoring splash of %zu bytes, expected %u\n",
+			 fw->size, info->fix.smem_len);
+		return;
+	}
+
+	lock_fb_info(info);
+	if (!data->virtualized) {
+		memcpy(data->fb_bitmap, fw->data, fw->size);
+		gfb_fb_update(data);
+	}
+	unlock_fb_info(info);
+}
+
+static void gfb_splash_loaded(const struct firmware *fw, void *context);
+
+static int gfb_splash_request(struct gfb_data *data, const char *name)
+{
+	return request_firmware_nowait(THIS_MODULE, true, name,
+				       data->dev, GFP_KERNEL, data,
+				       gfb_splash_loaded);
+}
+
+static void gfb_splash_loaded(const struct firmware *fw, void *context)
+{
+	struct gfb_data *data = context;
+	char name[32];
+
+	if (fw == NULL && !data->splash_fallback && !data->virtualized) {
+		/* The new request inherits our references */
+		snprintf(name, sizeof(name), "gfb/splash-%s.bin",
+			 data->panel->name);
+		data->splash_fallback = true;
+		if (gfb_splash_request(data, name) == 0)
+			return;
+	}
+
+	if (fw)
+		gfb_splash_show(data, fw);
+	release_firmware(fw);
+
+	gfb_count_put(data, HZ);
+
+	/* match kref_get in gfb_splash_probe */
+	kref_put(&data->kref, gfb_free_data);
+}
+
+static void gfb_splash_probe(struct gfb_data *data)
+{
+	char name[32];
+
+	if (!splash)
+		return;
+
+	if (data->hdev) {
+		snprintf(name, sizeof(name), "gfb/splash-%04x.bin",
+			 data->hdev->product);
+	} else {
+		snprintf(name, sizeof(name), "gfb/splash-%s.bin",
+			 data->panel->name);
+		data->splash_fallback = true;
+	}
+
+	atomic_inc(&data->fb_count);
+	kref_get(&data->kref);
+
+	if (gfb_splash_request(data, name)) {
+		gfb_count_put(data, HZ);
+		kref_put(&data->kref, gfb_free_data);
+	}
+}
+
+
+/*
+ * Set up a framebuffer on dev. Frames go through transport, or the default
+ * USB transport of the panel on hdev when it is NULL.
+ */
+static struct gfb_data *__gfb_probe(struct device *dev,
+				    struct hid_device *hdev,
+				    const int panel_type,
+				    const struct gfb_transport *transport,
+				    void *transport_data)
+{
 	int error;
 	struct gfb_data *data;
 
-	dev_dbg(&hdev->dev, "Logitech GamePanel framebuffer probe...");
+	dev_dbg(dev, "Logitech GamePanel framebuffer probe...");
 
 	/*
 	 * Let's allocate the gfb data structure, set some reasonable
@@ -583,107 +3422,84 @@ struct gfb_data *gfb_probe(struct hid_device *hdev,
 
 	kref_init(&data->kref); /* matching kref_put in gfb_remove */
 
-	data->fb_info = framebuffer_alloc(0, &hdev->dev);
+	data->fb_info = framebuffer_alloc(0, dev);
 	if (data->fb_info == NULL) {
-		dev_err(&hdev->dev, GFB_NAME " failed to allocate fb\n");
+		dev_err(dev, GFB_NAME " failed to allocate fb\n");
 		goto err_cleanup_data;
 	}
 
 	/* init Framebuffer visual structures */
 
+	if (panel_type < 0 || panel_type >= ARRAY_SIZE(gfb_panels) ||
+	    gfb_panels[panel_type].ops == NULL) {
+		dev_err(dev, GFB_NAME ": ERROR: unknown panel type\n");
+		goto err_cleanup_fb;
+	}
+
 	data->panel_type = panel_type;
+	data->panel = &gfb_panels[panel_type];
+	data->converter = &data->panel->converters[0];
+	gfb_orientation_probe(data);
+	if (transport)
+		data->transport = transport;
+	else if (loopback)
+		data->transport = &gfb_loopback_transport;
+	else
+		data->transport = data->panel->transport;
+	data->transport_data = transport_data;
 
-	switch (panel_type) {
-	case GFB_PANEL_TYPE_160_43_1:
-		data->fb_info->fix = (struct fb_fix_screeninfo) {
-			.id = "GFB_MONO",
-			.type = FB_TYPE_PACKED_PIXELS,
-			.visual = FB_VISUAL_MONO01,
-			.xpanstep = 0,
-			.ypanstep = 0,
-			.ywrapstep = 0,
-			.line_length = 32, /* = xres*bpp/8 + 12 bytes padding */
-			.accel = FB_ACCEL_NONE,
-		};
-		data->fb_info->var = (struct fb_var_screeninfo) {
-			.xres = 160,
-			.yres = 43,
-			.xres_virtual = 160,
-			.yres_virtual = 43,
-			.bits_per_pixel = 1,
-		};
+	data->fb_info->fix = data->panel->fix;
+	data->fb_info->var = data->panel->var;
+	data->fb_vbitmap_size = data->panel->vbitmap_size;
 
-		/*
-		 * The native monochrome format uses vertical bits. Therefore
-		 * the number of bytes needed to represent the first column is
-		 * 43/8 (rows/bits) rounded up.
-		 * Additionally, the format requires a padding of 32 bits in
-		 * front of theimage data.
-		 *
-		 * Therefore the vbitmap size must be:
-		 *   160 * ceil(43/8) + 32 = 160 * 6 + 32 = 992
-		 */
-		data->fb_vbitmap_size = 992; /* = 32 + ceil(yres/8) * xres */
-		break;
-	case GFB_PANEL_TYPE_320_240_16:
-		data->fb_info->fix = (struct fb_fix_screeninfo) {
-			.id = "GFB_QVGA",
-			.type = FB_TYPE_PACKED_PIXELS,
-			.visual = FB_VISUAL_TRUECOLOR,
-			.xpanstep = 0,
-			.ypanstep = 0,
-			.ywrapstep = 0,
-			.line_length = 640, /*	 = xres * bpp/8 */
-			.accel = FB_ACCEL_NONE,
-		};
-		data->fb_info->var = (struct fb_var_screeninfo) {
-			.xres = 320,
-			.yres = 240,
-			.xres_virtual = 320,
-			.yres_virtual = 240,
-			.bits_per_pixel = 16,
-			.red	    = {11, 5, 0}, /* RGB565 */
-			.green	    = { 5, 6, 0},
-			.blue	    = { 0, 5, 0},
-			.transp	    = { 0, 0, 0},
-		};
-		data->fb_vbitmap_size = 154112; /* = yres * line_length +
-						 *   sizeof(hdata) */
-		break;
-	default:
-		dev_err(&hdev->dev, GFB_NAME ": ERROR: unknown panel type\n");
-		goto err_cleanup_fb;
-	}
 	data->fb_info->pseudo_palette = &pseudo_palette;
 	data->fb_info->fbops = &gfb_ops;
 	data->fb_info->par = data;
-	data->fb_info->flags = FBINFO_FLAG_DEFAULT;
 	data->fb_info->fix.smem_len =
 		data->fb_info->fix.line_length * data->fb_info->var.yres;
 
+	data->dev = dev;
 	data->hdev = hdev;
 
-	data->fb_bitmap = vmalloc(data->fb_info->fix.smem_len);
+	data->fb_bitmap = vzalloc(data->fb_info->fix.smem_len);
 	if (data->fb_bitmap == NULL) {
 		error = -ENOMEM;
 		goto err_cleanup_data;
 	}
 
-	data->fb_vbitmap = kmalloc_array(data->fb_vbitmap_size, sizeof(u8),
-					 GFP_KERNEL);
+	data->fb_vbitmap = kcalloc(data->fb_vbitmap_size, sizeof(u8),
+				   GFP_KERNEL);
 	if (data->fb_vbitmap == NULL) {
 		error = -ENOMEM;
 		goto err_cleanup_fb_bitmap;
 	}
 	data->fb_vbitmap_busy = false;
 
-	spin_lock_init(&data->fb_urb_lock);
+	/* Start from a blank, valid device image */
+	gfb_fb_convert(data);
 
-	data->fb_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (data->fb_urb == NULL) {
-		dev_err(&hdev->dev, GFB_NAME ": ERROR: can't alloc usb urb\n");
-		error = -ENOMEM;
-		goto err_cleanup_fb_vbitmap;
+	spin_lock_init(&data->fb_urb_lock);
+	spin_lock_init(&data->anim_lock);
+	mutex_init(&data->text_lock);
+	mutex_init(&data->tap_lock);
+	init_waitqueue_head(&data->tap_wait);
+	INIT_WORK(&data->tap_work, gfb_tap_work);
+	INIT_DELAYED_WORK(&data->anim_work, gfb_anim_work);
+	mutex_init(&data->mirror_lock);
+	INIT_DELAYED_WORK(&data->mirror_work, gfb_mirror_work);
+	mutex_init(&data->queue_lock);
+	init_waitqueue_head(&data->queue_wait);
+	INIT_DELAYED_WORK(&data->queue_work, gfb_queue_work);
+	data->span_cell = -1;
+	INIT_WORK(&data->span_work, gfb_span_panel_work);
+
+	if (hdev) {
+		data->fb_urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (data->fb_urb == NULL) {
+			dev_err(dev, GFB_NAME ": ERROR: can't alloc usb urb\n");
+			error = -ENOMEM;
+			goto err_cleanup_fb_vbitmap;
+		}
 	}
 
 	data->fb_info->screen_base = (char __force __iomem *) data->fb_bitmap;
@@ -705,9 +3521,14 @@ struct gfb_data *gfb_probe(struct hid_device *hdev,
 	if (register_framebuffer(data->fb_info) < 0)
 		goto err_cleanup_fb_deferred;
 
-	data->fb_count = 0;
+	atomic_set(&data->fb_count, 1); /* dropped by gfb_remove() */
 	data->virtualized = false;
 
+	gfb_text_probe(data);
+	gfb_tap_probe(data);
+	gfb_queue_probe(data);
+	gfb_splash_probe(data);
+
 	kref_get(&data->kref); /* matching kref_put in free_framebuffer_work */
 
 	return data;
@@ -728,14 +3549,52 @@ err_cleanup_data:
 err_no_cleanup:
 	return NULL;
 }
+
+struct gfb_data *gfb_probe(struct hid_device *hdev,
+			   const int panel_type) {
+	return __gfb_probe(&hdev->dev, hdev, panel_type, NULL, NULL);
+}
 EXPORT_SYMBOL_GPL(gfb_probe);
 
+/* Framebuffer without a USB device behind it, see hid-gfb-dummy.c */
+struct gfb_data *gfb_probe_transport(struct device *dev, const int panel_type,
+				     const struct gfb_transport *transport,
+				     void *transport_data)
+{
+	if (transport == NULL)
+		return NULL;
+
+	return __gfb_probe(dev, NULL, panel_type, transport, transport_data);
+}
+EXPORT_SYMBOL_GPL(gfb_probe_transport);
+
 
 void gfb_remove(struct gfb_data *data)
 {
+	unsigned long irq_flags;
+
+	gfb_text_remove(data);
+
 	data->virtualized = true;
-	if (data->fb_count == 0)
-		schedule_delayed_work(&data->free_framebuffer_work, 0);
+
+	/* Let a frame being submitted finish, no more are submitted after */
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	gfb_tap_remove(data);
+	gfb_queue_remove(data);
+
+	mutex_lock(&data->mirror_lock);
+	gfb_mirror_stop(data);
+	mutex_unlock(&data->mirror_lock);
+
+	if (gfb_span) {
+		mutex_lock(&gfb_span->lock);
+		gfb_span_leave(data);
+		mutex_unlock(&gfb_span->lock);
+	}
+
+	gfb_count_put(data, 0);
 
 	/* release reference taken by kref_init in gfb_probe() */
 	kref_put(&data->kref, gfb_free_data);
@@ -743,6 +3602,23 @@ void gfb_remove(struct gfb_data *data)
 EXPORT_SYMBOL_GPL(gfb_remove);
 
 
+static int __init gfb_init(void)
+{
+	if (span_cols == 0 || span_rows == 0)
+		return 0;
+
+	return gfb_span_create();
+}
+
+static void __exit gfb_exit(void)
+{
+	gfb_span_destroy();
+}
+
+module_init(gfb_init);
+module_exit(gfb_exit);
+
+
 MODULE_DESCRIPTION("Logitech GFB HID Driver");
 MODULE_AUTHOR("Rick L Vinyard Jr (rvinyard@cs.nmsu.edu)");
 MODULE_AUTHOR("Alistair Buxton (a.j.buxton@gmail.com)");
@@ -5,14 +5,76 @@
 #define GFB_PANEL_TYPE_320_240_16	1
 
 #include <linux/fb.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+
+#include "hid-gfb-ioctl.h"
+#include "hid-gfb-panel.h"
+
+/* See linux/font.h */
+struct font_desc;
+
+struct gfb_data;
+
+/*
+ * Carries frames to the panel. submit() is called with fb_urb_lock held to
+ * start sending fb_vbitmap. It returns 0 when the frame is in flight and
+ * gfb_fb_send_done() will be called once the vbitmap may be reused, 1 when
+ * the frame was consumed on the spot, or a negative error.
+ */
+struct gfb_transport {
+	const char *name;
+	int (*submit)(struct gfb_data *data);
+};
+
+/* A bitmap cached by GFB_IOC_SPRITE_UPLOAD, in the fb pixel format */
+struct gfb_sprite {
+	u16 width;
+	u16 height;
+	u32 stride;	/* bytes per row of pixels */
+	size_t size;	/* bytes accounted against the sprite cache */
+	u8 *pixels;
+	u8 *mask;	/* 1 bit per pixel, NULL when fully opaque */
+};
+
+/* Drawing in the pixel format of a panel */
+struct gfb_panel_ops {
+	/*
+	 * Draw a glyph column, bit n for row y + n, of height h at x,y in
+	 * fb_bitmap and, if direct, in fb_vbitmap too.
+	 */
+	void (*text_column)(struct gfb_data *data, int x, int y, int h,
+			    u32 bits, bool direct);
+	/* Draw the w x h part of a sprite from sx,sy at dx,dy in fb_bitmap */
+	void (*sprite_draw)(struct gfb_data *data,
+			    const struct gfb_sprite *sprite,
+			    int sx, int sy, int dx, int dy, int w, int h);
+};
+
+/* A frame of the frame queue */
+struct gfb_queue_slot {
+	u8 *vbitmap;
+	u64 present_ns;
+	u64 cookie;
+	u64 time_ns;	/* when it was sent or dropped */
+	u32 status;	/* GFB_QUEUE_ value */
+};
 
 /* Per device data structure */
 struct gfb_data {
-	struct hid_device *hdev;
+	struct device *dev;
+	struct hid_device *hdev;	/* NULL without a USB device */
 	struct kref kref;
 
 	/* Framebuffer stuff */
 	int panel_type; /* enumeration of GFB_PANEL_TYPE_ values */
+	const struct gfb_panel *panel;
+	const struct gfb_converter *converter;
+	const struct gfb_orientation *orientation;
+	struct gfb_orientation orientations[4][GFB_FLIPS]; /* by var.rotate and flip */
+	u8 flip;	/* GFB_FLIP_ bits */
+	const struct gfb_transport *transport;
+	void *transport_data;	/* for the transport, see gfb_probe_transport */
 
 	struct fb_info *fb_info;
 
@@ -22,6 +84,7 @@ struct gfb_data {
 	u8 *fb_bitmap;		/* device-dependent bitmap */
 	u8 *fb_vbitmap;		/* userspace bitmap */
 	int fb_vbitmap_busy;	/* soft-lock for vbitmap; uses fb_urb_lock */
+	bool fb_vbitmap_stale;	/* vbitmap holds a frame not from the bitmap */
 	size_t fb_vbitmap_size; /* size of vbitmap */
 
 	struct delayed_work free_framebuffer_work;
@@ -31,8 +94,79 @@ struct gfb_data {
 	spinlock_t fb_urb_lock;
 
 	/* Userspace stuff */
-	int fb_count;	   /* open file handle counter */
+	atomic_t fb_count; /* open file handles, plus one until removal */
 	bool virtualized;  /* true when physical device not present */
+	bool splash_fallback; /* splash lookup is at the panel type file */
+
+	/* Text device stuff */
+	struct miscdevice text_miscdev;
+	char text_name[16];
+	struct mutex text_lock;
+	const struct font_desc *text_font;
+	u32 *text_glyphs;  /* glyph cache: one bit column per glyph column */
+	u16 *text_cells;   /* characters currently shown on the panel */
+	int text_cols;
+	int text_rows;
+	bool text_stale;   /* fb was redrawn behind the text device's back */
+
+	/* Frame tap, the ring is written by tap_work under tap_lock */
+	struct miscdevice tap_miscdev;
+	char tap_name[16];
+	struct mutex tap_lock;	/* serializes opens, releases and the ring */
+	atomic_t tap_readers;
+	wait_queue_head_t tap_wait;
+	struct work_struct tap_work;
+	u8 *tap_ring;		/* GFB_TAP_RING_SIZE bytes of records */
+	unsigned long tap_head;	/* bytes ever written to the ring */
+	u8 *tap_prev;		/* last frame published, padded to whole tiles */
+	size_t tap_tiles;
+	u32 tap_seq;		/* frames sent, under fb_urb_lock */
+	u8 *tap_snap;		/* last frame sent, under fb_urb_lock */
+	bool tap_snap_full;	/* tap_snap waits for tap_work */
+	u32 tap_snap_seq;
+	u8 *tap_frame;		/* the frame tap_work diffs */
+
+	/* Frame queue, one client at a time */
+	struct miscdevice queue_miscdev;
+	char queue_name[16];
+	struct mutex queue_lock;
+	wait_queue_head_t queue_wait;
+	struct delayed_work queue_work;
+	struct gfb_queue_slot queue_slots[GFB_QUEUE_SLOTS];
+	u8 *queue_frames;	/* the slot vbitmaps, NULL while closed */
+	u8 *queue_bitmap;	/* frame being submitted, in the fb format */
+	unsigned int queue_read;	/* next event to read */
+	unsigned int queue_show;	/* next frame to send */
+	unsigned int queue_write;	/* next slot to fill */
+
+	/* Animation playback */
+	struct delayed_work anim_work;
+	spinlock_t anim_lock;	/* orders frames against client updates */
+	bool anim_playing;
+	u8 *anim_frames;	/* anim_count vbitmaps back to back */
+	unsigned long *anim_delays; /* jiffies per frame */
+	int anim_count;
+	int anim_frame;		/* next frame to show */
+
+	/* Mirror of another framebuffer, configured through sysfs */
+	struct delayed_work mirror_work;
+	struct mutex mirror_lock;
+	bool mirror_on;
+	int mirror_fb;
+	u32 mirror_x, mirror_y, mirror_w, mirror_h;
+	u32 mirror_rate;
+	u32 *mirror_xoff;	/* source byte offsets of the panel columns,
+				 * then of the panel rows */
+	struct file *mirror_file; /* the source fb, held open */
+
+	/* Cell of the span framebuffer, protected by the span lock */
+	int span_cell;		/* -1 when not spanned */
+	struct work_struct span_work;
+	int span_x, span_y, span_w, span_h; /* damage on this panel */
+
+	/* Sprite cache, protected by the fb_info lock */
+	struct gfb_sprite *sprites[GFB_SPRITE_MAX];
+	size_t sprite_bytes;
 };
 
 ssize_t gfb_fb_node_show(struct device *dev,
@@ -47,8 +181,46 @@ ssize_t gfb_fb_update_rate_store(struct device *dev,
 				 struct device_attribute *attr,
 				 const char *buf, size_t count);
 
+ssize_t gfb_fb_converter_show(struct device *dev,
+			      struct device_attribute *attr,
+			      char *buf);
+
+ssize_t gfb_fb_converter_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count);
+
+ssize_t gfb_fb_flip_show(struct device *dev,
+			 struct device_attribute *attr,
+			 char *buf);
+
+ssize_t gfb_fb_flip_store(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t count);
+
+ssize_t gfb_fb_mirror_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf);
+
+ssize_t gfb_fb_mirror_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count);
+
+ssize_t gfb_fb_span_show(struct device *dev,
+			 struct device_attribute *attr,
+			 char *buf);
+
+ssize_t gfb_fb_span_store(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t count);
+
 struct gfb_data *gfb_probe(struct hid_device *hdev, const int panel_type);
 
+struct gfb_data *gfb_probe_transport(struct device *dev, const int panel_type,
+				     const struct gfb_transport *transport,
+				     void *transport_data);
+
+void gfb_fb_send_done(struct gfb_data *data);
+
 void gfb_remove(struct gfb_data *data);
 
 #endif
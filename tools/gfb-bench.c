@@ -0,0 +1,617 @@
+/*
+ * gfb-bench - time and check the hid-gfb conversion routines in userspace
+ *
+ * The converters, orientations and palette math are taken as they are
+ * from hid-gfb-convert.h. Every converter is run in every orientation over
+ * synthetic and recorded frames, its output is checked bit by bit against
+ * a plain per-pixel conversion (and golden files when given) and the time
+ * it takes is reported.
+ *
+ * Build in this directory with
+ *
+ *	cc -O2 -Wall -o gfb-bench gfb-bench.c
+ *
+ * Recorded frames (-r) are raw framebuffer contents of the panel chosen
+ * with -p in its upright orientation, e.g. saved with
+ *
+ *	cat /dev/fb1 > frames.raw
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "gfb-bench-shim.h"
+#include "../hid-gfb-convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC	1
+#endif
+
+#define MAX_IMAGES	64
+
+/* Same geometry as gfb_panels[] in hid-gfb.c */
+static const struct gfb_panel bench_panels[] = {
+	{
+		.name = "mono",
+		.fix = {
+			.visual = FB_VISUAL_MONO01,
+			.line_length = 32,
+		},
+		.var = {
+			.xres = 160,
+			.yres = 43,
+			.xres_virtual = 160,
+			.yres_virtual = 43,
+			.bits_per_pixel = 1,
+		},
+		.header_size = 32,
+		.vbitmap_size = 992,
+		.damage_rows = 8,
+		.converters = gfb_mono_converters,
+	},
+	{
+		.name = "qvga",
+		.fix = {
+			.visual = FB_VISUAL_TRUECOLOR,
+			.line_length = 640,
+		},
+		.var = {
+			.xres = 320,
+			.yres = 240,
+			.xres_virtual = 320,
+			.yres_virtual = 240,
+			.bits_per_pixel = 16,
+			.red	    = {11, 5, 0},
+			.green	    = { 5, 6, 0},
+			.blue	    = { 0, 5, 0},
+			.transp	    = { 0, 0, 0},
+		},
+		.header_size = sizeof(hdata),
+		.vbitmap_size = 154112,
+		.damage_rows = 1,
+		.converters = gfb_qvga_converters,
+	},
+};
+
+static const char * const rotate_names[] = { "ur", "cw", "ud", "ccw" };
+static const char * const flip_names[] = { "", "-h", "-v", "-hv" };
+
+/* A test image in panel coordinates, one pixel value per u32 */
+struct image {
+	char name[64];
+	u32 *pixels;
+};
+
+static struct image images[MAX_IMAGES];
+static int nimages;
+
+static int iterations = 100;
+static const char *golden_dir;
+static int write_golden;
+static int native_only;
+static int failures;
+
+static u32 hash(u32 x, u32 y, u32 seed)
+{
+	u32 h = x * 0x9e3779b1 ^ y * 0x85ebca77 ^ seed * 0xc2b2ae3d;
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	return h;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static u64 cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int is_mono(const struct gfb_panel *p)
+{
+	return p->var.bits_per_pixel == 1;
+}
+
+static struct image *new_image(const struct gfb_panel *p, const char *name)
+{
+	struct image *img;
+
+	if (nimages == MAX_IMAGES) {
+		fprintf(stderr, "gfb-bench: too many images\n");
+		exit(1);
+	}
+
+	img = &images[nimages++];
+	snprintf(img->name, sizeof(img->name), "%s", name);
+	img->pixels = calloc(p->var.xres * p->var.yres, sizeof(u32));
+	if (img->pixels == NULL) {
+		perror("gfb-bench");
+		exit(1);
+	}
+	return img;
+}
+
+static u32 rgb565(int r, int g, int b)
+{
+	return (r << 11) | (g << 5) | b;
+}
+
+static void synthetic_images(const struct gfb_panel *p)
+{
+	static const u8 bayer[4][4] = {
+		{  0,  8,  2, 10 },
+		{ 12,  4, 14,  6 },
+		{  3, 11,  1,  9 },
+		{ 15,  7, 13,  5 },
+	};
+	int xres = p->var.xres, yres = p->var.yres;
+	struct image *noise = new_image(p, "noise");
+	struct image *gradient = new_image(p, "gradient");
+	struct image *checker = new_image(p, "checker");
+	struct image *sparse = new_image(p, "sparse");
+	int x, y, i;
+
+	for (y = 0; y < yres; y++) {
+		for (x = 0; x < xres; x++) {
+			i = y * xres + x;
+			if (is_mono(p)) {
+				noise->pixels[i] = hash(x, y, 1) & 1;
+				gradient->pixels[i] =
+					x * 16 / xres > bayer[y % 4][x % 4];
+				checker->pixels[i] = ((x / 8) ^ (y / 8)) & 1;
+				sparse->pixels[i] = hash(x, y, 2) % 61 == 0;
+			} else {
+				noise->pixels[i] = hash(x, y, 1) & 0xffff;
+				gradient->pixels[i] =
+					rgb565(x * 31 / (xres - 1),
+					       y * 63 / (yres - 1),
+					       (x + y) * 31 / (xres + yres - 2));
+				checker->pixels[i] = ((x / 8) ^ (y / 8)) & 1 ?
+					0xf81f : 0x07e0;
+				sparse->pixels[i] = hash(x, y, 2) % 61 == 0 ?
+					0xffff : 0x0000;
+			}
+		}
+	}
+}
+
+static u32 fb_get(const struct gfb_panel *p, const u8 *fb, int ll,
+		  int fx, int fy)
+{
+	if (is_mono(p))
+		return (fb[fy * ll + fx / 8] >> (fx % 8)) & 1;
+	return ((const u16 *)fb)[fy * ll / 2 + fx];
+}
+
+static void fb_set(const struct gfb_panel *p, u8 *fb, int ll,
+		   int fx, int fy, u32 v)
+{
+	if (!is_mono(p))
+		((u16 *)fb)[fy * ll / 2 + fx] = v;
+	else if (v)
+		fb[fy * ll + fx / 8] |= 1 << (fx % 8);
+	else
+		fb[fy * ll + fx / 8] &= ~(1 << (fx % 8));
+}
+
+/* Frames of the upright panel, one after the other */
+static int recorded_images(const struct gfb_panel *p, const char *path)
+{
+	size_t frame_size = p->fix.line_length * p->var.yres;
+	const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	struct image *img;
+	char name[64];
+	u8 *frame;
+	FILE *f;
+	int x, y, n = 0;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "gfb-bench: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	frame = malloc(frame_size);
+	if (frame == NULL) {
+		fclose(f);
+		return -1;
+	}
+
+	while (fread(frame, frame_size, 1, f) == 1) {
+		snprintf(name, sizeof(name), "%s.%d", base, n++);
+		img = new_image(p, name);
+		for (y = 0; y < p->var.yres; y++)
+			for (x = 0; x < p->var.xres; x++)
+				img->pixels[y * p->var.xres + x] =
+					fb_get(p, frame, p->fix.line_length,
+					       x, y);
+	}
+
+	if (n == 0)
+		fprintf(stderr, "gfb-bench: %s: no complete %zu byte frame\n",
+			path, frame_size);
+
+	free(frame);
+	fclose(f);
+	return n ? 0 : -1;
+}
+
+/*
+ * Draw an image into an fb laid out for orientation o. The padding at the
+ * end of the lines is left as garbage, converters must not look at it.
+ */
+static void render(const struct gfb_panel *p, const struct gfb_orientation *o,
+		   const struct image *img, u8 *fb)
+{
+	int x, y;
+
+	for (x = 0; x < o->line_length * o->yres; x++)
+		fb[x] = hash(x, 0, 3);
+
+	for (y = 0; y < p->var.yres; y++)
+		for (x = 0; x < p->var.xres; x++)
+			fb_set(p, fb, o->line_length, gfb_fb_x(o, x, y),
+			       gfb_fb_y(o, x, y),
+			       img->pixels[y * p->var.xres + x]);
+}
+
+/* The x,y,w,h area of an image in the panel format, one pixel at a time */
+static void reference(const struct gfb_panel *p, const struct image *img,
+		      u8 *vbitmap, int x1, int y1, int w, int h)
+{
+	int xres = p->var.xres, yres = p->var.yres;
+	u8 *byte;
+	u32 v;
+	int x, y;
+
+	if (is_mono(p))
+		vbitmap[0] = 0x03;
+	else
+		memcpy(vbitmap, hdata, sizeof(hdata));
+
+	for (y = y1; y < y1 + h; y++) {
+		for (x = x1; x < x1 + w; x++) {
+			v = img->pixels[y * xres + x];
+			if (!is_mono(p)) {
+				((u16 *)(vbitmap + p->header_size))
+					[x * yres + y] = v;
+				continue;
+			}
+			byte = vbitmap + p->header_size + y / 8 * xres + x;
+			if (v)
+				*byte |= 1 << (y % 8);
+			else
+				*byte &= ~(1 << (y % 8));
+		}
+	}
+}
+
+static int golden(const struct gfb_panel *p, const struct image *img,
+		  u8 *expected)
+{
+	char path[4096];
+	u8 *buf;
+	FILE *f;
+	int error = 0;
+
+	snprintf(path, sizeof(path), "%s/%s-%s.vb", golden_dir, p->name,
+		 img->name);
+
+	if (write_golden) {
+		f = fopen(path, "wb");
+		if (f == NULL ||
+		    fwrite(expected, p->vbitmap_size, 1, f) != 1) {
+			fprintf(stderr, "gfb-bench: %s: %s\n", path,
+				strerror(errno));
+			error = -1;
+		}
+		if (f != NULL)
+			fclose(f);
+		return error;
+	}
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "gfb-bench: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	buf = malloc(p->vbitmap_size);
+	if (buf == NULL || fread(buf, p->vbitmap_size, 1, f) != 1) {
+		fprintf(stderr, "gfb-bench: %s: short golden image\n", path);
+		error = -1;
+	} else if (memcmp(buf, expected, p->vbitmap_size)) {
+		fprintf(stderr, "gfb-bench: %s: reference differs\n", path);
+		error = -1;
+	} else {
+		/* Converters are held to the golden image from now on */
+		memcpy(expected, buf, p->vbitmap_size);
+	}
+
+	free(buf);
+	fclose(f);
+	return error;
+}
+
+static void mismatch(const struct gfb_panel *p, const struct gfb_converter *c,
+		     int rotate, int flip, const struct image *img,
+		     const char *what, const u8 *out, const u8 *expected)
+{
+	size_t i;
+
+	for (i = 0; i < p->vbitmap_size && out[i] == expected[i]; i++)
+		;
+	fprintf(stderr, "gfb-bench: %s %s %s%s %s: %s differs at byte %zu "
+		"(%02x, expected %02x)\n", p->name, c->name,
+		rotate_names[rotate], flip_names[flip], img->name, what, i,
+		out[i], expected[i]);
+	failures++;
+}
+
+/*
+ * Convert a random area of image b over the converted image a, with the
+ * rows aligned like gfb_convert_rect() does
+ */
+static void check_area(const struct gfb_panel *p, const struct gfb_converter *c,
+		       const struct gfb_orientation *o, int rotate, int flip,
+		       const struct image *a, const struct image *b,
+		       u8 *fb, u8 *out, u8 *expected)
+{
+	int xres = p->var.xres, yres = p->var.yres;
+	u32 seed = rotate * GFB_FLIPS + flip;
+	int x, y, w, h;
+
+	x = hash(seed, 1, 4) % xres;
+	w = 1 + hash(seed, 2, 4) % (xres - x);
+	y = hash(seed, 3, 4) % yres;
+	h = 1 + hash(seed, 4, 4) % (yres - y);
+
+	h = min(ALIGN(y + h, p->damage_rows), yres);
+	y = y / p->damage_rows * p->damage_rows;
+	h -= y;
+
+	memset(expected, 0, p->vbitmap_size);
+	reference(p, a, expected, 0, 0, xres, yres);
+	memcpy(out, expected, p->vbitmap_size);
+	reference(p, b, expected, x, y, w, h);
+
+	render(p, o, b, fb);
+	c->convert(p, o, fb, out, x, y, w, h);
+
+	if (memcmp(out, expected, p->vbitmap_size))
+		mismatch(p, c, rotate, flip, b, "area", out, expected);
+}
+
+static void bench_converter(const struct gfb_panel *p,
+			    const struct gfb_converter *c,
+			    u8 **expected, u8 *out)
+{
+	struct gfb_orientation o;
+	double start, ns;
+	u64 start_cycles, ncycles;
+	size_t frame_bytes;
+	u8 *fbs[MAX_IMAGES];
+	int rotate, flip, i, n;
+
+	for (rotate = FB_ROTATE_UR; rotate <= FB_ROTATE_CCW; rotate++) {
+		for (flip = 0; flip < GFB_FLIPS; flip++) {
+			if (native_only && (rotate || flip))
+				continue;
+
+			gfb_orientation_init(&o, p, rotate, flip);
+			frame_bytes = o.line_length * o.yres;
+
+			for (i = 0; i < nimages; i++) {
+				fbs[i] = malloc(frame_bytes);
+				if (fbs[i] == NULL) {
+					perror("gfb-bench");
+					exit(1);
+				}
+				render(p, &o, &images[i], fbs[i]);
+
+				memset(out, 0, p->vbitmap_size);
+				c->convert(p, &o, fbs[i], out, 0, 0,
+					   p->var.xres, p->var.yres);
+				if (memcmp(out, expected[i], p->vbitmap_size))
+					mismatch(p, c, rotate, flip,
+						 &images[i], "frame", out,
+						 expected[i]);
+			}
+
+			start = now_ns();
+			start_cycles = cycles();
+			for (n = 0; n < iterations; n++)
+				for (i = 0; i < nimages; i++)
+					c->convert(p, &o, fbs[i], out, 0, 0,
+						   p->var.xres, p->var.yres);
+			ncycles = cycles() - start_cycles;
+			ns = (now_ns() - start) / ((double)iterations * nimages);
+
+			printf("%-5s %-8s %-7s %10.0f %10.1f ", p->name,
+			       c->name, rotate_names[rotate], ns,
+			       frame_bytes / ns * 1e3);
+			if (ncycles)
+				printf("%9.2f", (double)ncycles /
+				       ((double)iterations * nimages *
+					p->var.xres * p->var.yres));
+			else
+				printf("%9s", "n/a");
+			printf("  %s\n", flip_names[flip][0] ?
+			       flip_names[flip] + 1 : "");
+
+			check_area(p, c, &o, rotate, flip, &images[0],
+				   &images[nimages - 1], fbs[0], out,
+				   out + p->vbitmap_size);
+
+			for (i = 0; i < nimages; i++)
+				free(fbs[i]);
+		}
+	}
+}
+
+static void bench_truecolor(void)
+{
+	const struct fb_var_screeninfo *var = &bench_panels[1].var;
+	static const struct {
+		unsigned red, green, blue;
+		u32 v;
+	} cases[] = {
+		{ 0xffff, 0x0000, 0x0000, 0xf800 },
+		{ 0x0000, 0xffff, 0x0000, 0x07e0 },
+		{ 0x0000, 0x0000, 0xffff, 0x001f },
+		{ 0x8000, 0x8000, 0x8000, 0x7bef },
+		{ 0x0000, 0x0000, 0x0000, 0x0000 },
+	};
+	volatile u32 sink = 0;
+	double start, ns;
+	unsigned i, n = 1000000;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		u32 v = gfb_truecolor(var, cases[i].red, cases[i].green,
+				      cases[i].blue, 0);
+
+		if (v != cases[i].v) {
+			fprintf(stderr, "gfb-bench: truecolor %04x %04x %04x "
+				"is %04x, expected %04x\n", cases[i].red,
+				cases[i].green, cases[i].blue, v, cases[i].v);
+			failures++;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		sink += gfb_truecolor(var, i, i * 3, i * 7, 0);
+	ns = (now_ns() - start) / n;
+
+	printf("truecolor %.2f ns/entry\n", ns);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: gfb-bench [-p PANEL] [-c CONVERTER] [-n ITERATIONS] "
+		"[-N]\n"
+		"                 [-r FRAMES]... [-g DIR [-w]]\n"
+		"  -p  mono or qvga, default both\n"
+		"  -c  only this converter\n"
+		"  -n  passes over the frames per measurement, default 100\n"
+		"  -N  only the upright orientation\n"
+		"  -r  add the raw upright frames in FRAMES, needs -p\n"
+		"  -g  compare with the golden images in DIR\n"
+		"  -w  write the golden images instead\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *panel_name = NULL, *converter_name = NULL;
+	const char *recorded[MAX_IMAGES];
+	const struct gfb_converter *c;
+	const struct gfb_panel *p;
+	u8 *expected[MAX_IMAGES];
+	u8 *out;
+	int nrecorded = 0;
+	int opt, i, j;
+
+	while ((opt = getopt(argc, argv, "p:c:n:Nr:g:wh")) != -1) {
+		switch (opt) {
+		case 'p':
+			panel_name = optarg;
+			break;
+		case 'c':
+			converter_name = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0)
+				usage();
+			break;
+		case 'N':
+			native_only = 1;
+			break;
+		case 'r':
+			if (nrecorded == MAX_IMAGES)
+				usage();
+			recorded[nrecorded++] = optarg;
+			break;
+		case 'g':
+			golden_dir = optarg;
+			break;
+		case 'w':
+			write_golden = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || (write_golden && golden_dir == NULL) ||
+	    (nrecorded && panel_name == NULL))
+		usage();
+
+	printf("panel conv     orient    ns/frame       MB/s  cyc/pixel"
+	       "  flip\n");
+
+	for (i = 0; i < ARRAY_SIZE(bench_panels); i++) {
+		p = &bench_panels[i];
+		if (panel_name && strcmp(panel_name, p->name))
+			continue;
+
+		nimages = 0;
+		synthetic_images(p);
+		for (j = 0; j < nrecorded; j++)
+			if (recorded_images(p, recorded[j]))
+				return 1;
+
+		/* Two vbitmaps: converter output, and scratch for areas */
+		out = malloc(2 * p->vbitmap_size);
+		if (out == NULL) {
+			perror("gfb-bench");
+			return 1;
+		}
+
+		for (j = 0; j < nimages; j++) {
+			expected[j] = calloc(1, p->vbitmap_size);
+			if (expected[j] == NULL) {
+				perror("gfb-bench");
+				return 1;
+			}
+			reference(p, &images[j], expected[j], 0, 0,
+				  p->var.xres, p->var.yres);
+			if (golden_dir && golden(p, &images[j], expected[j]))
+				failures++;
+		}
+
+		for (c = p->converters; c->name; c++)
+			if (!converter_name || !strcmp(converter_name, c->name))
+				bench_converter(p, c, expected, out);
+
+		for (j = 0; j < nimages; j++) {
+			free(expected[j]);
+			free(images[j].pixels);
+		}
+		free(out);
+	}
+
+	if (!panel_name || !strcmp(panel_name, "qvga"))
+		bench_truecolor();
+
+	if (failures)
+		fprintf(stderr, "gfb-bench: %d mismatches\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,603 @@
+/*
+ * gfb.hpp - header-only client library for the gfb LCD panels
+ *
+ * Opens a panel framebuffer, draws into a private back buffer laid out
+ * like the framebuffer, tracks what was damaged and presents it:
+ *
+ *  - through /dev/fbqueueN when it can be opened: every present() queues
+ *    the frame with an optional present time, waits for a free slot first
+ *    so the client runs at the pace of the panel, and collects the
+ *    completion events (see hid-gfb-ioctl.h);
+ *  - otherwise by copying the damaged lines into the mmap of the
+ *    framebuffer, which the driver sends at its update rate.
+ *
+ *	gfb::Panel panel("/dev/fb1");
+ *	panel.clear(gfb::black);
+ *	panel.fill({ 10, 10, 100, 20 }, 0x3060c0);
+ *	panel.text(12, 16, "Hello", gfb::white);
+ *	panel.present();
+ *
+ * Colours are 0xRRGGBB. On monochrome panels (FB_VISUAL_MONO01) a colour
+ * sets the pixel, ie darkens it, when its luminance is below one half.
+ *
+ * Requires C++17. Errors are reported as std::system_error.
+ */
+
+#ifndef GFB_HPP_INCLUDED
+#define GFB_HPP_INCLUDED
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+
+#include "../hid-gfb-ioctl.h"
+
+namespace gfb {
+
+using Color = std::uint32_t;
+
+constexpr Color black = 0x000000;
+constexpr Color white = 0xffffff;
+
+struct Rect {
+	int x, y, w, h;
+
+	bool empty() const { return w <= 0 || h <= 0; }
+
+	Rect intersect(const Rect &o) const
+	{
+		int x1 = std::max(x, o.x), y1 = std::max(y, o.y);
+		int x2 = std::min(x + w, o.x + o.w);
+		int y2 = std::min(y + h, o.y + o.h);
+
+		return { x1, y1, x2 - x1, y2 - y1 };
+	}
+
+	Rect unite(const Rect &o) const
+	{
+		if (empty())
+			return o;
+		if (o.empty())
+			return *this;
+
+		int x1 = std::min(x, o.x), y1 = std::min(y, o.y);
+		int x2 = std::max(x + w, o.x + o.w);
+		int y2 = std::max(y + h, o.y + o.h);
+
+		return { x1, y1, x2 - x1, y2 - y1 };
+	}
+};
+
+enum class Format {
+	mono,		/* 1 bit per pixel, bit 0 leftmost, set is dark */
+	rgb565,
+};
+
+/* An image in the panel format, rows stride bytes apart */
+struct Image {
+	int width, height;
+	std::size_t stride;
+	const std::uint8_t *pixels;
+};
+
+/*
+ * A bitmap font of up to 8 rows, stored column by column: one byte per
+ * glyph column, bit 0 at the top
+ */
+struct Font {
+	int width, height;	/* cell size, including spacing */
+	int glyph_width;	/* columns stored per glyph */
+	char first, last;
+	const std::uint8_t *columns;
+};
+
+namespace detail {
+
+/* The classic 5x7 font with descenders, printable ASCII */
+inline constexpr std::uint8_t font_5x8[] = {
+	0x00, 0x00, 0x00, 0x00, 0x00,	/* ' ' */
+	0x00, 0x00, 0x5f, 0x00, 0x00,	/* '!' */
+	0x00, 0x07, 0x00, 0x07, 0x00,	/* '"' */
+	0x14, 0x7f, 0x14, 0x7f, 0x14,	/* '#' */
+	0x24, 0x2a, 0x7f, 0x2a, 0x12,	/* '$' */
+	0x23, 0x13, 0x08, 0x64, 0x62,	/* '%' */
+	0x36, 0x49, 0x56, 0x20, 0x50,	/* '&' */
+	0x00, 0x05, 0x03, 0x00, 0x00,	/* ''' */
+	0x00, 0x1c, 0x22, 0x41, 0x00,	/* '(' */
+	0x00, 0x41, 0x22, 0x1c, 0x00,	/* ')' */
+	0x2a, 0x1c, 0x7f, 0x1c, 0x2a,	/* '*' */
+	0x08, 0x08, 0x3e, 0x08, 0x08,	/* '+' */
+	0x00, 0x80, 0x70, 0x30, 0x00,	/* ',' */
+	0x08, 0x08, 0x08, 0x08, 0x08,	/* '-' */
+	0x00, 0x00, 0x60, 0x60, 0x00,	/* '.' */
+	0x20, 0x10, 0x08, 0x04, 0x02,	/* '/' */
+	0x3e, 0x51, 0x49, 0x45, 0x3e,	/* '0' */
+	0x00, 0x42, 0x7f, 0x40, 0x00,	/* '1' */
+	0x42, 0x61, 0x51, 0x49, 0x46,	/* '2' */
+	0x21, 0x41, 0x45, 0x4b, 0x31,	/* '3' */
+	0x18, 0x14, 0x12, 0x7f, 0x10,	/* '4' */
+	0x27, 0x45, 0x45, 0x45, 0x39,	/* '5' */
+	0x3c, 0x4a, 0x49, 0x49, 0x30,	/* '6' */
+	0x01, 0x71, 0x09, 0x05, 0x03,	/* '7' */
+	0x36, 0x49, 0x49, 0x49, 0x36,	/* '8' */
+	0x06, 0x49, 0x49, 0x29, 0x1e,	/* '9' */
+	0x00, 0x36, 0x36, 0x00, 0x00,	/* ':' */
+	0x00, 0x56, 0x36, 0x00, 0x00,	/* ';' */
+	0x08, 0x14, 0x22, 0x41, 0x00,	/* '<' */
+	0x14, 0x14, 0x14, 0x14, 0x14,	/* '=' */
+	0x00, 0x41, 0x22, 0x14, 0x08,	/* '>' */
+	0x02, 0x01, 0x51, 0x09, 0x06,	/* '?' */
+	0x32, 0x49, 0x79, 0x41, 0x3e,	/* '@' */
+	0x7e, 0x11, 0x11, 0x11, 0x7e,	/* 'A' */
+	0x7f, 0x49, 0x49, 0x49, 0x36,	/* 'B' */
+	0x3e, 0x41, 0x41, 0x41, 0x22,	/* 'C' */
+	0x7f, 0x41, 0x41, 0x22, 0x1c,	/* 'D' */
+	0x7f, 0x49, 0x49, 0x49, 0x41,	/* 'E' */
+	0x7f, 0x09, 0x09, 0x09, 0x01,	/* 'F' */
+	0x3e, 0x41, 0x49, 0x49, 0x7a,	/* 'G' */
+	0x7f, 0x08, 0x08, 0x08, 0x7f,	/* 'H' */
+	0x00, 0x41, 0x7f, 0x41, 0x00,	/* 'I' */
+	0x20, 0x40, 0x41, 0x3f, 0x01,	/* 'J' */
+	0x7f, 0x08, 0x14, 0x22, 0x41,	/* 'K' */
+	0x7f, 0x40, 0x40, 0x40, 0x40,	/* 'L' */
+	0x7f, 0x02, 0x0c, 0x02, 0x7f,	/* 'M' */
+	0x7f, 0x04, 0x08, 0x10, 0x7f,	/* 'N' */
+	0x3e, 0x41, 0x41, 0x41, 0x3e,	/* 'O' */
+	0x7f, 0x09, 0x09, 0x09, 0x06,	/* 'P' */
+	0x3e, 0x41, 0x51, 0x21, 0x5e,	/* 'Q' */
+	0x7f, 0x09, 0x19, 0x29, 0x46,	/* 'R' */
+	0x46, 0x49, 0x49, 0x49, 0x31,	/* 'S' */
+	0x01, 0x01, 0x7f, 0x01, 0x01,	/* 'T' */
+	0x3f, 0x40, 0x40, 0x40, 0x3f,	/* 'U' */
+	0x1f, 0x20, 0x40, 0x20, 0x1f,	/* 'V' */
+	0x3f, 0x40, 0x38, 0x40, 0x3f,	/* 'W' */
+	0x63, 0x14, 0x08, 0x14, 0x63,	/* 'X' */
+	0x07, 0x08, 0x70, 0x08, 0x07,	/* 'Y' */
+	0x61, 0x51, 0x49, 0x45, 0x43,	/* 'Z' */
+	0x00, 0x7f, 0x41, 0x41, 0x00,	/* '[' */
+	0x02, 0x04, 0x08, 0x10, 0x20,	/* '\' */
+	0x00, 0x41, 0x41, 0x7f, 0x00,	/* ']' */
+	0x04, 0x02, 0x01, 0x02, 0x04,	/* '^' */
+	0x40, 0x40, 0x40, 0x40, 0x40,	/* '_' */
+	0x00, 0x01, 0x02, 0x04, 0x00,	/* '`' */
+	0x20, 0x54, 0x54, 0x54, 0x78,	/* 'a' */
+	0x7f, 0x48, 0x44, 0x44, 0x38,	/* 'b' */
+	0x38, 0x44, 0x44, 0x44, 0x20,	/* 'c' */
+	0x38, 0x44, 0x44, 0x48, 0x7f,	/* 'd' */
+	0x38, 0x54, 0x54, 0x54, 0x18,	/* 'e' */
+	0x08, 0x7e, 0x09, 0x01, 0x02,	/* 'f' */
+	0x18, 0xa4, 0xa4, 0xa4, 0x7c,	/* 'g' */
+	0x7f, 0x08, 0x04, 0x04, 0x78,	/* 'h' */
+	0x00, 0x44, 0x7d, 0x40, 0x00,	/* 'i' */
+	0x40, 0x80, 0x84, 0x7d, 0x00,	/* 'j' */
+	0x7f, 0x10, 0x28, 0x44, 0x00,	/* 'k' */
+	0x00, 0x41, 0x7f, 0x40, 0x00,	/* 'l' */
+	0x7c, 0x04, 0x18, 0x04, 0x78,	/* 'm' */
+	0x7c, 0x08, 0x04, 0x04, 0x78,	/* 'n' */
+	0x38, 0x44, 0x44, 0x44, 0x38,	/* 'o' */
+	0xfc, 0x24, 0x24, 0x24, 0x18,	/* 'p' */
+	0x18, 0x24, 0x24, 0x28, 0xfc,	/* 'q' */
+	0x7c, 0x08, 0x04, 0x04, 0x08,	/* 'r' */
+	0x48, 0x54, 0x54, 0x54, 0x20,	/* 's' */
+	0x04, 0x3f, 0x44, 0x40, 0x20,	/* 't' */
+	0x3c, 0x40, 0x40, 0x20, 0x7c,	/* 'u' */
+	0x1c, 0x20, 0x40, 0x20, 0x1c,	/* 'v' */
+	0x3c, 0x40, 0x30, 0x40, 0x3c,	/* 'w' */
+	0x44, 0x28, 0x10, 0x28, 0x44,	/* 'x' */
+	0x1c, 0xa0, 0xa0, 0xa0, 0x7c,	/* 'y' */
+	0x44, 0x64, 0x54, 0x4c, 0x44,	/* 'z' */
+	0x00, 0x08, 0x36, 0x41, 0x00,	/* '{' */
+	0x00, 0x00, 0x7f, 0x00, 0x00,	/* '|' */
+	0x00, 0x41, 0x36, 0x08, 0x00,	/* '}' */
+	0x08, 0x04, 0x08, 0x10, 0x08,	/* '~' */
+};
+
+[[noreturn]] inline void fail(const std::string &what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+} /* namespace detail */
+
+inline constexpr Font default_font = {
+	6, 8, 5, ' ', '~', detail::font_5x8
+};
+
+class Panel {
+public:
+	/* Open fbdev, a gfb framebuffer such as /dev/fb1 */
+	explicit Panel(const std::string &fbdev)
+	{
+		struct stat st;
+
+		fd_ = ::open(fbdev.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd_ < 0)
+			detail::fail("open " + fbdev);
+
+		try {
+			if (ioctl(fd_, FBIOGET_VSCREENINFO, &var_) < 0 ||
+			    ioctl(fd_, FBIOGET_FSCREENINFO, &fix_) < 0)
+				detail::fail("fb screeninfo");
+
+			if (std::strncmp(fix_.id, "GFB_", 4) != 0) {
+				errno = ENODEV;
+				detail::fail(fbdev + " is not a gfb panel");
+			}
+
+			if (var_.bits_per_pixel == 1) {
+				format_ = Format::mono;
+			} else if (var_.bits_per_pixel == 16) {
+				format_ = Format::rgb565;
+			} else {
+				errno = EINVAL;
+				detail::fail("unsupported pixel format");
+			}
+
+			size_ = std::size_t(fix_.line_length) * var_.yres;
+			back_.assign(size_, 0);
+
+			/* The frame queue of fbN is fbqueueN */
+			if (fstat(fd_, &st) == 0)
+				queue_fd_ = ::open(("/dev/fbqueue" +
+					std::to_string(minor(st.st_rdev))).c_str(),
+					O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+			if (queue_fd_ < 0) {
+				map_ = static_cast<std::uint8_t *>(
+					mmap(nullptr, fix_.smem_len,
+					     PROT_READ | PROT_WRITE, MAP_SHARED,
+					     fd_, 0));
+				if (map_ == MAP_FAILED) {
+					map_ = nullptr;
+					detail::fail("mmap");
+				}
+				/* Start from what is shown */
+				std::memcpy(back_.data(), map_, size_);
+			}
+		} catch (...) {
+			close();
+			throw;
+		}
+	}
+
+	~Panel()
+	{
+		close();
+	}
+
+	Panel(const Panel &) = delete;
+	Panel &operator=(const Panel &) = delete;
+
+	int width() const { return var_.xres; }
+	int height() const { return var_.yres; }
+	Format format() const { return format_; }
+	std::size_t stride() const { return fix_.line_length; }
+	Rect bounds() const { return { 0, 0, width(), height() }; }
+
+	/* True when frames go through the frame queue */
+	bool queued() const { return queue_fd_ >= 0; }
+
+	/* The back buffer, in the framebuffer format */
+	std::uint8_t *pixels() { return back_.data(); }
+
+	/* Mark an area changed after drawing into pixels() directly */
+	void damage(const Rect &r)
+	{
+		damage_ = damage_.unite(r.intersect(bounds()));
+	}
+
+	const Rect &damaged() const { return damage_; }
+
+	/* Panel pixel value of a colour */
+	std::uint16_t pixel(Color c) const
+	{
+		unsigned r = (c >> 16) & 0xff;
+		unsigned g = (c >> 8) & 0xff;
+		unsigned b = c & 0xff;
+
+		if (format_ == Format::mono)
+			return (r * 77 + g * 150 + b * 29) < 128 * 256;
+
+		return (r >> 3) << 11 | (g >> 2) << 5 | (b >> 3);
+	}
+
+	void clear(Color c)
+	{
+		fill(bounds(), c);
+	}
+
+	void fill(Rect r, Color c)
+	{
+		r = r.intersect(bounds());
+		if (r.empty())
+			return;
+
+		if (format_ == Format::mono)
+			fill_mono(r, pixel(c));
+		else
+			fill_rgb565(r, pixel(c));
+
+		damage(r);
+	}
+
+	/* Copy an image in the panel format with its top left at x,y */
+	void blit(int x, int y, const Image &img)
+	{
+		Rect r = Rect{ x, y, img.width, img.height }.intersect(bounds());
+		if (r.empty())
+			return;
+
+		int sx = r.x - x, sy = r.y - y;
+
+		for (int row = 0; row < r.h; row++) {
+			const std::uint8_t *src = img.pixels +
+				(sy + row) * img.stride;
+			std::uint8_t *dst = line(r.y + row);
+
+			if (format_ == Format::rgb565)
+				std::memcpy(dst + r.x * 2, src + sx * 2,
+					    r.w * 2);
+			else
+				copy_bits(dst, r.x, src, sx, r.w);
+		}
+
+		damage(r);
+	}
+
+	/* Draw s with the top left of its first cell at x,y */
+	void text(int x, int y, std::string_view s, Color fg,
+		  const Font &font = default_font)
+	{
+		std::uint16_t value = pixel(fg);
+		Rect area{ x, y, int(s.size()) * font.width, font.height };
+
+		for (char ch : s) {
+			if (ch < font.first || ch > font.last)
+				ch = '?';
+			glyph(x, y, font.columns +
+			      (ch - font.first) * font.glyph_width,
+			      font.glyph_width, font.height, value);
+			x += font.width;
+		}
+
+		damage(area);
+	}
+
+	int text_width(std::string_view s, const Font &font = default_font) const
+	{
+		return int(s.size()) * font.width;
+	}
+
+	/*
+	 * Send the damaged area. With the frame queue, waits until a slot is
+	 * free, then queues the whole frame to be shown no earlier than
+	 * present_ns (CLOCK_MONOTONIC, 0 for now). Returns false if nothing
+	 * was damaged.
+	 */
+	bool present(std::uint64_t present_ns = 0)
+	{
+		if (damage_.empty())
+			return false;
+
+		if (queued()) {
+			wait(POLLOUT);
+
+			gfb_queue_frame frame = {};
+			frame.frame = reinterpret_cast<std::uintptr_t>(back_.data());
+			frame.present_ns = present_ns;
+			frame.cookie = ++submitted_;
+
+			while (ioctl(queue_fd_, GFB_IOC_QUEUE_SUBMIT, &frame) < 0) {
+				if (errno != EAGAIN)
+					detail::fail("GFB_IOC_QUEUE_SUBMIT");
+				wait(POLLOUT);
+			}
+		} else {
+			int x1 = damage_.x, x2 = damage_.x + damage_.w;
+			std::size_t from, len;
+
+			if (format_ == Format::mono) {
+				from = x1 / 8;
+				len = (x2 + 7) / 8 - from;
+			} else {
+				from = x1 * 2;
+				len = (x2 - x1) * 2;
+			}
+
+			/* Touching the pages is what makes the driver update */
+			for (int y = damage_.y; y < damage_.y + damage_.h; y++)
+				std::memcpy(map_ + y * stride() + from,
+					    line(y) + from, len);
+		}
+
+		damage_ = {};
+		return true;
+	}
+
+	/*
+	 * Wait until every frame queued so far was shown or dropped. Returns
+	 * the event of the last one, or a zeroed event without the queue.
+	 */
+	gfb_queue_event finish()
+	{
+		while (queued() && completed_ != submitted_) {
+			wait(POLLIN);
+			collect();
+		}
+		return last_;
+	}
+
+	/* Frames dropped by the driver so far */
+	std::uint64_t dropped() const { return dropped_; }
+
+	/* Descriptor to poll for POLLOUT before presenting, -1 without queue */
+	int queue_fd() const { return queue_fd_; }
+
+	/* Read the completion events available */
+	void collect()
+	{
+		gfb_queue_event events[GFB_QUEUE_SLOTS];
+		ssize_t len;
+
+		while ((len = ::read(queue_fd_, events, sizeof(events))) > 0) {
+			for (std::size_t i = 0;
+			     i < std::size_t(len) / sizeof(events[0]); i++) {
+				if (events[i].status == GFB_QUEUE_DROPPED)
+					dropped_++;
+				last_ = events[i];
+				completed_++;
+			}
+		}
+		if (len < 0 && errno != EAGAIN)
+			detail::fail("read fbqueue");
+	}
+
+private:
+	std::uint8_t *line(int y)
+	{
+		return back_.data() + y * stride();
+	}
+
+	void wait(short events)
+	{
+		pollfd pfd = { queue_fd_, events, 0 };
+
+		for (;;) {
+			if (events == POLLOUT)
+				collect();
+			if (poll(&pfd, 1, -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				detail::fail("poll fbqueue");
+			}
+			if (pfd.revents & POLLHUP) {
+				errno = ENODEV;
+				detail::fail("fbqueue");
+			}
+			if (pfd.revents & events)
+				return;
+		}
+	}
+
+	void fill_rgb565(const Rect &r, std::uint16_t value)
+	{
+		/* Plain loops over whole lines, which compilers vectorize */
+		for (int y = r.y; y < r.y + r.h; y++) {
+			std::uint16_t *p =
+				reinterpret_cast<std::uint16_t *>(line(y)) + r.x;
+			std::fill_n(p, r.w, value);
+		}
+	}
+
+	void fill_mono(const Rect &r, bool set)
+	{
+		int x1 = r.x, x2 = r.x + r.w;	/* x2 exclusive */
+		int b1 = x1 / 8, b2 = (x2 - 1) / 8;
+		std::uint8_t head = 0xff << (x1 % 8);
+		std::uint8_t tail = 0xff >> (7 - (x2 - 1) % 8);
+
+		if (b1 == b2)
+			head = tail = head & tail;
+
+		for (int y = r.y; y < r.y + r.h; y++) {
+			std::uint8_t *p = line(y);
+
+			p[b1] = set ? p[b1] | head : p[b1] & ~head;
+			if (b2 > b1) {
+				std::memset(p + b1 + 1, set ? 0xff : 0x00,
+					    b2 - b1 - 1);
+				p[b2] = set ? p[b2] | tail : p[b2] & ~tail;
+			}
+		}
+	}
+
+	/* Copy w bits from bit sx of src to bit dx of dst, bit 0 leftmost */
+	static void copy_bits(std::uint8_t *dst, int dx, const std::uint8_t *src,
+			      int sx, int w)
+	{
+		if (dx % 8 == 0 && sx % 8 == 0) {
+			std::memcpy(dst + dx / 8, src + sx / 8, w / 8);
+			dx += w & ~7;
+			sx += w & ~7;
+			w &= 7;
+		}
+
+		for (int i = 0; i < w; i++, dx++, sx++) {
+			std::uint8_t mask = 1 << (dx % 8);
+
+			if (src[sx / 8] & (1 << (sx % 8)))
+				dst[dx / 8] |= mask;
+			else
+				dst[dx / 8] &= ~mask;
+		}
+	}
+
+	void glyph(int x, int y, const std::uint8_t *columns, int w, int h,
+		   std::uint16_t value)
+	{
+		Rect cell = Rect{ x, y, w, h }.intersect(bounds());
+
+		for (int row = cell.y; row < cell.y + cell.h; row++) {
+			std::uint8_t bit = 1 << (row - y);
+			std::uint8_t *p = line(row);
+
+			for (int col = cell.x; col < cell.x + cell.w; col++) {
+				if (!(columns[col - x] & bit))
+					continue;
+				if (format_ == Format::rgb565)
+					reinterpret_cast<std::uint16_t *>(p)[col] =
+						value;
+				else if (value)
+					p[col / 8] |= 1 << (col % 8);
+				else
+					p[col / 8] &= ~(1 << (col % 8));
+			}
+		}
+	}
+
+	void close()
+	{
+		if (map_)
+			munmap(map_, fix_.smem_len);
+		if (queue_fd_ >= 0)
+			::close(queue_fd_);
+		if (fd_ >= 0)
+			::close(fd_);
+		map_ = nullptr;
+		queue_fd_ = fd_ = -1;
+	}
+
+	int fd_ = -1;
+	int queue_fd_ = -1;
+	fb_var_screeninfo var_ = {};
+	fb_fix_screeninfo fix_ = {};
+	Format format_ = Format::rgb565;
+	std::size_t size_ = 0;
+	std::vector<std::uint8_t> back_;
+	std::uint8_t *map_ = nullptr;
+	Rect damage_ = {};
+
+	std::uint64_t submitted_ = 0;
+	std::uint64_t completed_ = 0;
+	std::uint64_t dropped_ = 0;
+	gfb_queue_event last_ = {};
+};
+
+} /* namespace gfb */
+
+#endif